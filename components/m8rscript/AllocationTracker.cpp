@@ -0,0 +1,114 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "AllocationTracker.h"
+
+#include "ExecutionUnit.h"
+#include <algorithm>
+
+using namespace m8rscript;
+using namespace m8r;
+
+bool AllocationTracker::_tracking = false;
+const ExecutionUnit* AllocationTracker::_executionUnit = nullptr;
+Vector<AllocationTracker::Site> AllocationTracker::_sites;
+Map<AllocationTracker::SiteKey, uint32_t> AllocationTracker::_siteIndexes;
+Map<const void*, AllocationTracker::Block> AllocationTracker::_blocks;
+
+bool AllocationTracker::SiteKey::operator<(const SiteKey& other) const
+{
+    if (_program != other._program) {
+        return _program < other._program;
+    }
+    if (_name != other._name) {
+        return _name < other._name;
+    }
+    if (_isProgram != other._isProgram) {
+        return _isProgram < other._isProgram;
+    }
+    if (_lineno != other._lineno) {
+        return _lineno < other._lineno;
+    }
+    return _type < other._type;
+}
+
+bool AllocationTracker::SiteKey::operator==(const SiteKey& other) const
+{
+    return _program == other._program && _name == other._name && _isProgram == other._isProgram &&
+           _lineno == other._lineno && _type == other._type;
+}
+
+void AllocationTracker::clear()
+{
+    _sites.clear();
+    _siteIndexes.clear();
+    _blocks.clear();
+}
+
+void AllocationTracker::stop()
+{
+    // Frees aren't followed any more, so the blocks would only use memory
+    _tracking = false;
+    _blocks = Map<const void*, Block>();
+}
+
+void AllocationTracker::addBlock(const void* block, MemoryType type, uint32_t size)
+{
+    Mad<Program> program = _executionUnit->program();
+    Mad<Callable> function = _executionUnit->currentFunction();
+    if (!program.valid() || !function.valid()) {
+        return;
+    }
+    
+    SiteKey key { program.get(), function->name(), function == program, _executionUnit->lineno(), type };
+    auto it = _siteIndexes.find(key);
+    uint32_t index;
+    if (it == _siteIndexes.end()) {
+        // The name is looked up now, while the Program that owns its atom is known to be alive
+        index = static_cast<uint32_t>(_sites.size());
+        String name = key._isProgram ? String("<main>") : (key._name ? String(program->stringFromAtom(key._name)) : String("<anonymous>"));
+        _sites.push_back({ name, type, key._lineno, 0, 0, 0, 0 });
+        _siteIndexes.emplace(key, index);
+    } else {
+        index = it->value;
+    }
+    
+    Site& site = _sites[index];
+    site._liveCount++;
+    site._liveBytes += size;
+    site._totalCount++;
+    site._totalBytes += size;
+    _blocks.emplace(block, { index, size });
+}
+
+void AllocationTracker::removeBlock(const void* block)
+{
+    auto it = _blocks.find(block);
+    if (it == _blocks.end()) {
+        return;
+    }
+    
+    Site& site = _sites[it->value._site];
+    site._liveCount--;
+    site._liveBytes -= it->value._size;
+    _blocks.erase(it);
+}
+
+Vector<AllocationTracker::Site> AllocationTracker::topSites(uint32_t n)
+{
+    // Return copies. Reporting them allocates, which can add sites
+    Vector<Site> sites = _sites;
+    std::sort(sites.begin(), sites.end(), [](const Site& a, const Site& b) {
+        return (a._liveBytes != b._liveBytes) ? (a._liveBytes > b._liveBytes) : (a._totalBytes > b._totalBytes);
+    });
+    if (sites.size() > n) {
+        sites.resize(n);
+    }
+    return sites;
+}
@@ -0,0 +1,103 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Containers.h"
+#include "Mallocator.h"
+
+namespace m8rscript {
+
+class ExecutionUnit;
+
+// AllocationTracker - Attributes script heap use to the line that allocated it
+//
+// When tracking is on, each Object, String and UpValue created while an
+// ExecutionUnit is running is charged to a site: the function and line being
+// executed and the type of memory. The GC reports each block it frees, so every
+// site keeps both the total it has allocated and what is still live. Blocks
+// allocated before tracking started are not known and are ignored when freed.
+//
+// This is a diagnostic mode. Each allocation and free does a lookup in a sorted
+// map, so it is much slower than normal running. Stopping drops the map of
+// blocks but keeps the sites for meminfo(), so after that each allocation and
+// free costs one test of a flag. The live counts then stay as they were when
+// tracking stopped.
+class AllocationTracker {
+public:
+    struct Site {
+        m8r::String _name;
+        m8r::MemoryType _type;
+        uint32_t _lineno;
+        uint32_t _liveCount;
+        uint32_t _liveBytes;
+        uint32_t _totalCount;
+        uint32_t _totalBytes;
+    };
+
+    static void start() { _tracking = true; }
+    static void stop();
+    static void clear();
+    static bool tracking() { return _tracking; }
+
+    // Allocations are charged to the current function and line of the running unit
+    class Scope {
+    public:
+        Scope(const ExecutionUnit* eu) : _prev(_executionUnit) { _executionUnit = eu; }
+        ~Scope() { _executionUnit = _prev; }
+
+    private:
+        const ExecutionUnit* _prev;
+    };
+
+    static void allocated(const void* block, m8r::MemoryType type, uint32_t size)
+    {
+        if (_tracking && _executionUnit) {
+            addBlock(block, type, size);
+        }
+    }
+
+    static void freed(const void* block)
+    {
+        if (_tracking) {
+            removeBlock(block);
+        }
+    }
+
+    // Returns at most n sites, the ones with the most live bytes first
+    static m8r::Vector<Site> topSites(uint32_t n);
+
+private:
+    struct SiteKey {
+        bool operator<(const SiteKey& other) const;
+        bool operator==(const SiteKey& other) const;
+
+        const void* _program;
+        m8r::Atom _name;
+        bool _isProgram;
+        uint32_t _lineno;
+        m8r::MemoryType _type;
+    };
+
+    struct Block {
+        uint32_t _site;
+        uint32_t _size;
+    };
+
+    static void addBlock(const void* block, m8r::MemoryType, uint32_t size);
+    static void removeBlock(const void* block);
+
+    static bool _tracking;
+    static const ExecutionUnit* _executionUnit;
+    static m8r::Vector<Site> _sites;
+    static m8r::Map<SiteKey, uint32_t> _siteIndexes;
+    static m8r::Map<const void*, Block> _blocks;
+};
+
+}
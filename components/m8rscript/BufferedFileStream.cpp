@@ -0,0 +1,72 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "BufferedFileStream.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace m8rscript;
+using namespace m8r;
+
+BufferedFileStream::~BufferedFileStream()
+{
+    if (_buffer.valid()) {
+        _buffer.destroy();
+    }
+}
+
+bool BufferedFileStream::fill() const
+{
+    if (_atEnd || !_file.valid()) {
+        return false;
+    }
+    
+    if (!_buffer.valid()) {
+        _buffer = Mad<char>::create(BufferSize);
+    }
+    
+    int32_t size = _file->read(_buffer.get(), BufferSize);
+    if (size <= 0) {
+        _atEnd = true;
+        return false;
+    }
+    
+    _next = _buffer.get();
+    _end = _next + size;
+    return true;
+}
+
+int32_t BufferedFileStream::read(char* buf, uint32_t size) const
+{
+    uint32_t count = 0;
+    while (count < size) {
+        if (_next >= _end) {
+            // Reads of a block or more go straight into buf
+            if (size - count >= BufferSize && !_atEnd && _file.valid()) {
+                int32_t result = _file->read(buf + count, size - count);
+                if (result <= 0) {
+                    _atEnd = true;
+                    break;
+                }
+                count += result;
+                continue;
+            }
+            if (!fill()) {
+                break;
+            }
+        }
+        
+        uint32_t chunk = std::min(size - count, static_cast<uint32_t>(_end - _next));
+        memcpy(buf + count, _next, chunk);
+        _next += chunk;
+        count += chunk;
+    }
+    return count;
+}
@@ -0,0 +1,60 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "FileStream.h"
+
+namespace m8rscript {
+
+// BufferedFileStream - Read only Stream of a File, read a block at a time
+//
+// The Scanner reads its source one character at a time. FileStream passes
+// each of those to the File, which is a call into the file system. This reads
+// BufferSize bytes at once and hands them out from memory, so compiling a
+// script makes one file system call per block. A block is 4 SPIFFS pages,
+// enough for most imports in one or two calls. The buffer is on the heap
+// because imports run deep in the unit's stack. The File is not owned.
+//
+// Callers which want more than a character at a time use read(buf, size),
+// which skips the virtual call per character.
+class BufferedFileStream : public m8r::Stream {
+public:
+    BufferedFileStream(m8r::Mad<m8r::File> file) : _file(file) { }
+    virtual ~BufferedFileStream();
+
+    virtual bool eof() const override { return _next >= _end && !fill(); }
+
+    virtual int read() const override
+    {
+        if (_next >= _end && !fill()) {
+            return -1;
+        }
+        return static_cast<uint8_t>(*_next++);
+    }
+
+    virtual int write(uint8_t) override { return -1; }
+    
+    // Reads up to size bytes into buf. Returns the number read, which is
+    // only less than size at the end of the File
+    int32_t read(char* buf, uint32_t size) const;
+
+private:
+    static constexpr uint32_t BufferSize = 1024;
+
+    bool fill() const;
+
+    m8r::Mad<m8r::File> _file;
+    mutable m8r::Mad<char> _buffer;
+    mutable const char* _next = nullptr;
+    mutable const char* _end = nullptr;
+    mutable bool _atEnd = false;
+};
+
+}
@@ -10,6 +10,7 @@
 #include "Closure.h"
 
 #include "ExecutionUnit.h"
+#include "HeapSnapshot.h"
 
 using namespace m8rscript;
 using namespace m8r;
@@ -25,8 +26,6 @@ void Closure::init(ExecutionUnit* eu, const Value& function, const Value& thisVa
     assert(_func.valid());
 
     for (uint32_t i = 0; i < _func->upValueCount(); ++i) {
-        SharedPtr<UpValue> up(new UpValue());
-
         uint32_t index;
         uint16_t frame;
         Atom name;
@@ -34,23 +33,53 @@ void Closure::init(ExecutionUnit* eu, const Value& function, const Value& thisVa
             continue;
         }
         
-        up->setStackIndex(eu->upValueStackIndex(index, frame - 1));
-        eu->addOpenUpValue(up);
-        _upValues.push_back(up);
+        SharedPtr<UpValue> up = eu->openUpValue(eu->upValueStackIndex(index, frame - 1));
+        if (_upValueCount < InlineUpValues) {
+            _inlineUpValues[_upValueCount] = up;
+        } else {
+            _moreUpValues.push_back(up);
+        }
+        ++_upValueCount;
     }
 }
 
 bool Closure::loadUpValue(ExecutionUnit* eu, uint32_t index, Value& value) const
 {
-    assert(index < _upValues.size() && _upValues.size() == _func->upValueCount());
-    if (_upValues[index]->closed()) {
-        value = _upValues[index]->value();
+    assert(index < _upValueCount && _upValueCount == _func->upValueCount());
+    const SharedPtr<UpValue>& up = upValue(index);
+    if (up->closed()) {
+        value = up->value();
     } else {
-        value = eu->stack().at(_upValues[index]->stackIndex());
+        value = eu->stack().at(up->stackIndex());
     }
     return true;
 }
 
+void Closure::heapSnapshot(HeapSnapshot& snapshot) const
+{
+    Object::heapSnapshot(snapshot);
+    snapshot.setType("Closure", sizeof(Closure));
+    
+    // UpValues are shared by the closures made in the same frame, so they
+    // aren't counted here. Charging each one to every closure holding it
+    // would count it more than once in retained sizes
+    snapshot.addSize(static_cast<uint32_t>(_moreUpValues.size() * sizeof(SharedPtr<UpValue>)));
+    snapshot.addEdge(HeapSnapshot::Edge::Function, Value(_func));
+    snapshot.addEdge(HeapSnapshot::Edge::This, _thisValue);
+    
+    // Open UpValues refer to the stack, which is a root
+    for (uint32_t i = 0; i < _upValueCount; ++i) {
+        if (!upValue(i)->closed()) {
+            continue;
+        }
+        uint32_t index;
+        uint16_t frame;
+        Atom name;
+        _func->upValue(i, index, frame, name);
+        snapshot.addEdge(HeapSnapshot::Edge::UpValue, name, upValue(i)->value());
+    }
+}
+
 CallReturnValue Closure::call(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
 {
     if (_thisValue) {
@@ -60,13 +89,52 @@ CallReturnValue Closure::call(ExecutionUnit* eu, Value thisValue, uint32_t npara
     return CallReturnValue(CallReturnValue::Type::FunctionStart);
 }
 
-bool UpValue::closeIfNeeded(ExecutionUnit* eu, uint32_t frame)
+void UpValue::close(ExecutionUnit* eu)
 {
     assert(!closed());
-    if (stackIndex() >= frame) {
-        value() = eu->stack().at(stackIndex());
-        setClosed(true);
-        return true;
+    value() = eu->stack().at(stackIndex());
+    setClosed(true);
+}
+
+// Freed UpValues are kept for reuse. They are all the same size and closures
+// are made and dropped often, so this avoids going to the heap each time.
+// Past MaxFree they go back to the heap, so a burst of closures doesn't keep
+// its memory from everything else
+struct FreeUpValue {
+    FreeUpValue* _next;
+};
+
+static FreeUpValue* _freeUpValues = nullptr;
+static uint32_t _freeUpValueCount = 0;
+
+void* UpValue::operator new(size_t size)
+{
+    assert(size == sizeof(UpValue));
+    void* p;
+    if (_freeUpValues) {
+        FreeUpValue* entry = _freeUpValues;
+        _freeUpValues = entry->_next;
+        --_freeUpValueCount;
+        p = entry;
+    } else {
+        p = ::operator new(size);
+    }
+    AllocationTracker::allocated(p, MemoryType::UpValue, static_cast<uint32_t>(size));
+    return p;
+}
+
+void UpValue::operator delete(void* p)
+{
+    if (!p) {
+        return;
+    }
+    AllocationTracker::freed(p);
+    if (_freeUpValueCount >= MaxFree) {
+        ::operator delete(p);
+        return;
     }
-    return false;
+    FreeUpValue* entry = static_cast<FreeUpValue*>(p);
+    entry->_next = _freeUpValues;
+    _freeUpValues = entry;
+    ++_freeUpValueCount;
 }
@@ -14,13 +14,22 @@
 
 namespace m8rscript {
 
+// UpValue - A variable captured by a Closure
+//
+// While open it refers to a slot on the ExecutionUnit stack. Open UpValues
+// are kept in a list, sorted by stack index with the highest first. Closures
+// capturing the same slot share the same UpValue. When a frame is left, the
+// UpValues at the head of the list that point into it are closed, which
+// copies the value out of the stack. UpValues are allocated from a free list,
+// which keeps at most MaxFree of them.
 class UpValue : public m8r::Shared {
 public:
-    UpValue()
+    UpValue(uint32_t stackIndex)
         : _closed(false)
         , _marked(true)
         , _destroyed(false)
     {
+        setStackIndex(stackIndex);
     }
 
     ~UpValue()
@@ -39,12 +48,21 @@ public:
     Value& value() { return _value; }
     const Value& value() const { return _value; }
     
-    bool closeIfNeeded(ExecutionUnit*, uint32_t frame);
+    void close(ExecutionUnit*);
     
     uint32_t stackIndex() const { return static_cast<uint32_t>(_value.asIntValue()); }
     
+    m8r::SharedPtr<UpValue>& next() { return _next; }
+    
+    static void* operator new(size_t);
+    static void operator delete(void*);
+    
 private:
+    static constexpr uint32_t MaxFree = 16;
+    
+
     Value _value;
+    m8r::SharedPtr<UpValue> _next;
     bool _closed : 1;
     bool _marked : 1;
     bool _destroyed : 1;
@@ -52,11 +70,13 @@ private:
 
 class Closure : public Object {
 public:
-    Closure() { }
+    Closure() { setIsClosure(); }
     virtual ~Closure();
     
     void init(ExecutionUnit* eu, const Value& function, const Value& thisValue);
     
+    const Value& thisValue() const { return _thisValue; }
+    
     virtual m8r::String toString(ExecutionUnit* eu, bool typeOnly = false) const override { return typeOnly ? m8r::String("Closure") : Object::toString(eu, false); }
 
     virtual void gcMark() override
@@ -67,26 +87,42 @@ public:
         Object::gcMark();
         _func->gcMark();
         _thisValue.gcMark();
-        for (auto it : _upValues) {
-            it->value().gcMark();
-            it->setMarked(true);
+        for (uint32_t i = 0; i < _upValueCount; ++i) {
+            upValue(i)->value().gcMark();
+            upValue(i)->setMarked(true);
         }
     }
     
+    virtual void heapSnapshot(HeapSnapshot&) const override;
+    
     virtual m8r::CallReturnValue callProperty(ExecutionUnit* eu, m8r::Atom prop, uint32_t nparams) override { return _func->callProperty(eu, prop, nparams); }
 
     virtual m8r::CallReturnValue call(ExecutionUnit* eu, Value thisValue, uint32_t nparams) override;
     
     virtual const InstructionVector* code() const override { return _func->code(); }
+    virtual const ThreadedCode* threadedCode(const void* const* handlers) const override { return _func->threadedCode(handlers); }
     virtual uint16_t localCount() const override { return _func->localCount(); }
     virtual bool constant(uint8_t reg, Value& value) const override { return _func->constant(reg, value); }
+    virtual const SwitchTable* switchTable(uint16_t index) const override { return _func->switchTable(index); }
+    virtual uint32_t lineno(uint32_t addr) const override { return _func->lineno(addr); }
     virtual uint16_t formalParamCount() const override { return _func->formalParamCount(); }
     virtual bool loadUpValue(ExecutionUnit* eu, uint32_t index, Value& value) const override;
     
     virtual m8r::Atom name() const override { return _func->name(); }
 
 private:
-    m8r::Vector<m8r::SharedPtr<UpValue>> _upValues;
+    // Most closures capture only a few values. Their UpValues are kept in the
+    // Closure itself, and only the ones past InlineUpValues go in a Vector
+    static constexpr uint32_t InlineUpValues = 2;
+    
+    const m8r::SharedPtr<UpValue>& upValue(uint32_t i) const
+    {
+        return (i < InlineUpValues) ? _inlineUpValues[i] : _moreUpValues[i - InlineUpValues];
+    }
+    
+    m8r::SharedPtr<UpValue> _inlineUpValues[InlineUpValues];
+    m8r::Vector<m8r::SharedPtr<UpValue>> _moreUpValues;
+    uint32_t _upValueCount = 0;
 
     m8r::Mad<Object> _func;
     Value _thisValue;
@@ -11,6 +11,8 @@
 
 #include "ExecutionUnit.h"
 #include "Program.h"
+#include <algorithm>
+#include <cstdio>
 
 using namespace m8rscript;
 using namespace m8r;
@@ -27,6 +29,10 @@ uint32_t CodePrinter::findAnnotation(uint32_t addr) const
 
 void CodePrinter::preamble(String& s, uint32_t addr, bool indent) const
 {
+    // The count goes in front of the instruction, not the lines before it
+    int64_t count = _pendingCount;
+    _pendingCount = -1;
+    
     if (_lineno != _emittedLineNumber) {
         _emittedLineNumber = _lineno;
         if (_nestingLevel) {
@@ -41,6 +47,7 @@ void CodePrinter::preamble(String& s, uint32_t addr, bool indent) const
     
     uint32_t uniqueID = findAnnotation(addr);
     if (!uniqueID) {
+        _pendingCount = count;
         if (indent) {
             indentCode(s);
         }
@@ -54,6 +61,7 @@ void CodePrinter::preamble(String& s, uint32_t addr, bool indent) const
     s += "LABEL[";
     s += String(uniqueID);
     s += "]\n";
+    _pendingCount = count;
     if (indent) {
         indentCode(s);
     }
@@ -81,6 +89,87 @@ m8r::String CodePrinter::generateCodeString(const ExecutionUnit* eu) const
     return generateCodeString(eu, eu->program(), "main");
 }
 
+m8r::String CodePrinter::generateAnnotatedCodeString(const ExecutionUnit* eu, uint32_t hotCount) const
+{
+    _annotated = true;
+    _blocks.clear();
+    _functionCounts.clear();
+    
+    String s = generateCodeString(eu);
+    
+    _annotated = false;
+    _pendingCount = -1;
+    if (!s.empty()) {
+        appendHotList(s, hotCount);
+    }
+    return s;
+}
+
+void CodePrinter::countInstruction(uint32_t functionIndex, Op op, uint32_t pc, uint32_t count, bool& blockEnded) const
+{
+    if (blockEnded || findAnnotation(pc)) {
+        _blocks.push_back({ _functionCounts[functionIndex].function, pc, _lineno, 0, 0 });
+    }
+    Block& block = _blocks.back();
+    block.instructions++;
+    block.count += count;
+    _functionCounts[functionIndex].count += count;
+    
+    switch (op) {
+        case Op::JMP: case Op::JT: case Op::JF: case Op::SWITCH:
+        case Op::FORPREP: case Op::FORLOOP:
+        case Op::RET: case Op::RETI: case Op::TAILCALL: case Op::END:
+            blockEnded = true;
+            break;
+        default:
+            blockEnded = false;
+            break;
+    }
+}
+
+void CodePrinter::appendHotList(String& s, uint32_t hotCount) const
+{
+    if (!OpcodeStats::enabled()) {
+        s += "\nNo execution counts. Build with M8RSCRIPT_OPCODE_STATS=1\n";
+        return;
+    }
+    
+    uint64_t total = 0;
+    for (auto& it : _functionCounts) {
+        total += it.count;
+    }
+    
+    char buf[40];
+    auto appendCount = [&](uint64_t count) {
+        snprintf(buf, sizeof(buf), "%12llu %6.2f%%  ", static_cast<unsigned long long>(count), total ? (100.0 * count / total) : 0.0);
+        s += buf;
+    };
+    
+    std::sort(_functionCounts.begin(), _functionCounts.end(), [](const FunctionCount& a, const FunctionCount& b) {
+        return a.count > b.count;
+    });
+    
+    s += "\nHOT FUNCTIONS:\n";
+    for (uint32_t i = 0; i < _functionCounts.size() && i < hotCount && _functionCounts[i].count; ++i) {
+        appendCount(_functionCounts[i].count);
+        s += _functionCounts[i].function;
+        s += "\n";
+    }
+    
+    // Blocks are ranked by instructions run, which is a better guide to time than entries
+    std::sort(_blocks.begin(), _blocks.end(), [](const Block& a, const Block& b) {
+        return a.count > b.count;
+    });
+    
+    s += "\nHOT BLOCKS:\n";
+    for (uint32_t i = 0; i < _blocks.size() && i < hotCount && _blocks[i].count; ++i) {
+        const Block& block = _blocks[i];
+        appendCount(block.count);
+        s += block.function;
+        s += " LINENO[" + String(block.lineno) + "] addr " + String(block.addr) + ", " + String(block.instructions) + " instructions\n";
+    }
+}
+
 m8r::String CodePrinter::regString(const ExecutionUnit* eu, const Mad<Object> function, const uint8_t*& code, bool up) const
 {
     Value constant;
@@ -210,12 +299,28 @@ m8r::String CodePrinter::generateCodeString(const ExecutionUnit* eu, const Mad<F
     indentCode(outputString);
     outputString += "CODE:\n";
     _nestingLevel++;
+    
+    // Functions that have never run are translated here, so they show counts of 0
+    const ThreadedCode* threadedCode = nullptr;
+    uint32_t functionIndex = static_cast<uint32_t>(_functionCounts.size());
+    bool blockEnded = true;
+    if (_annotated) {
+        threadedCode = ExecutionUnit::handlers() ? func->threadedCode(ExecutionUnit::handlers()) : nullptr;
+        _functionCounts.push_back({ name, 0 });
+    }
 
     enumerateCode(eu, func, [&](Op op, uint8_t imm, uint32_t pc)
     {
         // On entry pc points to the opcode. We need to be one past this to get the regs
         // If we are at the end of the code, we can't set a valid address so just make it null
         const uint8_t* currentAddr = ((pc + 1) < func->code()->size()) ? &(func->code()->at(pc + 1)) : nullptr;
+        _lineno = func->lineno(pc);
+        
+        if (_annotated && op != Op::UNKNOWN) {
+            uint32_t count = threadedCode ? threadedCode->executionCount(pc) : 0;
+            _pendingCount = count;
+            countInstruction(functionIndex, op, pc, count, blockEnded);
+        }
 
         switch(op) {
             default: {
@@ -280,12 +385,56 @@ m8r::String CodePrinter::generateCodeString(const ExecutionUnit* eu, const Mad<F
                 outputString += String(stringFromOp(op)) + " " + regstr + ", " + ((id == 0) ? "[???]" : (String("LABEL[") + String(id) + "]")) + "\n";
                 break;
             }
-            case Op::LINENO:
-                _lineno = uNFromCode(currentAddr);
-                if (findAnnotation(pc)) {
-                    preamble(outputString, pc, false);
-                }
+            case Op::SWITCH: {
+                preamble(outputString, pc);
+                String regstr = regString(eu, func, currentAddr);
+                uint16_t index = uNFromCode(currentAddr);
+                outputString += String(stringFromOp(op)) + " " + regstr + ", TABLE[" + String(index) + "]\n";
+                
+                const SwitchTable* table = func->switchTable(index);
+                auto labelString = [this, pc](int16_t offset) -> String {
+                    uint32_t id = findAnnotation(static_cast<uint32_t>(pc + offset));
+                    return (id == 0) ? String("[???]") : (String("LABEL[") + String(id) + "]");
+                };
+                
+                _nestingLevel++;
+                table->enumerate([&](const Value& value, int16_t offset) {
+                    indentCode(outputString);
+                    showConstant(eu, outputString, value, true);
+                    outputString += " => " + labelString(offset) + "\n";
+                });
+                indentCode(outputString);
+                outputString += "default => " + labelString(table->defaultOffset()) + "\n";
+                _nestingLevel--;
                 break;
+            }
+            case Op::ITERINIT:
+                preamble(outputString, pc);
+                outputString += String(stringFromOp(op)) + " " + regString(eu, func, currentAddr) + (imm ? ", ITERATOR" : "") + "\n";
+                break;
+            case Op::ITERNEXT: {
+                static const char* iterOps[] = { "DONE", "NEXT", "GETVALUE", "SETVALUE" };
+                preamble(outputString, pc);
+                String cursorstr = regString(eu, func, currentAddr);
+                String collectionstr = regString(eu, func, currentAddr);
+                uint8_t iterOp = byteFromCode(currentAddr);
+                outputString += String(stringFromOp(op)) + " " + cursorstr + ", " + collectionstr + ", " + 
+                                ((iterOp < 4) ? iterOps[iterOp] : "???") + "\n";
+                break;
+            }
+            case Op::FORPREP:
+            case Op::FORLOOP: {
+                static const char* forTests[] = { "<", "<=", ">", ">=" };
+                preamble(outputString, pc);
+                String indexstr = regString(eu, func, currentAddr);
+                String endstr = regString(eu, func, currentAddr);
+                String stepstr = (op == Op::FORLOOP) ? (String(", ") + regString(eu, func, currentAddr)) : String();
+                int16_t targetAddr = sNFromCode(currentAddr);
+                uint32_t id = findAnnotation(static_cast<uint32_t>(pc + targetAddr));
+                outputString += String(stringFromOp(op)) + " " + indexstr + " " + forTests[imm] + " " + endstr + stepstr + ", " + 
+                                ((id == 0) ? "[???]" : (String("LABEL[") + String(id) + "]")) + "\n";
+                break;
+            }
         }
     });
     return _nerrors ? String() : outputString;
@@ -311,10 +460,10 @@ bool CodePrinter::enumerateCode(const ExecutionUnit* eu, const Mad<Function> fun
         /* 0x28 */ OP(POSTINC)  OP(POSTDEC)  OP(CALL)  OP(NEW)
         /* 0x2c */ OP(CALLPROP) OP(JMP)  OP(JT)  OP(JF)
 
-        /* 0x30 */ OP(LINENO)  OP(LOADTHIS)  OP(LOADUP)  OP(CLOSURE)
-        /* 0x34 */ OP(UNKNOWN) OP(POPX)  OP(RETI)  OP(UNKNOWN)
-        /* 0x38 */ OP(UNKNOWN) OP(UNKNOWN)  OP(UNKNOWN)  OP(UNKNOWN)
-        /* 0x3c */ OP(UNKNOWN) OP(END) OP(RET) OP(UNKNOWN)
+        /* 0x30 */ OP(UNKNOWN)  OP(LOADTHIS)  OP(LOADUP)  OP(CLOSURE)
+        /* 0x34 */ OP(UNKNOWN) OP(POPX)  OP(RETI)  OP(SWITCH)
+        /* 0x38 */ OP(ITERINIT) OP(ITERNEXT)  OP(FORPREP)  OP(FORLOOP)
+        /* 0x3c */ OP(TAILCALL) OP(END) OP(RET) OP(UNKNOWN)
     };
     
 static_assert (sizeof(dispatchTable) == 64 * sizeof(void*), "Dispatch table is wrong size");
@@ -342,7 +491,7 @@ static_assert (sizeof(dispatchTable) == 64 * sizeof(void*), "Dispatch table is w
     
     for (const uint8_t* p = code; ; ) {
         if (p >= end) {
-            eu->print(Error::formatError(Error::Code::InternalError, _lineno, "WENT PAST THE END OF CODE").c_str());
+            eu->print(Error::formatError(Error::Code::InternalError, func->lineno(static_cast<uint32_t>(p - code)), "WENT PAST THE END OF CODE").c_str());
             _nerrors++;
             return false;
         }
@@ -354,20 +503,29 @@ static_assert (sizeof(dispatchTable) == 64 * sizeof(void*), "Dispatch table is w
             break;
         }
         
-        if (op == Op::LINENO) {
-            _lineno = uNFromCode(p);
-        } else {
-            advanceAddr(op, p);
-        }
+        advanceAddr(op, p);
         
         // advanceAddr advances past the jump address in the case of any of the jump
         // instructions. So back up to get it
-        if (op == Op::JT || op == Op::JF || op == Op::JMP) {
+        if (op == Op::JT || op == Op::JF || op == Op::JMP || op == Op::FORPREP || op == Op::FORLOOP) {
             p -= 2;
             uint32_t addr = static_cast<uint32_t>((jumpAddr - code) + sNFromCode(p));
             Annotation annotation = { addr, uniqueID++ };
             _annotations.push_back(annotation);
         }
+        
+        // Same for the switch table index. Add a label for each target
+        if (op == Op::SWITCH) {
+            p -= 2;
+            const SwitchTable* table = func->switchTable(uNFromCode(p));
+            assert(table);
+            uint32_t defaultAddr = static_cast<uint32_t>((jumpAddr - code) + table->defaultOffset());
+            _annotations.push_back({ defaultAddr, uniqueID++ });
+            table->enumerate([&](const Value&, int16_t offset) {
+                uint32_t addr = static_cast<uint32_t>((jumpAddr - code) + offset);
+                _annotations.push_back({ addr, uniqueID++ });
+            });
+        }
     }
 
     const uint8_t* currentAddr = code;
@@ -423,7 +581,10 @@ static_assert (sizeof(dispatchTable) == 64 * sizeof(void*), "Dispatch table is w
     L_JT: L_JF:
         enumerationFunction(op, imm, pc);
         DISPATCH;
-    L_CALL:
+    L_SWITCH:
+        enumerationFunction(op, imm, pc);
+        DISPATCH;
+    L_CALL: L_TAILCALL:
         enumerationFunction(op, imm, pc);
         DISPATCH;
     L_NEW:
@@ -432,7 +593,10 @@ static_assert (sizeof(dispatchTable) == 64 * sizeof(void*), "Dispatch table is w
     L_CALLPROP:
         enumerationFunction(op, imm, pc);
         DISPATCH;
-    L_LINENO:
+    L_ITERINIT: L_ITERNEXT:
+        enumerationFunction(op, imm, pc);
+        DISPATCH;
+    L_FORPREP: L_FORLOOP:
         enumerationFunction(op, imm, pc);
         DISPATCH;
 }
@@ -462,8 +626,11 @@ static CodeMap opcodes[] = {
     OP(POSTINC) OP(POSTDEC) OP(CALL) OP(NEW) 
     OP(CALLPROP) OP(JMP) OP(JT) OP(JF) 
     
-    OP(LINENO) OP(LOADTHIS) OP(LOADUP)
-    OP(CLOSURE) OP(POPX) OP(RETI)
+    OP(LOADTHIS) OP(LOADUP)
+    OP(CLOSURE) OP(POPX) OP(RETI) OP(SWITCH)
+    
+    OP(ITERINIT) OP(ITERNEXT) OP(FORPREP) OP(FORLOOP)
+    OP(TAILCALL)
     
     OP(END) OP(RET)
 };
@@ -480,6 +647,19 @@ const char* CodePrinter::stringFromOp(Op op)
 
 void CodePrinter::indentCode(m8r::String& s) const
 {
+    // Annotated lines start with a column for the count, blank for anything but
+    // an instruction
+    if (_annotated) {
+        char buf[16];
+        if (_pendingCount >= 0) {
+            snprintf(buf, sizeof(buf), "%10llu  ", static_cast<unsigned long long>(_pendingCount));
+        } else {
+            snprintf(buf, sizeof(buf), "%12s", "");
+        }
+        s += buf;
+        _pendingCount = -1;
+    }
+    
     for (uint32_t i = 0; i < _nestingLevel; ++i) {
         s += "    ";
     }
@@ -28,8 +28,15 @@ public:
     
     m8r::String generateCodeString(const ExecutionUnit*) const;
     
+    // Same listing with the number of times each instruction has run in front of
+    // it, followed by the hottest functions and basic blocks. Counts are only kept
+    // in a build with M8RSCRIPT_OPCODE_STATS
+    m8r::String generateAnnotatedCodeString(const ExecutionUnit*, uint32_t hotCount = 10) const;
+    
     bool hasErrors() const { return _nerrors > 0; }
     
+    static const char* stringFromOp(Op op);
+
 private:
     using EnumerationFunction = std::function<void(Op, uint8_t imm, uint32_t pc)>;
     
@@ -54,10 +61,26 @@ private:
     };
     
     using Annotations = m8r::Vector<Annotation>;
+    
+    // A basic block starts at a label or after a jump or return
+    struct Block {
+        m8r::String function;
+        uint32_t addr;
+        int32_t lineno;
+        uint32_t instructions;
+        uint64_t count;
+    };
+    
+    struct FunctionCount {
+        m8r::String function;
+        uint64_t count;
+    };
+    
+    void countInstruction(uint32_t functionIndex, Op, uint32_t pc, uint32_t count, bool& blockEnded) const;
+    void appendHotList(m8r::String&, uint32_t hotCount) const;
 
     uint32_t findAnnotation(uint32_t addr) const;
     void preamble(m8r::String& s, uint32_t addr, bool indent = true) const;
-    static const char* stringFromOp(Op op);
     void indentCode(m8r::String&) const;
     
     mutable uint32_t _nestingLevel = 0;
@@ -65,6 +88,11 @@ private:
     mutable uint32_t _nerrors = 0;
     mutable int32_t _lineno = -1;
     mutable int32_t _emittedLineNumber = -1;
+    
+    mutable bool _annotated = false;
+    mutable int64_t _pendingCount = -1;
+    mutable m8r::Vector<Block> _blocks;
+    mutable m8r::Vector<FunctionCount> _functionCounts;
 };
     
 }
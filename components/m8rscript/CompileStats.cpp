@@ -0,0 +1,46 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "CompileStats.h"
+
+#include "Mallocator.h"
+
+using namespace m8rscript;
+using namespace m8r;
+
+#if M8RSCRIPT_COMPILE_STATS
+uint32_t CompileStats::_depth[static_cast<uint8_t>(Phase::NumPhases)];
+uint64_t CompileStats::_ns[static_cast<uint8_t>(Phase::NumPhases)];
+uint32_t CompileStats::_tokens = 0;
+uint32_t CompileStats::_functions = 0;
+uint32_t CompileStats::_startFree = 0;
+uint32_t CompileStats::_minFree = 0;
+
+void CompileStats::function()
+{
+    ++_functions;
+    
+    // The code and constants of a function are at their largest as it ends
+    uint32_t freeSize = Mallocator::shared()->freeSize();
+    if (freeSize < _minFree) {
+        _minFree = freeSize;
+    }
+}
+
+void CompileStats::clear()
+{
+    for (uint8_t i = 0; i < static_cast<uint8_t>(Phase::NumPhases); ++i) {
+        _ns[i] = 0;
+    }
+    _tokens = 0;
+    _functions = 0;
+    _startFree = Mallocator::shared()->freeSize();
+    _minFree = _startFree;
+}
+#endif
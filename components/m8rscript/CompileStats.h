@@ -0,0 +1,99 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <cstdint>
+
+// Set to 1 to time the phases of Parser::parse
+#ifndef M8RSCRIPT_COMPILE_STATS
+#define M8RSCRIPT_COMPILE_STATS 0
+#endif
+
+#if M8RSCRIPT_COMPILE_STATS
+#include <chrono>
+#endif
+
+namespace m8rscript {
+
+// CompileStats - Where the time and memory of a compile go
+//
+// Parse is the whole of Parser::parse. Inside it, Scan is the time in the
+// Scanner getting tokens and Emit is the time in emitDeferred and
+// reconcileRegisters. What is left is the ParseEngine productions. Each token
+// the ParseEngine retires and each function it ends is counted, and the heap
+// is sampled as each function ends to find the peak use. Scopes of a phase
+// nest, so an import inside a parse isn't counted twice.
+class CompileStats {
+public:
+    enum class Phase : uint8_t { Parse, Scan, Emit, NumPhases };
+
+#if M8RSCRIPT_COMPILE_STATS
+    static constexpr bool enabled() { return true; }
+
+    class Scope {
+    public:
+        Scope(Phase phase) : _phase(static_cast<uint8_t>(phase))
+        {
+            if (_depth[_phase]++ == 0) {
+                _start = std::chrono::steady_clock::now();
+            }
+        }
+
+        ~Scope()
+        {
+            if (--_depth[_phase] == 0) {
+                _ns[_phase] += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                std::chrono::steady_clock::now() - _start).count());
+            }
+        }
+
+    private:
+        uint8_t _phase;
+        std::chrono::steady_clock::time_point _start;
+    };
+
+    static void token() { ++_tokens; }
+    static void function();
+    static void clear();
+
+    static uint64_t ns(Phase phase) { return _ns[static_cast<uint8_t>(phase)]; }
+    static uint32_t tokens() { return _tokens; }
+    static uint32_t functions() { return _functions; }
+    static uint32_t peakBytes() { return _startFree - _minFree; }
+#else
+    static constexpr bool enabled() { return false; }
+
+    class Scope {
+    public:
+        Scope(Phase) { }
+    };
+
+    static void token() { }
+    static void function() { }
+    static void clear() { }
+
+    static uint64_t ns(Phase) { return 0; }
+    static uint32_t tokens() { return 0; }
+    static uint32_t functions() { return 0; }
+    static uint32_t peakBytes() { return 0; }
+#endif
+
+private:
+#if M8RSCRIPT_COMPILE_STATS
+    static uint32_t _depth[static_cast<uint8_t>(Phase::NumPhases)];
+    static uint64_t _ns[static_cast<uint8_t>(Phase::NumPhases)];
+    static uint32_t _tokens;
+    static uint32_t _functions;
+    static uint32_t _startFree;
+    static uint32_t _minFree;
+#endif
+};
+
+}
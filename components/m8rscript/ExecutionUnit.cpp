@@ -11,20 +11,27 @@
 
 #include "Closure.h"
 #include "GC.h"
+#include "HeapSnapshot.h"
+#include "Metrics.h"
 #include "MStream.h"
 #include "Parser.h"
 #include "SystemInterface.h"
 #include "SystemTime.h"
+#include "Trace.h"
 #include <cmath>
 
 using namespace m8rscript;
 using namespace m8r;
 
+const void* const* ExecutionUnit::_handlers = nullptr;
+
 ExecutionUnit::ExecutionUnit()
     : _stack(20)
 {
     _delayTimer.setCallback([this](Timer*) {
         _delayComplete = true;
+        Trace::endAsync(Trace::Span::Delay, _delayTraceId);
+        _delayTraceId = 0;
     });
     
     GC::addExecutable(SharedPtr<Executable>(this));
@@ -32,6 +39,7 @@ ExecutionUnit::ExecutionUnit()
 
 ExecutionUnit::~ExecutionUnit()
 {
+    clearEventQueue();
     GC::removeExecutable(SharedPtr<Executable>(this));
     GC::gc();
 }
@@ -55,14 +63,18 @@ Mad<m8r::String> ExecutionUnit::createString(const m8r::String& other)
     Mad<String> s = Mad<String>::create();
     *(s.get()) = other;
     GC::addToStore<MemoryType::String>(s.raw());
+    Metrics::increment(Metrics::Counter::StringsAllocated);
+    AllocationTracker::allocated(s.get(), MemoryType::String, sizeof(String) + static_cast<uint32_t>(s->size()));
     return s;
 }
 
 Mad<m8r::String> ExecutionUnit::createString(m8r::String&& other)
 {
     Mad<m8r::String> s = Mad<m8r::String>::create();
-    *(s.get()) = other;
+    *(s.get()) = std::move(other);
     GC::addToStore<MemoryType::String>(s.raw());
+    Metrics::increment(Metrics::Counter::StringsAllocated);
+    AllocationTracker::allocated(s.get(), MemoryType::String, sizeof(String) + static_cast<uint32_t>(s->size()));
     return s;
 }
 
@@ -71,6 +83,8 @@ Mad<m8r::String> ExecutionUnit::createString(const char* str, int32_t length)
     Mad<m8r::String> s = Mad<m8r::String>::create();
     *(s.get()) = String(str, length);
     GC::addToStore<MemoryType::String>(s.raw());
+    Metrics::increment(Metrics::Counter::StringsAllocated);
+    AllocationTracker::allocated(s.get(), MemoryType::String, sizeof(String) + static_cast<uint32_t>(s->size()));
     return s;
 }
 
@@ -80,7 +94,7 @@ void ExecutionUnit::printError(const char* format, ...) const
     va_start(args, format);
     printf("***** ");
 
-    print(Error::vformatError(Error::Code::RuntimeError, _lineno, format, args).c_str());
+    print(Error::vformatError(Error::Code::RuntimeError, lineno(), format, args).c_str());
     if (++_nerrors > MaxRunTimeErrrors) {
         printf("\n\nToo many runtime errors, (%d) exiting...\n", _nerrors);
         requestTerminate();
@@ -113,21 +127,53 @@ void ExecutionUnit::gcMark()
     }
 }
 
+void ExecutionUnit::heapSnapshotRoots(HeapSnapshot& snapshot)
+{
+    if (!_program.valid()) {
+        return;
+    }
+    
+    for (auto entry : _stack) {
+        snapshot.addRoot("stack", entry);
+    }
+    
+    snapshot.addRoot("program", Value(Mad<Object>(_program)));
+    if (_function.valid()) {
+        snapshot.addRoot("function", Value(_function));
+    }
+    if (_this.valid()) {
+        snapshot.addRoot("this", Value(_this));
+    }
+
+    for (auto it : _eventQueue) {
+        snapshot.addRoot("event", it);
+    }
+}
+
 Value* ExecutionUnit::valueFromId(Atom id, const Object* obj) const
 {
     // Start at the current object and walk up the chain
     return nullptr;
 }
 
-void ExecutionUnit::stoIdRef(Atom atom, const Value& value)
+void ExecutionUnit::fillRefCache(ThreadedCode::RefCache* cache, Value* slot, const Value& value)
+{
+    cache->_epoch = _program->propertyEpoch();
+    cache->_program = _program.get();
+    cache->_slot = slot;
+    cache->_value = slot ? Value() : value;
+}
+
+void ExecutionUnit::stoIdRef(Atom atom, const Value& value, ThreadedCode::RefCache* cache)
 {
     if (!atom) {
         printError("Destination in STOREFK must be an Atom");
         return;
     }
     
-    // If property exists in this, store it there
-    if (_this.valid()) {
+    // If property exists in this, store it there. When this is the
+    // Program that is the same as storing it in the Program below
+    if (_this.valid() && _this.get() != _program.get()) {
         Value oldValue = _this->property(atom);
         if (oldValue) {
             if (!_this->setProperty(atom, value, Value::SetType::AddIfNeeded)) {
@@ -137,11 +183,25 @@ void ExecutionUnit::stoIdRef(Atom atom, const Value& value)
         }
     }
 
+    // An existing property of the Program can be stored straight into its
+    // slot, as MaterObject::setProperty would
+    if (cache->_slot && cache->_program == _program.get() && cache->_epoch == _program->propertyEpoch() && *cache->_slot) {
+        value.gcMark();
+        *cache->_slot = value;
+        return;
+    }
+
     // See if it's in Program
     Value oldValue = _program->property(atom);
     if (oldValue) {
         if (!_program->setProperty(atom, value, Value::SetType::AddIfNeeded)) {
             printError("'%s' property of this object cannot be set", _program->stringFromAtom(atom));
+            return;
+        }
+        
+        Value* slot = _program->propertySlot(atom);
+        if (slot) {
+            fillRefCache(cache, slot, value);
         }
         return;
     }
@@ -150,29 +210,52 @@ void ExecutionUnit::stoIdRef(Atom atom, const Value& value)
     return;
 }
 
-Value ExecutionUnit::derefId(Atom atom)
+Value ExecutionUnit::derefId(Atom atom, ThreadedCode::RefCache* cache)
 {
     if (!atom) {
         printError("Value in LOADREFK must be an Atom");
         return Value();
     }
     
-    // Look in this then program then global
+    // Look in this then program then global. When this is the
+    // Program there is no need to look in it twice
     Value value;
-    if (_this.valid()) {
+    if (_this.valid() && _this.get() != _program.get()) {
         value = _this->property(atom);
         if (value) {
             return value;
         }
     }
+    
+    // A slot set to undefined since it was cached might now be
+    // shadowing a global, so take the long way
+    if (cache->_program == _program.get() && cache->_epoch == _program->propertyEpoch()) {
+        value = cache->_slot ? *cache->_slot : cache->_value;
+        if (value) {
+            return value;
+        }
+    }
+
+    // Only properties of the Program itself are cached
+    Value* slot = _program->propertySlot(atom);
+    if (slot && *slot) {
+        fillRefCache(cache, slot, *slot);
+        return *slot;
+    }
 
     value = _program->property(atom);
     if (value) {
         return value;
     }
     
+    // A global is only cached if the Program doesn't have the property
+    // at all. Otherwise setting it would make the cache stale without
+    // changing the epoch
     value = Global::shared()->property(atom);
     if (value) {
+        if (!slot) {
+            fillRefCache(cache, nullptr, value);
+        }
         return value;
     }
     
@@ -180,6 +263,91 @@ Value ExecutionUnit::derefId(Atom atom)
     return Value();
 }
 
+int32_t ExecutionUnit::iterationCount(const Value& collection)
+{
+    if (collection.isString()) {
+        Mad<String> s = collection.asString();
+        if (s.valid()) {
+            return static_cast<int32_t>(s->size());
+        }
+        const char* literal = _program->stringFromStringLiteral(collection.asStringLiteralValue());
+        return literal ? static_cast<int32_t>(strlen(literal)) : 0;
+    }
+    
+    Mad<Object> obj = collection.asObject();
+    return obj.valid() ? obj->iterationCount() : -1;
+}
+
+CallReturnValue ExecutionUnit::iterInit(const Value& collection, bool makeIterator, uint32_t& nparams)
+{
+    // Arrays, Objects and Strings are iterated using an integer cursor, unless
+    // the loop needs the Iterator itself. Everything else gets an Iterator
+    // object, the equivalent of 'new obj.iterator(obj)'
+    if (!makeIterator && iterationCount(collection) >= 0) {
+        nparams = 0;
+        _stack.push(Value(0));
+        return CallReturnValue(CallReturnValue::Type::ReturnCount, 1);
+    }
+    
+    Value iterator = collection.property(this, SAtom(SA::iterator));
+    if (!iterator) {
+        iterator = Global::shared()->property(SAtom(SA::Iterator));
+    }
+    
+    nparams = 1;
+    _stack.push(collection);
+    return iterator.construct(this, nparams);
+}
+
+CallReturnValue ExecutionUnit::iterNext(IterOp iterOp, uint8_t cursorReg, const Value& collection, uint32_t nparams)
+{
+    Value cursor = reg(cursorReg);
+    if (!cursor.isInteger()) {
+        // This is an Iterator object, call the appropriate function on it
+        Atom name;
+        switch (iterOp) {
+            case IterOp::Done: name = SAtom(SA::done); break;
+            case IterOp::Next: name = SAtom(SA::next); break;
+            case IterOp::GetValue: name = SAtom(SA::getValue); break;
+            case IterOp::SetValue: name = SAtom(SA::setValue); break;
+        }
+        return cursor.callProperty(this, name, nparams);
+    }
+    
+    int32_t index = cursor.asIntValue();
+    Value value;
+    
+    switch (iterOp) {
+        case IterOp::Done:
+            value = Value(index >= iterationCount(collection));
+            break;
+        case IterOp::Next:
+            setInFrame(cursorReg, Value(index + 1));
+            break;
+        case IterOp::GetValue: {
+            if (collection.isString()) {
+                value = collection.element(this, cursor);
+                break;
+            }
+            Mad<Object> obj = collection.asObject();
+            if (obj.valid()) {
+                value = obj->iterationValue(this, index);
+            }
+            break;
+        }
+        case IterOp::SetValue: {
+            Mad<Object> obj = collection.asObject();
+            if (!obj.valid() || !obj->setIterationValue(this, index, _stack.top())) {
+                printError("Can't set value of iterated element %d", index);
+            }
+            break;
+        }
+    }
+    
+    _stack.push(value);
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 1);
+}
+
 void ExecutionUnit::startExecution(Mad<Program> program)
 {
     if (!program.valid()) {
@@ -197,19 +365,23 @@ void ExecutionUnit::startExecution(Mad<Program> program)
     _this = program;
     _stack.setLocalFrame(0, 0, _function->localCount());
 
-    _localOffset = 0;
     _formalParamCount = 0;
     _actualParamCount = 0;
 
     _nerrors = 0;
     _terminate = false;
     
-    _eventQueue.clear();
+    clearEventQueue();
     _executingEvent = false;
+    Trace::endAsync(Trace::Span::Event, _eventTraceId);
+    _eventTraceId = 0;
     _numEventListeners = 0;
-    _lineno = 0;
 
-    _openUpValues.clear();
+    while (_openUpValues) {
+        SharedPtr<UpValue> upValue = _openUpValues;
+        _openUpValues = upValue->next();
+        upValue->next() = SharedPtr<UpValue>();
+    }
     updateCodePointer();
 }
 
@@ -224,6 +396,7 @@ void ExecutionUnit::fireEvent(const Value& func, const Value& thisValue, const V
         }
         
         _checkForExceptions = true;
+        Metrics::adjust(Metrics::Gauge::EventQueueDepth, 1);
 
 #ifndef NDEBUG
         checkEventQueueConsistency();
@@ -264,6 +437,15 @@ void ExecutionUnit::receivedData(const String& data, KeyAction action)
 
 // This function will only ever return Delay, Yield, WaitForEvent and Error.
 // everything else is handled
+void ExecutionUnit::clearEventQueue()
+{
+    // Each event is 3 entries plus its args
+    for (uint32_t index = 0; index + 2 < _eventQueue.size(); index += _eventQueue[index + 2].asIntValue() + 3) {
+        Metrics::adjust(Metrics::Gauge::EventQueueDepth, -1);
+    }
+    _eventQueue.clear();
+}
+
 CallReturnValue ExecutionUnit::runNextEvent()
 {
     // Each event is at least 3 entries long. First is the function, followed by the this pointer
@@ -279,6 +461,7 @@ CallReturnValue ExecutionUnit::runNextEvent()
             
             haveEvent = true;
             _executingEvent = true;
+            _eventTraceId = Trace::beginAsync(Trace::Span::Event);
             func = _eventQueue[0];
             thisValue = _eventQueue[1];
             nargs = _eventQueue[2].asIntValue();
@@ -289,6 +472,8 @@ CallReturnValue ExecutionUnit::runNextEvent()
             }
             
             _eventQueue.erase(_eventQueue.begin(), _eventQueue.begin() + 3 + nargs);
+            Metrics::adjust(Metrics::Gauge::EventQueueDepth, -1);
+            Metrics::increment(Metrics::Counter::EventsRun);
         }
 
 #ifndef NDEBUG
@@ -301,6 +486,9 @@ CallReturnValue ExecutionUnit::runNextEvent()
                 
         // Callbacks don't return a value. Ignore it, but pop the stack
         if (callReturnValue.isReturnCount()) {
+            // A native callback has already run
+            Trace::endAsync(Trace::Span::Event, _eventTraceId);
+            _eventTraceId = 0;
             if (callReturnValue.returnCount() > 0) {
                 _stack.pop(callReturnValue.returnCount());
             }
@@ -329,14 +517,23 @@ uint32_t ExecutionUnit::upValueStackIndex(uint32_t index, uint16_t frame) const
     return stackIndex;
 }
 
-void ExecutionUnit::closeUpValues(uint32_t frame)
+SharedPtr<UpValue> ExecutionUnit::openUpValue(uint32_t stackIndex)
 {
-    auto it = std::remove_if(_openUpValues.begin(), _openUpValues.end(), 
-        [this, frame](SharedPtr<UpValue>& upValue) {
-            return upValue->closeIfNeeded(this, frame);
-        });
+    // Closures are almost always made for the newest frame, so the
+    // search ends near the head of the list
+    SharedPtr<UpValue>* link = &_openUpValues;
+    while (*link && (*link)->stackIndex() > stackIndex) {
+        link = &((*link)->next());
+    }
+    
+    if (*link && (*link)->stackIndex() == stackIndex) {
+        return *link;
+    }
     
-    _openUpValues.erase(it, _openUpValues.end());
+    SharedPtr<UpValue> upValue(new UpValue(stackIndex));
+    upValue->next() = *link;
+    *link = upValue;
+    return upValue;
 }
 
 void ExecutionUnit::startFunction(Mad<Object> function, Mad<Object> thisObject, uint32_t nparams)
@@ -344,28 +541,67 @@ void ExecutionUnit::startFunction(Mad<Object> function, Mad<Object> thisObject,
     assert(_program.valid());
     
     Mad<Object> prevFunction = _function;
+    Mad<Object> prevThis = _this;
+    uint32_t prevActualParamCount = _actualParamCount;
+    
+    uint32_t prevFrame;
+    uint32_t localsAdded;
+    enterFunction(function, thisObject, nparams, prevFrame, localsAdded);
+    
+    // Add nparams to localsAdded so when we restore the frame we pop off the params, too
+    _callRecords.push_back({ static_cast<uint32_t>(_currentAddr - _code), prevFrame, prevFunction, prevThis, prevActualParamCount, localsAdded + nparams });
+    
+    updateCodePointer();
+}
+
+void ExecutionUnit::tailCallFunction(Mad<Object> function, Mad<Object> thisObject, uint32_t nparams)
+{
+    // The CallRecord of the current function is kept, so the callee returns
+    // straight to our caller. Our params and locals are below the nparams
+    // args. Close any upValues pointing at them, then slide the args down
+    // over them, so the stack looks like our caller made the call.
+    CallRecord& callRecord = _callRecords.back();
+    uint32_t argStart = _stack.size() - nparams;
+    uint32_t base = argStart - callRecord._localsAdded;
+    assert(base == frameBase());
+    
+    closeUpValues(base);
+    
+    for (uint32_t i = 0; i < nparams; ++i) {
+        _stack.at(base + i) = _stack.at(argStart + i);
+    }
+    _stack.pop(argStart - base);
+    
+    uint32_t frame;
+    uint32_t localsAdded;
+    enterFunction(function, thisObject, nparams, frame, localsAdded);
+    callRecord._localsAdded = localsAdded + nparams;
+    
+    updateCodePointer();
+}
+
+void ExecutionUnit::enterFunction(Mad<Object> function, Mad<Object> thisObject, uint32_t nparams, uint32_t& prevFrame, uint32_t& localsAdded)
+{
     _function =  function;
 
     _formalParamCount = _function.valid() ? _function->formalParamCount() : 0;
-    uint32_t prevActualParamCount = _actualParamCount;
     _actualParamCount = nparams;
-    _localOffset = (_formalParamCount < _actualParamCount) ? (_actualParamCount - _formalParamCount) : 0;
+    
+    // Any params past the formals go below the frame, so registers index the frame directly
+    uint32_t framedParamCount = nparams;
+    if (nparams > _formalParamCount) {
+        moveExtraParams(nparams, nparams - _formalParamCount);
+        framedParamCount = _formalParamCount;
+    }
+    
     uint32_t localCount = _function.valid() ? _function->localCount() : 0;
     
-    Mad<Object> prevThis = _this;
     _this = thisObject;
     if (!_this.valid()) {
         _this = _program;
     }
     
-    uint32_t prevFrame;
-    uint32_t localsAdded;
-    _stack.setLocalFrame(_formalParamCount, _actualParamCount, localCount, prevFrame, localsAdded);
-    
-    // Add nparams to localsAdded so when we restore the frame we pop off the params, too
-    _callRecords.push_back({ static_cast<uint32_t>(_currentAddr - _code), prevFrame, prevFunction, prevThis, prevActualParamCount, _lineno, localsAdded + nparams });
-    
-    updateCodePointer();
+    _stack.setLocalFrame(_formalParamCount, framedParamCount, localCount, prevFrame, localsAdded);
 }
 
 CallReturnValue ExecutionUnit::endFunction()
@@ -374,8 +610,8 @@ CallReturnValue ExecutionUnit::endFunction()
     assert(!_callRecords.empty());
     const CallRecord& callRecord = _callRecords.back();
     
-    // Close any upValues that need it
-    closeUpValues(callRecord._frame);
+    // Close any upValues pointing into the frame being left
+    closeUpValues(frameBase());
     
     _actualParamCount = callRecord._paramCount;
     _this = callRecord._thisObj;
@@ -387,22 +623,59 @@ CallReturnValue ExecutionUnit::endFunction()
     updateCodePointer();
     _currentAddr = _code + callRecord._pc;
     
-    _lineno = callRecord._lineno;
-    
     _callRecords.pop_back();
 
     _formalParamCount = _function.valid() ? _function->formalParamCount() : 0;
-    _localOffset = (_formalParamCount < _actualParamCount) ? (_actualParamCount - _formalParamCount) : 0;
 
      return CallReturnValue(CallReturnValue::Type::Yield);
 }
 
+void ExecutionUnit::moveExtraParams(uint32_t nparams, uint32_t extra)
+{
+    // Rotate the top nparams stack entries so the last extra are at the bottom,
+    // followed by the formal params in order. Done with 3 reversals, in place.
+    auto reverse = [this](uint32_t first, uint32_t last) {
+        while (first < last) {
+            std::swap(_stack.at(first++), _stack.at(--last));
+        }
+    };
+    
+    uint32_t start = _stack.size() - nparams;
+    uint32_t formalStart = _stack.size() - extra;
+    reverse(start, formalStart);
+    reverse(formalStart, _stack.size());
+    reverse(start, _stack.size());
+}
+
+void ExecutionUnit::setCallResult(const Value& value)
+{
+    // The value returned from a call is almost always popped into a register
+    // by the next instruction. Store it there directly and skip the POP.
+    // In a counting build the POP is still counted, as if it had been dispatched
+    Op nextOp = opFromByte(static_cast<uint8_t>(_currentAddr[1]));
+    if (OpcodeStats::enabled() && (nextOp == Op::POP || nextOp == Op::POPX)) {
+        _threadedCode->count(static_cast<uint32_t>(_currentAddr - _code));
+        OpcodeStats::dispatched(nextOp);
+    }
+    
+    if (nextOp == Op::POP) {
+        _currentAddr += 2;
+        uint32_t r = uintFromCode();
+        setInFrame(r, value);
+    } else if (nextOp == Op::POPX) {
+        _currentAddr += 2;
+    } else {
+        _stack.push(value);
+    }
+}
+
 void ExecutionUnit::startDelay(Duration duration)
 {
     _delayComplete = false;
     if (!_callRecords.empty()) {
         _callRecords.back()._executingDelay = true;
     }
+    _delayTraceId = Trace::beginAsync(Trace::Span::Delay);
     _delayTimer.start(duration);
 }
 
@@ -414,6 +687,62 @@ void ExecutionUnit::continueDelay()
     }
 }
 
+void ExecutionUnit::startQuantum()
+{
+    _quantumStart = Time::now().us();
+    _safepointsUntilTimeCheck = SafepointsPerTimeCheck;
+}
+
+void ExecutionUnit::checkQuantum()
+{
+    // Yield if this quantum is used up, so a busy script can't starve other tasks
+    _safepointsUntilTimeCheck = SafepointsPerTimeCheck;
+    flushInstructionCount();
+    uint64_t now = Time::now().us();
+    uint32_t weight = _profiler.sampleDue(now);
+    if (weight) {
+        sampleStack(weight);
+    }
+    if (now - _quantumStart >= QuantumUs) {
+        _yield = true;
+        _checkForExceptions = true;
+    }
+}
+
+Profiler::Frame ExecutionUnit::profileFrame(const Mad<Object>& function, uint32_t index) const
+{
+    const ThreadedCode* code = function->threadedCode(_handlers);
+    uint32_t lineno = code ? function->lineno(code->addrFromIndex(index)) : 0;
+    return { function->name(), lineno, static_cast<Mad<Callable>>(_program) == function };
+}
+
+void ExecutionUnit::sampleStack(uint32_t weight)
+{
+    if (!_code || !_function.valid()) {
+        return;
+    }
+    
+    // The current function is at the next instruction to run. Each caller is
+    // at the CALL it will return to, so back up one word from its return point
+    Vector<Profiler::Frame> frames;
+    frames.ensureCapacity(_callRecords.size() + 1);
+    frames.push_back(profileFrame(_function, static_cast<uint32_t>(_currentAddr - _code)));
+    for (uint32_t i = static_cast<uint32_t>(_callRecords.size()); i > 0; --i) {
+        const CallRecord& callRecord = _callRecords[i - 1];
+        if (callRecord._func.valid()) {
+            frames.push_back(profileFrame(callRecord._func, callRecord._pc ? (callRecord._pc - 1) : 0));
+        }
+    }
+    _profiler.addSample(&(frames[0]), static_cast<uint32_t>(frames.size()), weight);
+}
+
+void ExecutionUnit::printProfile() const
+{
+    if (_printProfileOnExit && _program.valid() && _profiler.sampleCount()) {
+        print(_profiler.folded(_program.get()).c_str());
+    }
+}
+
 static inline bool valuesAreInt(const Value& a, const Value& b)
 {
     return a.isInteger() && b.isInteger();
@@ -510,21 +839,33 @@ CallReturnValue ExecutionUnit::execute()
         /* 0x28 */ OP(POSTINC)  OP(POSTDEC)  OP(CALL)  OP(NEW)
         /* 0x2c */ OP(CALLPROP) OP(JMP)  OP(JT)  OP(JF)
 
-        /* 0x30 */ OP(LINENO)  OP(LOADTHIS)  OP(LOADUP) OP(CLOSURE)
-        /* 0x34 */ OP(YIELD)  OP(POPX)  OP(RETI) OP(UNKNOWN)
-        /* 0x38 */ OP(UNKNOWN) OP(UNKNOWN)  OP(UNKNOWN)  OP(UNKNOWN) 
-        /* 0x3c */ OP(UNKNOWN) OP(END) OP(RET) OP(UNKNOWN)
+        /* 0x30 */ OP(UNKNOWN)  OP(LOADTHIS)  OP(LOADUP) OP(CLOSURE)
+        /* 0x34 */ OP(YIELD)  OP(POPX)  OP(RETI) OP(SWITCH)
+        /* 0x38 */ OP(ITERINIT) OP(ITERNEXT)  OP(FORPREP)  OP(FORLOOP) 
+        /* 0x3c */ OP(TAILCALL) OP(END) OP(RET) OP(UNKNOWN)
     };
  
     static_assert (sizeof(dispatchTable) == (1 << 6) * sizeof(void*), "Dispatch table is wrong size");
 
-    #define DISPATCH { goto *dispatchTable[static_cast<uint8_t>(op = dispatchNextOp(imm))]; }
+    #define DISPATCH { goto *dispatchNextOp(op, imm); }
+    #define DISPATCH_SAFEPOINT { if (atSafepoint(op)) { goto *dispatchTable[static_cast<uint8_t>(op)]; } DISPATCH; }
+    
+    _handlers = dispatchTable;
     
     if (!_program.valid()) {
         return CallReturnValue(CallReturnValue::Type::Finished);
     }
     
+    if (!_code) {
+        updateCodePointer();
+    }
+    
+    AllocationTracker::Scope allocationScope(this);
+    Trace::Scope traceScope(this);
+    InstructionCountScope instructionCountScope(this);
+    
     _yield = false;
+    startQuantum();
     GC::gc();
     
     uint32_t uintValue;
@@ -549,12 +890,8 @@ CallReturnValue ExecutionUnit::execute()
         goto L_YIELD;
     }
     
-    DISPATCH;
+    DISPATCH_SAFEPOINT;
     
-    L_LINENO:
-        _lineno = uNFromCode(_currentAddr);
-        DISPATCH;
-        
     L_UNKNOWN:
         assert(0);
         return CallReturnValue(CallReturnValue::Type::Finished);
@@ -582,6 +919,7 @@ CallReturnValue ExecutionUnit::execute()
             _stack.clear();
             _callRecords.clear();
             GC::gc(true);
+            printProfile();
             _program.reset();
             return CallReturnValue(CallReturnValue::Type::Terminated);
         }
@@ -592,7 +930,7 @@ CallReturnValue ExecutionUnit::execute()
             // This is essentially the same as the exit code returned from main() in C
             if (op == Op::RET || op == Op::RETI) {
                 // Take care of the values on the return stack
-                uint8_t nparams = (op == Op::RET) ? byteFromCode(_currentAddr) : imm;
+                uint8_t nparams = (op == Op::RET) ? uintFromCode() : imm;
                 returnedValue = nparams ? _stack.top(1 - nparams) : Value();
                 _stack.pop(nparams);
             }
@@ -609,6 +947,7 @@ CallReturnValue ExecutionUnit::execute()
                 }
                 
                 GC::gc(true);
+                printProfile();
                 _program.reset();
                 return CallReturnValue(CallReturnValue::Type::Finished);
             }
@@ -616,7 +955,7 @@ CallReturnValue ExecutionUnit::execute()
         }
         else {
             // Assume this is RET or RETI
-            uint8_t nparams = (op == Op::RET) ? byteFromCode(_currentAddr) : imm;
+            uint8_t nparams = (op == Op::RET) ? uintFromCode() : imm;
             callReturnValue = CallReturnValue(CallReturnValue::Type::ReturnCount, nparams);
         }
         
@@ -631,30 +970,38 @@ CallReturnValue ExecutionUnit::execute()
         // If we were executing an event don't push the return value
         if (_executingEvent) {
             _executingEvent = false;
+            Trace::endAsync(Trace::Span::Event, _eventTraceId);
+            _eventTraceId = 0;
             
             // When we finish executing an event there may be another event pending.
             // Tell the dispatcher to check for this
             _checkForExceptions = true;
-        } else {
+        } else if (executingDelay()) {
             _stack.push(returnedValue);
+        } else {
+            setCallResult(returnedValue);
         }
         
         if (executingDelay()) {
             // Return Delay so we continue to delay.
             return CallReturnValue(CallReturnValue::Type::Delay);
         }
-        DISPATCH;
+        DISPATCH_SAFEPOINT;
     L_MOVE:
-        setInFrame(byteFromCode(_currentAddr), regOrConst());
+        setInFrame(uintFromCode(), regOrConst());
         DISPATCH;
     L_LOADREFK:
-        setInFrame(byteFromCode(_currentAddr), derefId(regOrConst().asIdValue()));
+        ra = uintFromCode();
+        prop = regOrConst().asIdValue();
+        setInFrame(ra, derefId(prop, refCacheFromCode()));
         DISPATCH;
     L_STOREFK:
-        stoIdRef(regOrConst().asIdValue(), regOrConst());
+        prop = regOrConst().asIdValue();
+        rightValue = regOrConst();
+        stoIdRef(prop, rightValue, refCacheFromCode());
         DISPATCH;
     L_LOADPROP:
-        ra = byteFromCode(_currentAddr);
+        ra = uintFromCode();
         leftValue = regOrConst().property(this, (rightValue = regOrConst()).toIdValue(this));
         // TODO: Distinguish between Values that can't have properties and those that can
         //
@@ -674,13 +1021,16 @@ CallReturnValue ExecutionUnit::execute()
         setInFrame(ra, leftValue);
         DISPATCH;
     L_STOPROP:
-        if (!reg(byteFromCode(_currentAddr)).setProperty((leftValue = regOrConst()).toIdValue(this), regOrConst(), Value::SetType::NeverAdd)) {
+        if (!reg(uintFromCode()).setProperty((leftValue = regOrConst()).toIdValue(this), regOrConst(), Value::SetType::NeverAdd)) {
             printError("Property '%s' does not exist", leftValue.toStringPointer(this));
         }
         DISPATCH;
     L_LOADELT:
-        ra = byteFromCode(_currentAddr);
+        ra = uintFromCode();
         leftValue = regOrConst().element(this, (rightValue = regOrConst()));
+        if (OpcodeStats::enabled() && !rightValue.isInteger()) {
+            OpcodeStats::fallback(OpcodeStats::Fallback::LoadEltByName);
+        }
         if (!leftValue) {
             printError("Can't read element '%s' of a non-existant object", rightValue.toStringValue(this).c_str());
         } else {
@@ -688,13 +1038,13 @@ CallReturnValue ExecutionUnit::execute()
         }
         DISPATCH;
     L_STOELT:
-        if (!reg(byteFromCode(_currentAddr)).setElement(this, (leftValue = regOrConst()), regOrConst(), Value::SetType::AddIfNeeded)) {
+        if (!reg(uintFromCode()).setElement(this, (leftValue = regOrConst()), regOrConst(), Value::SetType::AddIfNeeded)) {
             printError("Element '%s' does not exist", leftValue.toStringValue(this).c_str());
         }
         DISPATCH;
     L_LOADUP:
-        ra = byteFromCode(_currentAddr);
-        if (!_function->loadUpValue(this, byteFromCode(_currentAddr), rightValue)) {
+        ra = uintFromCode();
+        if (!_function->loadUpValue(this, uintFromCode(), rightValue)) {
             printError("unable to load upValue");
         } else {
             setInFrame(ra, rightValue);
@@ -702,39 +1052,39 @@ CallReturnValue ExecutionUnit::execute()
         DISPATCH;
     L_LOADLITA:
         objectValue = Object::create<MaterArray>();
-        setInFrame(byteFromCode(_currentAddr), Value(objectValue));
+        setInFrame(uintFromCode(), Value(objectValue));
         DISPATCH;
     L_LOADLITO:
         objectValue = Object::create<MaterObject>();
-        setInFrame(byteFromCode(_currentAddr), Value(objectValue));
+        setInFrame(uintFromCode(), Value(objectValue));
         DISPATCH;
     L_APPENDPROP:
-        if (!reg(byteFromCode(_currentAddr)).setProperty((leftValue = regOrConst()).toIdValue(this), regOrConst(), Value::SetType::AlwaysAdd)) {
+        if (!reg(uintFromCode()).setProperty((leftValue = regOrConst()).toIdValue(this), regOrConst(), Value::SetType::AlwaysAdd)) {
             printError("Property '%s' already exists for APPENDPROP", leftValue.toStringPointer(this));
         }
         DISPATCH;
     L_APPENDELT:
-        if (!reg(byteFromCode(_currentAddr)).setElement(this, Value(), (leftValue = regOrConst()), Value::SetType::AlwaysAdd)) {
+        if (!reg(uintFromCode()).setElement(this, Value(), (leftValue = regOrConst()), Value::SetType::AlwaysAdd)) {
             printError("Can't append element '%s' to object", leftValue.toStringValue(this).c_str());
         }
         DISPATCH;
     L_LOADTRUE:
-        setInFrame(byteFromCode(_currentAddr), Value(true));
+        setInFrame(uintFromCode(), Value(true));
         DISPATCH;
     L_LOADFALSE:
-        setInFrame(byteFromCode(_currentAddr), Value(false));
+        setInFrame(uintFromCode(), Value(false));
         DISPATCH;
     L_LOADNULL:
-        setInFrame(byteFromCode(_currentAddr), Value());
+        setInFrame(uintFromCode(), Value());
         DISPATCH;
     L_LOADTHIS:
-        setInFrame(byteFromCode(_currentAddr), Value(_this));
+        setInFrame(uintFromCode(), Value(_this));
         DISPATCH;
     L_PUSH:
         _stack.push(regOrConst());
         DISPATCH;
     L_POP:
-        setInFrame(byteFromCode(_currentAddr), _stack.top());
+        setInFrame(uintFromCode(), _stack.top());
         _stack.pop();
         DISPATCH;
     L_POPX:
@@ -742,13 +1092,13 @@ CallReturnValue ExecutionUnit::execute()
         DISPATCH;
     L_LOR:
     L_LAND:
-        ra = byteFromCode(_currentAddr);
+        ra = uintFromCode();
         leftBoolValue = regOrConst().toBoolValue(this);
         rightBoolValue = regOrConst().toBoolValue(this);
         setInFrame(ra, (op == Op::LOR) ? Value(leftBoolValue || rightBoolValue) : Value(leftBoolValue && rightBoolValue));
         DISPATCH;
     L_BINIOP:
-        ra = byteFromCode(_currentAddr);
+        ra = uintFromCode();
         leftIntValue = regOrConst().toIntValue(this);
         rightIntValue = regOrConst().toIntValue(this);
         switch(op) {
@@ -765,25 +1115,25 @@ CallReturnValue ExecutionUnit::execute()
         setInFrame(ra, Value(leftIntValue));
         DISPATCH;
     L_EQ: 
-        setInFrame(byteFromCode(_currentAddr), Value(compareValues(regOrConst(), regOrConst()) == 0));
+        setInFrame(uintFromCode(), Value(compareValues(regOrConst(), regOrConst()) == 0));
         DISPATCH;
     L_NE: 
-        setInFrame(byteFromCode(_currentAddr), Value(compareValues(regOrConst(), regOrConst()) != 0));
+        setInFrame(uintFromCode(), Value(compareValues(regOrConst(), regOrConst()) != 0));
         DISPATCH;
     L_LT: 
-        setInFrame(byteFromCode(_currentAddr), Value(compareValues(regOrConst(), regOrConst()) < 0));
+        setInFrame(uintFromCode(), Value(compareValues(regOrConst(), regOrConst()) < 0));
         DISPATCH;
     L_LE: 
-        setInFrame(byteFromCode(_currentAddr), Value(compareValues(regOrConst(), regOrConst()) <= 0));
+        setInFrame(uintFromCode(), Value(compareValues(regOrConst(), regOrConst()) <= 0));
         DISPATCH;
     L_GT: 
-        setInFrame(byteFromCode(_currentAddr), Value(compareValues(regOrConst(), regOrConst()) > 0));
+        setInFrame(uintFromCode(), Value(compareValues(regOrConst(), regOrConst()) > 0));
         DISPATCH;
     L_GE: 
-        setInFrame(byteFromCode(_currentAddr), Value(compareValues(regOrConst(), regOrConst()) >= 0));
+        setInFrame(uintFromCode(), Value(compareValues(regOrConst(), regOrConst()) >= 0));
         DISPATCH;
     L_SUB:
-        ra = byteFromCode(_currentAddr);
+        ra = uintFromCode();
         leftValue = regOrConst();
         rightValue = regOrConst();
         if (valuesAreInt(leftValue, rightValue)) {
@@ -793,7 +1143,7 @@ CallReturnValue ExecutionUnit::execute()
         }
         DISPATCH;
     L_MUL:
-        ra = byteFromCode(_currentAddr);
+        ra = uintFromCode();
         leftValue = regOrConst();
         rightValue = regOrConst();
         if (valuesAreInt(leftValue, rightValue)) {
@@ -803,7 +1153,7 @@ CallReturnValue ExecutionUnit::execute()
         }
         DISPATCH;
     L_DIV:
-        ra = byteFromCode(_currentAddr);
+        ra = uintFromCode();
         leftValue = regOrConst();
         rightValue = regOrConst();
         if (valuesAreInt(leftValue, rightValue)) {
@@ -813,7 +1163,7 @@ CallReturnValue ExecutionUnit::execute()
         }
         DISPATCH;
     L_MOD: 
-        ra = byteFromCode(_currentAddr);
+        ra = uintFromCode();
         leftValue = regOrConst();
         rightValue = regOrConst();
         if (valuesAreInt(leftValue, rightValue)) {
@@ -823,20 +1173,22 @@ CallReturnValue ExecutionUnit::execute()
         }
         DISPATCH;
     L_ADD:
-        ra = byteFromCode(_currentAddr);
+        ra = uintFromCode();
         leftValue = regOrConst();
         rightValue = regOrConst();
         if (valuesAreInt(leftValue, rightValue)) {
             setInFrame(ra, Value(leftValue.asIntValue() + rightValue.asIntValue()));
         } else if (leftValue.isNumber() && rightValue.isNumber()) {
+            OpcodeStats::fallback(OpcodeStats::Fallback::AddFloat);
             setInFrame(ra, Value(leftValue.toFloatValue(this) + rightValue.toFloatValue(this)));
         } else {
+            OpcodeStats::fallback(OpcodeStats::Fallback::AddString);
             Mad<String> string = ExecutionUnit::createString(leftValue.toStringValue(this) + rightValue.toStringValue(this));
             setInFrame(ra, Value(string));
         }
         DISPATCH;
     L_UMINUS:
-        ra = byteFromCode(_currentAddr);
+        ra = uintFromCode();
         leftValue = regOrConst();
         if (leftValue.isInteger()) {
             setInFrame(ra, Value(-leftValue.asIntValue()));
@@ -845,37 +1197,37 @@ CallReturnValue ExecutionUnit::execute()
         }
         DISPATCH;
     L_UNEG:
-        setInFrame(byteFromCode(_currentAddr), Value((regOrConst().toIntValue(this) == 0) ? 1 : 0));
+        setInFrame(uintFromCode(), Value((regOrConst().toIntValue(this) == 0) ? 1 : 0));
         DISPATCH;
     L_UNOT:
-        setInFrame(byteFromCode(_currentAddr), Value(~(regOrConst().toIntValue(this))));
+        setInFrame(uintFromCode(), Value(~(regOrConst().toIntValue(this))));
         DISPATCH;
     L_PREINC:
-        ra = byteFromCode(_currentAddr);
-        rb = byteFromCode(_currentAddr);
+        ra = uintFromCode();
+        rb = uintFromCode();
         setInFrame(rb, Value(reg(rb).toIntValue(this) + 1));
         setInFrame(ra, reg(rb));
         DISPATCH;
     L_PREDEC:
-        ra = byteFromCode(_currentAddr);
-        rb = byteFromCode(_currentAddr);
+        ra = uintFromCode();
+        rb = uintFromCode();
         setInFrame(rb, Value(reg(rb).toIntValue(this) - 1));
         setInFrame(ra, reg(rb));
         DISPATCH;
     L_POSTINC:
-        ra = byteFromCode(_currentAddr);
-        rb = byteFromCode(_currentAddr);
+        ra = uintFromCode();
+        rb = uintFromCode();
         setInFrame(ra, reg(rb));
         setInFrame(rb, Value(reg(rb).toIntValue(this) + 1));
         DISPATCH;
     L_POSTDEC:
-        ra = byteFromCode(_currentAddr);
-        rb = byteFromCode(_currentAddr);
+        ra = uintFromCode();
+        rb = uintFromCode();
         setInFrame(ra, reg(rb));
         setInFrame(rb, Value(reg(rb).toIntValue(this) - 1));
         DISPATCH;
     L_CLOSURE: {
-        ra = byteFromCode(_currentAddr);
+        ra = uintFromCode();
         Mad<Closure> closure = Object::create<Closure>();
         closure->init(this, regOrConst(), _this.valid() ? Value(_this) : Value());
         setInFrame(ra, Value(static_cast<Mad<Object>>(closure)));
@@ -883,25 +1235,66 @@ CallReturnValue ExecutionUnit::execute()
     }
     L_NEW:
     L_CALL:
-    L_CALLPROP: {
+    L_TAILCALL:
+    L_CALLPROP:
+    L_ITERINIT:
+    L_ITERNEXT: {
+        ra = 0;
+        if (op == Op::ITERNEXT) {
+            ra = uintFromCode();
+        }
         leftValue = regOrConst();
-        rightValue = (op != Op::NEW) ? regOrConst() : Value();
-        uintValue = byteFromCode(_currentAddr);
+        rightValue = (op == Op::CALL || op == Op::TAILCALL || op == Op::CALLPROP) ? regOrConst() : Value();
+        uintValue = (op != Op::ITERINIT) ? uintFromCode() : 0;
         Atom name;
 
         switch(op) {
             default: break;
-            case Op::CALL: {
+            case Op::ITERINIT:
+                // The immediate bit is set when the loop must use an Iterator object
+                callReturnValue = iterInit(leftValue, imm != 0, uintValue);
+                break;
+            case Op::ITERNEXT: {
+                // The operand is the IterOp. Only SetValue has a param
+                IterOp iterOp = static_cast<IterOp>(uintValue);
+                uintValue = (iterOp == IterOp::SetValue) ? 1 : 0;
+                callReturnValue = iterNext(iterOp, ra, leftValue, uintValue);
+                break;
+            }
+            case Op::CALL:
+            case Op::TAILCALL: {
+                Metrics::increment(Metrics::Counter::Calls);
                 if (!rightValue) {
                     rightValue = Value(_this);
                 }
+                
+                // Script functions are started directly, without the virtual call
+                objectValue = leftValue.asObject();
+                if (objectValue.valid() && (objectValue->isFunction() || objectValue->isClosure())) {
+                    if (objectValue->isClosure()) {
+                        const Value& closureThis = Mad<Closure>(objectValue.raw())->thisValue();
+                        if (closureThis) {
+                            rightValue = closureThis;
+                        }
+                    }
+                    if (op == Op::TAILCALL && !_callRecords.empty()) {
+                        tailCallFunction(objectValue, rightValue.asObject(), uintValue);
+                    } else {
+                        startFunction(objectValue, rightValue.asObject(), uintValue);
+                    }
+                    DISPATCH_SAFEPOINT;
+                }
+                
+                OpcodeStats::fallback(OpcodeStats::Fallback::CallNative);
                 callReturnValue = leftValue.call(this, rightValue, uintValue);
                 break;
             }
             case Op::NEW:
+                Metrics::increment(Metrics::Counter::Calls);
                 callReturnValue = leftValue.construct(this, uintValue);
                 break;
             case Op::CALLPROP:
+                Metrics::increment(Metrics::Counter::Calls);
                 name = rightValue.asIdValue();
                 callReturnValue = leftValue.callProperty(this, name, uintValue);
                 if (callReturnValue.isError()) {
@@ -929,7 +1322,7 @@ CallReturnValue ExecutionUnit::execute()
         // If the callReturnValue is FunctionStart it means we've called a Function and it just
         // setup the EU to execute it. In that case just continue
         if (callReturnValue.isFunctionStart()) {
-            DISPATCH;
+            DISPATCH_SAFEPOINT;
         }
 
         // Call/new is an expression. It needs to leave one item on the stack. If no values were
@@ -942,13 +1335,15 @@ CallReturnValue ExecutionUnit::execute()
             _stack.pop(callReturnValue.returnCount());
         }
         _stack.pop(uintValue);
-        _stack.push(returnedValue);
         
         if (callReturnValue.isDelay()) {
+            _stack.push(returnedValue);
             startDelay(callReturnValue.delay());
             return callReturnValue;
         }
-        DISPATCH;
+        
+        setCallResult(returnedValue);
+        DISPATCH_SAFEPOINT;
     }
     L_JT:
     L_JF:
@@ -957,14 +1352,71 @@ CallReturnValue ExecutionUnit::execute()
             boolValue = !boolValue;
         }
         if (boolValue) {
-            sNFromCode(_currentAddr);
+            intFromCode();
             DISPATCH;
         }
-        _currentAddr += sNFromCode(_currentAddr) - 4;
+        leftIntValue = intFromCode();
+        _currentAddr += leftIntValue;
+        if (leftIntValue < 0) {
+            DISPATCH_SAFEPOINT;
+        }
         DISPATCH;
     L_JMP:
-        _currentAddr += sNFromCode(_currentAddr) - 3;
+        leftIntValue = intFromCode();
+        _currentAddr += leftIntValue;
+        if (leftIntValue < 0) {
+            DISPATCH_SAFEPOINT;
+        }
+        DISPATCH;
+    L_SWITCH: {
+        leftValue = regOrConst();
+        const SwitchTable* table = switchTableFromCode();
+        _currentAddr += table->find(this, leftValue);
+        DISPATCH;
+    }
+    L_FORPREP:
+    L_FORLOOP: {
+        ra = uintFromCode();
+        rightValue = regOrConst();
+        leftValue = (op == Op::FORLOOP) ? regOrConst() : Value();
+        int32_t offset = intFromCode();
+        
+        if (op == Op::FORLOOP) {
+            // Step the index the same way PREINC and PREDEC do
+            if (valuesAreInt(reg(ra), leftValue)) {
+                leftIntValue = reg(ra).asIntValue() + leftValue.asIntValue();
+            } else {
+                leftIntValue = reg(ra).toIntValue(this) + leftValue.toIntValue(this);
+            }
+            setInFrame(ra, Value(leftIntValue));
+        } else {
+            leftIntValue = reg(ra).isInteger() ? reg(ra).asIntValue() : 0;
+        }
+        
+        // Compare the index and end values directly if they are both ints
+        if (reg(ra).isInteger() && rightValue.isInteger()) {
+            rightIntValue = rightValue.asIntValue();
+            rightIntValue = (leftIntValue < rightIntValue) ? -1 : ((leftIntValue > rightIntValue) ? 1 : 0);
+        } else {
+            rightIntValue = compareValues(reg(ra), rightValue);
+        }
+        
+        switch (static_cast<ForTest>(imm)) {
+            case ForTest::LT: boolValue = rightIntValue < 0; break;
+            case ForTest::LE: boolValue = rightIntValue <= 0; break;
+            case ForTest::GT: boolValue = rightIntValue > 0; break;
+            case ForTest::GE: boolValue = rightIntValue >= 0; break;
+        }
+        
+        // FORPREP jumps to the exit if the test fails, FORLOOP jumps back to the body if it passes
+        if (boolValue == (op == Op::FORLOOP)) {
+            _currentAddr += offset;
+            if (offset < 0) {
+                DISPATCH_SAFEPOINT;
+            }
+        }
         DISPATCH;
+    }
 }
 
 m8r::String ExecutionUnit::debugString(uint16_t index)
@@ -13,6 +13,9 @@
 
 #include "Atom.h"
 #include "Closure.h"
+#include "Metrics.h"
+#include "OpcodeStats.h"
+#include "Profiler.h"
 #include "Program.h"
 #include "Task.h"
 
@@ -30,6 +33,7 @@ public:
     ~ExecutionUnit();
     
     virtual void gcMark() override;
+    void heapSnapshotRoots(HeapSnapshot&);
 
     // Executable overrides
     virtual bool load(const m8r::Stream&) override;
@@ -54,8 +58,16 @@ public:
     
     const m8r::Mad<Program> program() const { return _program; }
     
+    // Handlers used in threaded code. Null until execute() has run
+    static const void* const* handlers() { return _handlers; }
+    
     uint32_t argumentCount() const { return _actualParamCount; }
-    Value& argument(int32_t i) { return _stack.inFrame(i); }
+    
+    // Extra args (beyond the formal params) are placed just below the frame
+    Value& argument(int32_t i)
+    {
+        return (i < _formalParamCount) ? _stack.inFrame(i) : _stack.inFrame(i - static_cast<int32_t>(_actualParamCount));
+    }
     
     void fireEvent(const Value& func, const Value& thisValue, const Value* args, int32_t nargs);
     
@@ -70,13 +82,28 @@ public:
     void stopEventListening() { _numEventListeners--; }
 
     uint32_t upValueStackIndex(uint32_t index, uint16_t frame) const;
-    void addOpenUpValue(const m8r::SharedPtr<UpValue>& upValue) { _openUpValues.push_back(upValue); }
+    m8r::SharedPtr<UpValue> openUpValue(uint32_t stackIndex);
     
     m8r::Mad<Callable> currentFunction() const { return _function; }
     
-    uint32_t lineno() const { return _lineno; }
+    // Line number of the instruction being executed, from the Function's line table
+    uint32_t lineno() const
+    {
+        return (_threadedCode && _currentAddr > _code) ? _function->lineno(_threadedCode->addrFromIndex(static_cast<uint32_t>(_currentAddr - _code) - 1)) : 0;
+    }
 
     m8r::String debugString(uint16_t index);
+    
+    // Samples are taken while running. When started by the host, the folded
+    // stacks are printed when the program ends
+    void startProfiling(uint32_t intervalUs, bool printOnExit = false)
+    {
+        _profiler.clear();
+        _profiler.start(m8r::Time::now().us(), intervalUs);
+        _printProfileOnExit = printOnExit;
+    }
+    void stopProfiling() { _profiler.stop(); }
+    const Profiler& profiler() const { return _profiler; }
 
     static m8r::Mad<m8r::String> createString(const m8r::String& other);
     static m8r::Mad<m8r::String> createString(m8r::String&& other);
@@ -86,92 +113,170 @@ public:
 
     void startFunction(m8r::Mad<Object> function, m8r::Mad<Object> thisObject, uint32_t nparams);
 
+    int compareValues(const Value& a, const Value& b);
+
 private:
     static constexpr uint32_t MaxRunTimeErrrors = 30;
     static constexpr uint32_t DelayThreadSize = 1024;
     
-    Op checkForExceptions(uint8_t& imm)
+    // Each call to execute() runs for at most QuantumUs before yielding. The time is
+    // only checked every SafepointsPerTimeCheck safepoints
+    static constexpr uint64_t QuantumUs = 10000;
+    static constexpr uint32_t SafepointsPerTimeCheck = 64;
+    
+    // Returns true if op has been set to the instruction to run instead of the next one
+    bool checkForExceptions(Op& op)
     {
         _checkForExceptions = false;
         if (_terminate) {
             _yield = false;
-            return Op::END;
+            op = Op::END;
+            return true;
         }
         if (_yield) {
             _yield = false;
-            return Op::YIELD;
+            op = Op::YIELD;
+            return true;
         }
         if (!_eventQueue.empty() && !_executingEvent) {
-            return Op::YIELD;
+            op = Op::YIELD;
+            return true;
         }
-        return opFromCode(_currentAddr, imm);
+        return false;
     }
     
-    Op dispatchNextOp(uint8_t& imm)
+    // Returns the handler of the next instruction in the threaded code
+    const void* dispatchNextOp(Op& op, uint8_t& imm)
     {
-        return _checkForExceptions ? checkForExceptions(imm) : opFromCode(_currentAddr, imm);
+        if (Metrics::counted(Metrics::Counter::Instructions)) {
+            ++_instructionCount;
+        }
+        _threadedCode->count(static_cast<uint32_t>(_currentAddr - _code));
+        const void* handler = reinterpret_cast<const void*>(*_currentAddr++);
+        uint8_t opByte = static_cast<uint8_t>(*_currentAddr++);
+        op = opFromByte(opByte);
+        imm = immFromByte(opByte);
+        OpcodeStats::dispatched(op);
+        return handler;
+    }
+    
+    // Exceptions (yield, terminate and pending events) are only checked at safepoints:
+    // backward jumps, calls and returns. Any loop or recursion passes through one, so
+    // they are seen promptly, while straight line code runs without checks
+    bool atSafepoint(Op& op)
+    {
+        if (--_safepointsUntilTimeCheck == 0) {
+            checkQuantum();
+        }
+        return _checkForExceptions && checkForExceptions(op);
+    }
+    
+    void startQuantum();
+    void checkQuantum();
+    
+    // Instructions are added to their counter in bulk, at the end of each
+    // quantum and when execute() returns
+    void flushInstructionCount()
+    {
+        if (Metrics::counted(Metrics::Counter::Instructions)) {
+            Metrics::increment(Metrics::Counter::Instructions, _instructionCount);
+            _instructionCount = 0;
+        }
     }
     
+    class InstructionCountScope {
+    public:
+        InstructionCountScope(ExecutionUnit* eu) : _eu(eu) { }
+        ~InstructionCountScope() { _eu->flushInstructionCount(); }
+        
+    private:
+        ExecutionUnit* _eu;
+    };
+    
+    void sampleStack(uint32_t weight);
+    Profiler::Frame profileFrame(const m8r::Mad<Object>& function, uint32_t index) const;
+    void printProfile() const;
+    
     m8r::CallReturnValue endFunction();
+    void tailCallFunction(m8r::Mad<Object> function, m8r::Mad<Object> thisObject, uint32_t nparams);
+    void enterFunction(m8r::Mad<Object> function, m8r::Mad<Object> thisObject, uint32_t nparams, uint32_t& prevFrame, uint32_t& localsAdded);
+    
+    void moveExtraParams(uint32_t nparams, uint32_t extra);
+    void setCallResult(const Value&);
     m8r::CallReturnValue runNextEvent();
+    void clearEventQueue();
 
     void printError(const char* s, ...) const;
     void printError(m8r::Error) const;
     
     Value* valueFromId(m8r::Atom, const Object*) const;
 
+    // Handlers aren't known until execute() has run. Until then _code is null
+    // and execute() calls this again before running anything
     void updateCodePointer()
     {
-        _code = _function.valid() ? &(_function->code()->front()) : nullptr;
+        _threadedCode = (_function.valid() && _handlers) ? _function->threadedCode(_handlers) : nullptr;
+        _code = (_threadedCode && !_threadedCode->empty()) ? _threadedCode->code() : nullptr;
         _currentAddr = _code;
     }
     
-    Value derefId(m8r::Atom);
-    void stoIdRef(m8r::Atom, const Value&);
+    Value derefId(m8r::Atom, ThreadedCode::RefCache*);
+    void stoIdRef(m8r::Atom, const Value&, ThreadedCode::RefCache*);
+    void fillRefCache(ThreadedCode::RefCache*, Value* slot, const Value& value);
+    
+    int32_t iterationCount(const Value& collection);
+    m8r::CallReturnValue iterInit(const Value& collection, bool makeIterator, uint32_t& nparams);
+    m8r::CallReturnValue iterNext(IterOp, uint8_t cursorReg, const Value& collection, uint32_t nparams);
     
     void setInFrame(uint32_t r, const Value& v)
     {
         assert(r <= MaxRegister);
-        if (r >= _formalParamCount) {
-            r += _localOffset;
-        }
         _stack.atFrame(r) = v;
     }
     
-    void closeUpValues(uint32_t frame);
+    // Close the open UpValues at or above base. The list is sorted, so
+    // this only looks at the head when the frame captured nothing
+    void closeUpValues(uint32_t base)
+    {
+        while (_openUpValues && _openUpValues->stackIndex() >= base) {
+            m8r::SharedPtr<UpValue> upValue = _openUpValues;
+            _openUpValues = upValue->next();
+            upValue->next() = m8r::SharedPtr<UpValue>();
+            upValue->close(this);
+        }
+    }
+    
+    // Start of the current frame on the stack, including extra params below it
+    uint32_t frameBase() const
+    {
+        return _stack.frame() - ((_actualParamCount > _formalParamCount) ? (_actualParamCount - _formalParamCount) : 0);
+    }
     
     Value& reg(uint32_t r)
     {
         assert(r <= MaxRegister);
-        if (r >= _formalParamCount) {
-            r += _localOffset;
-        }
         return _stack.atFrame(r);
     }
     
     
+    // Operands in the threaded code are one word each. See ThreadedCode
+    uint32_t uintFromCode() { return static_cast<uint32_t>(*_currentAddr++); }
+    int32_t intFromCode() { return static_cast<int32_t>(static_cast<intptr_t>(*_currentAddr++)); }
+    
     const Value regOrConst()
     {
-        uint32_t r = byteFromCode(_currentAddr);
-        if (r <= MaxRegister) {
-            return reg(r);
-        }
-
-        if (shortSharedAtomConstant(r)) {
-            return Value(m8r::Atom(byteFromCode(_currentAddr)));
-        } else if (longSharedAtomConstant(r)) {
-            return Value(m8r::Atom(uNFromCode(_currentAddr)));
-        } else {
-            Value value;
-            _function->constant(r, value);
-            return value;
+        ThreadedCode::Word w = *_currentAddr++;
+        if (w <= MaxRegister) {
+            return reg(static_cast<uint32_t>(w));
         }
+        return *reinterpret_cast<const Value*>(w);
     }
     
+    ThreadedCode::RefCache* refCacheFromCode() { return reinterpret_cast<ThreadedCode::RefCache*>(*_currentAddr++); }
+    const SwitchTable* switchTableFromCode() { return reinterpret_cast<const SwitchTable*>(*_currentAddr++); }
+    
     bool isConstant(uint32_t r) { return r > MaxRegister; }
 
-    int compareValues(const Value& a, const Value& b);
-    
     bool executingDelay() const
     {
         if (_callRecords.empty()) {
@@ -195,13 +300,12 @@ private:
     
     struct CallRecord {
         CallRecord() { }
-        CallRecord(uint32_t pc, uint32_t frame, m8r::Mad<Object> func, m8r::Mad<Object> thisObj, uint32_t paramCount, uint32_t lineno, uint32_t localsAdded)
+        CallRecord(uint32_t pc, uint32_t frame, m8r::Mad<Object> func, m8r::Mad<Object> thisObj, uint32_t paramCount, uint32_t localsAdded)
             : _pc(pc)
             , _paramCount(paramCount)
             , _frame(frame)
             , _func(func)
             , _thisObj(thisObj)
-            , _lineno(lineno)
             , _localsAdded(localsAdded)
         { }
         
@@ -210,7 +314,6 @@ private:
         uint32_t _frame;
         m8r::Mad<Object> _func;
         m8r::Mad<Object> _thisObj;
-        uint32_t _lineno = 0;
         uint32_t _localsAdded = 0;
         bool _executingDelay = false;
     };
@@ -225,12 +328,14 @@ private:
     m8r::Mad<Program> _program;
     m8r::Mad<Object> _function;
     m8r::Mad<Object> _this;
-    uint32_t _localOffset = 0;
     uint16_t _formalParamCount = 0;
     uint32_t _actualParamCount = 0;
 
-    const uint8_t* _code = nullptr;
-    const uint8_t* _currentAddr = nullptr;
+    static const void* const* _handlers;
+    
+    const ThreadedCode* _threadedCode = nullptr;
+    const ThreadedCode::Word* _code = nullptr;
+    const ThreadedCode::Word* _currentAddr = nullptr;
     
     mutable uint32_t _nerrors = 0;
     
@@ -238,15 +343,24 @@ private:
 
     bool _executingEvent = false;
     bool _delayComplete = true;
+    
+    // Ids of the async trace spans of the running event and delay
+    uint16_t _eventTraceId = 0;
+    uint16_t _delayTraceId = 0;
     mutable bool _checkForExceptions = false;
     mutable bool _terminate = false;
     mutable bool _yield = false;
     
-    uint32_t _numEventListeners = 0;
+    uint64_t _quantumStart = 0;
+    uint32_t _safepointsUntilTimeCheck = SafepointsPerTimeCheck;
+    uint32_t _instructionCount = 0;
     
-    uint32_t _lineno = 0;
+    Profiler _profiler;
+    bool _printProfileOnExit = false;
+    
+    uint32_t _numEventListeners = 0;
     
-    m8r::Vector<m8r::SharedPtr<UpValue>> _openUpValues;
+    m8r::SharedPtr<UpValue> _openUpValues;
     
     Value _consoleListener;
     
@@ -17,20 +17,20 @@
 using namespace m8rscript;
 using namespace m8r;
 
-static StaticObject::StaticFunctionProperty _propsFS[] =
+static const StaticObject::StaticFunctionProperty _propsFS[] =
 {
+    { SA::errorString, FSProto::errorString },
+    { SA::format, FSProto::format },
+    { SA::lastError, FSProto::lastError },
+    { SA::makeDirectory, FSProto::makeDirectory },
     { SA::mount, FSProto::mount },
     { SA::mounted, FSProto::mounted },
-    { SA::unmount, FSProto::unmount },
-    { SA::format, FSProto::format },
     { SA::open, FSProto::open },
     { SA::openDirectory, FSProto::openDirectory },
-    { SA::makeDirectory, FSProto::makeDirectory },
     { SA::remove, FSProto::remove },
     { SA::rename, FSProto::rename },
     { SA::stat, FSProto::stat },
-    { SA::lastError, FSProto::lastError },
-    { SA::errorString, FSProto::errorString },
+    { SA::unmount, FSProto::unmount },
 };
 
 FSProto::FSProto()
@@ -108,17 +108,17 @@ CallReturnValue FSProto::errorString(ExecutionUnit* eu, Value thisValue, uint32_
     return CallReturnValue(CallReturnValue::Type::ReturnCount, 0);
 }
 
-static StaticObject::StaticFunctionProperty _propsFile[] =
+static const StaticObject::StaticFunctionProperty _propsFile[] =
 {
-    { SA::constructor, FileProto::constructor },
     { SA::close, FileProto::close },
-    { SA::read, FileProto::read },
-    { SA::write, FileProto::write },
-    { SA::seek, FileProto::seek },
+    { SA::constructor, FileProto::constructor },
     { SA::eof, FileProto::eof },
-    { SA::valid, FileProto::valid },
     { SA::error, FileProto::error },
+    { SA::read, FileProto::read },
+    { SA::seek, FileProto::seek },
     { SA::type, FileProto::type },
+    { SA::valid, FileProto::valid },
+    { SA::write, FileProto::write },
 };
 
 FileProto::FileProto()
@@ -263,15 +263,15 @@ CallReturnValue FileProto::type(ExecutionUnit* eu, Value thisValue, uint32_t npa
     return CallReturnValue(CallReturnValue::Type::ReturnCount, 0);
 }
 
-static StaticObject::StaticFunctionProperty _propsDirectory[] =
+static const StaticObject::StaticFunctionProperty _propsDirectory[] =
 {
     { SA::constructor, DirectoryProto::constructor },
+    { SA::error, DirectoryProto::error },
     { SA::name, DirectoryProto::name },
+    { SA::next, DirectoryProto::next },
     { SA::size, DirectoryProto::size },
     { SA::type, DirectoryProto::type },
     { SA::valid, DirectoryProto::valid },
-    { SA::error, DirectoryProto::error },
-    { SA::next, DirectoryProto::next },
 };
 
 DirectoryProto::DirectoryProto()
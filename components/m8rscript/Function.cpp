@@ -10,12 +10,18 @@
 #include "Function.h"
 
 #include "ExecutionUnit.h"
+#include "HeapSnapshot.h"
+#include "OpenAddressing.h"
+#include "Program.h"
+#include <algorithm>
+#include <limits>
 
 using namespace m8rscript;
 using namespace m8r;
 
 Function::Function()
 {
+    setIsFunction();
 }
 
 bool Function::builtinConstant(uint8_t reg, Value& value)
@@ -39,6 +45,32 @@ bool Function::builtinConstant(uint8_t reg, Value& value)
     }
 }
 
+void Function::setCode(const uint8_t* code, uint32_t size)
+{
+    // Both are empty, so resize() allocates exactly size entries
+    assert(_code.empty());
+    _code.resize(size);
+    std::copy(code, code + size, _code.begin());
+}
+
+void Function::setConstants(const Value* constants, uint32_t size)
+{
+    assert(_constants.empty());
+    _constants.resize(size);
+    std::copy(constants, constants + size, _constants.begin());
+}
+
+void Function::heapSnapshot(HeapSnapshot& snapshot) const
+{
+    MaterObject::heapSnapshot(snapshot);
+    snapshot.setType("Function", sizeof(Function));
+    snapshot.setName(_name);
+    snapshot.addSize(static_cast<uint32_t>(_code.size() + _constants.size() * sizeof(Value)));
+    for (uint32_t i = 0; i < _constants.size(); ++i) {
+        snapshot.addEdge(HeapSnapshot::Edge::Constant, i, _constants[i]);
+    }
+}
+
 CallReturnValue Function::callProperty(ExecutionUnit* eu, Atom prop, uint32_t nparams)
 {
     if (prop == SAtom(SA::call)) {
@@ -83,3 +115,531 @@ bool Function::loadUpValue(ExecutionUnit* eu, uint32_t index, Value& value) cons
     value = eu->stack().at(eu->upValueStackIndex(_upValues[index]._index, _upValues[index]._frame));
     return true;
 }
+
+bool SwitchTable::init(const Vector<Value>& caseValues, const Program* program)
+{
+    if (caseValues.empty()) {
+        return false;
+    }
+    
+    if (caseValues[0].isInteger()) {
+        int32_t min = std::numeric_limits<int32_t>::max();
+        int32_t max = std::numeric_limits<int32_t>::min();
+        for (auto it : caseValues) {
+            if (!it.isInteger()) {
+                return false;
+            }
+            min = std::min(min, it.asIntValue());
+            max = std::max(max, it.asIntValue());
+        }
+        
+        // Only use a table if it's less than half empty
+        int64_t range = static_cast<int64_t>(max) - static_cast<int64_t>(min) + 1;
+        if (range > static_cast<int64_t>(caseValues.size()) * 2 || range > MaxIntegerRange) {
+            return false;
+        }
+
+        _type = Type::Integer;
+        _min = min;
+        _offsets.resize(static_cast<uint32_t>(range));
+        std::fill(_offsets.begin(), _offsets.end(), 0);
+        return true;
+    }
+    
+    if (!caseValues[0].isStringLiteral()) {
+        return false;
+    }
+    
+    for (auto it : caseValues) {
+        if (!it.isStringLiteral()) {
+            return false;
+        }
+    }
+    
+    // Keep the table at most half full so probes are short and always hit an empty entry
+    uint32_t size = 4;
+    while (size < caseValues.size() * 2) {
+        size *= 2;
+    }
+    
+    _type = Type::String;
+    _entries.resize(size);
+    
+    for (auto it : caseValues) {
+        const char* s = program->stringFromStringLiteral(it.asStringLiteralValue());
+        uint32_t h = OpenAddressing::hash(s);
+        if (!findEntry(s, h, program)) {
+            Entry entry;
+            entry._key = it.asStringLiteralValue();
+            entry._hash = h;
+            OpenAddressing::insert(&(_entries[0]), _entries.size(), h, entry);
+        }
+    }
+    return true;
+}
+
+const SwitchTable::Entry* SwitchTable::findEntry(const char* s, uint32_t h, const Program* program) const
+{
+    return OpenAddressing::find(_entries.empty() ? nullptr : &(_entries[0]), _entries.size(), h, [s, h, program](const Entry& entry) {
+        return entry._hash == h && strcmp(s, program->stringFromStringLiteral(entry._key)) == 0;
+    });
+}
+
+void SwitchTable::setTarget(const Value& caseValue, int16_t offset, const Program* program)
+{
+    if (_type == Type::Integer) {
+        int16_t& target = _offsets[caseValue.asIntValue() - _min];
+        if (target == 0) {
+            target = offset;
+        }
+        return;
+    }
+    
+    const char* s = program->stringFromStringLiteral(caseValue.asStringLiteralValue());
+    Entry* entry = const_cast<Entry*>(findEntry(s, OpenAddressing::hash(s), program));
+    assert(entry);
+    if (entry->_offset == 0) {
+        entry->_offset = offset;
+    }
+}
+
+void SwitchTable::setDefaultTarget(int16_t offset)
+{
+    _defaultOffset = offset;
+    for (auto& it : _offsets) {
+        if (it == 0) {
+            it = offset;
+        }
+    }
+}
+
+int16_t SwitchTable::find(ExecutionUnit* eu, const Value& value) const
+{
+    if (_type == Type::Integer) {
+        if (value.isInteger()) {
+            uint32_t index = static_cast<uint32_t>(value.asIntValue()) - static_cast<uint32_t>(_min);
+            return (index < _offsets.size()) ? _offsets[index] : _defaultOffset;
+        }
+    } else if (value.isString()) {
+        const Program* program = eu->program().get();
+        const char* s = value.toStringPointer(eu);
+        const Entry* entry = findEntry(s, OpenAddressing::hash(s), program);
+        return entry ? entry->_offset : _defaultOffset;
+    }
+    
+    // Not the type of the table. Compare each case so we get the same answer as EQ
+    int16_t offset = _defaultOffset;
+    bool found = false;
+    enumerate([eu, &value, &offset, &found](const Value& caseValue, int16_t caseOffset) {
+        if (!found && eu->compareValues(value, caseValue) == 0) {
+            offset = caseOffset;
+            found = true;
+        }
+    });
+    return offset;
+}
+
+void SwitchTable::enumerate(std::function<void(const Value& caseValue, int16_t offset)> func) const
+{
+    if (_type == Type::Integer) {
+        for (uint32_t i = 0; i < _offsets.size(); ++i) {
+            if (_offsets[i] != _defaultOffset) {
+                func(Value(static_cast<int32_t>(_min + i)), _offsets[i]);
+            }
+        }
+        return;
+    }
+    
+    for (auto it : _entries) {
+        if (it._key) {
+            func(Value(it._key), it._offset);
+        }
+    }
+}
+
+void SwitchTable::mapTargets(std::function<int16_t(int16_t offset)> func)
+{
+    _defaultOffset = func(_defaultOffset);
+    for (auto& it : _offsets) {
+        it = func(it);
+    }
+    for (auto& it : _entries) {
+        if (it._key) {
+            it._offset = func(it._offset);
+        }
+    }
+}
+
+void LineTable::add(uint32_t addr, uint32_t lineno)
+{
+    assert(_table.empty() || addr > _lastAddr);
+    if (!_table.empty() && lineno == _lastLineno) {
+        return;
+    }
+    
+    int32_t linenoDelta = static_cast<int32_t>(lineno - _lastLineno);
+    addNumber(addr - _lastAddr);
+    addNumber((static_cast<uint32_t>(linenoDelta) << 1) ^ static_cast<uint32_t>(linenoDelta >> 31));
+    _lastAddr = addr;
+    _lastLineno = lineno;
+}
+
+uint32_t LineTable::lineno(uint32_t addr) const
+{
+    if (_table.empty()) {
+        return 0;
+    }
+    
+    const uint8_t* p = &(_table[0]);
+    const uint8_t* end = p + _table.size();
+    uint32_t entryAddr = 0;
+    uint32_t lineno = 0;
+    
+    while (p < end) {
+        entryAddr += numberFromTable(p);
+        if (entryAddr > addr) {
+            break;
+        }
+        uint32_t zigzag = numberFromTable(p);
+        lineno += static_cast<uint32_t>(static_cast<int32_t>(zigzag >> 1) ^ -static_cast<int32_t>(zigzag & 1));
+    }
+    return lineno;
+}
+
+void LineTable::addNumber(uint32_t n)
+{
+    while (n >= 0x80) {
+        _table.push_back(static_cast<uint8_t>(n | 0x80));
+        n >>= 7;
+    }
+    _table.push_back(static_cast<uint8_t>(n));
+}
+
+uint32_t LineTable::numberFromTable(const uint8_t*& p)
+{
+    uint32_t n = 0;
+    uint32_t shift = 0;
+    while (*p & 0x80) {
+        n |= static_cast<uint32_t>(*p++ & 0x7f) << shift;
+        shift += 7;
+    }
+    return n | (static_cast<uint32_t>(*p++) << shift);
+}
+
+// Kinds of operands in an instruction. This must match the order the
+// operands are read by each instruction in ExecutionUnit::execute()
+enum class OperandKind : uint8_t { None, R, RK, Byte, UN, SN };
+
+static void operandKinds(Op op, OperandKind kinds[4])
+{
+    using K = OperandKind;
+    
+    auto set = [kinds](K a, K b = K::None, K c = K::None, K d = K::None)
+    {
+        kinds[0] = a;
+        kinds[1] = b;
+        kinds[2] = c;
+        kinds[3] = d;
+    };
+    
+    set(K::None);
+    
+    switch (op) {
+        case Op::MOVE:
+        case Op::LOADREFK:
+        case Op::APPENDELT:
+        case Op::UMINUS:
+        case Op::UNOT:
+        case Op::UNEG:
+        case Op::CLOSURE: set(K::R, K::RK); break;
+        case Op::STOREFK: set(K::RK, K::RK); break;
+        case Op::LOADLITA:
+        case Op::LOADLITO:
+        case Op::LOADTRUE:
+        case Op::LOADFALSE:
+        case Op::LOADNULL:
+        case Op::LOADTHIS:
+        case Op::POP: set(K::R); break;
+        case Op::PUSH:
+        case Op::ITERINIT: set(K::RK); break;
+        case Op::LOADUP: set(K::R, K::Byte); break;
+        case Op::PREINC:
+        case Op::PREDEC:
+        case Op::POSTINC:
+        case Op::POSTDEC: set(K::R, K::R); break;
+        case Op::CALL:
+        case Op::TAILCALL:
+        case Op::CALLPROP: set(K::RK, K::RK, K::Byte); break;
+        case Op::NEW: set(K::RK, K::Byte); break;
+        case Op::ITERNEXT: set(K::R, K::RK, K::Byte); break;
+        case Op::JMP: set(K::SN); break;
+        case Op::JT:
+        case Op::JF: set(K::RK, K::SN); break;
+        case Op::SWITCH: set(K::RK, K::UN); break;
+        case Op::FORPREP: set(K::R, K::RK, K::SN); break;
+        case Op::FORLOOP: set(K::R, K::RK, K::RK, K::SN); break;
+        case Op::RET: set(K::Byte); break;
+        case Op::LOADPROP:
+        case Op::LOADELT:
+        case Op::STOPROP:
+        case Op::STOELT:
+        case Op::APPENDPROP:
+        case Op::LOR: case Op::LAND: case Op::OR: case Op::AND:
+        case Op::XOR: case Op::EQ: case Op::NE: case Op::LT:
+        case Op::LE: case Op::GT: case Op::GE: case Op::SHL:
+        case Op::SHR: case Op::SAR: case Op::ADD: case Op::SUB:
+        case Op::MUL: case Op::DIV: case Op::MOD: set(K::R, K::RK, K::RK); break;
+        default: break;
+    }
+}
+
+// Moves p past the instruction it is at and returns the number of words
+// translate() makes of it
+static uint32_t skipInstruction(const uint8_t*& p)
+{
+    Op op = opFromByte(byteFromCode(p));
+    OperandKind kinds[4];
+    operandKinds(op, kinds);
+    
+    uint32_t words = 2;
+    for (OperandKind kind : kinds) {
+        switch (kind) {
+            case OperandKind::None:
+                continue;
+            case OperandKind::R:
+            case OperandKind::Byte:
+                p += 1;
+                break;
+            case OperandKind::UN:
+            case OperandKind::SN:
+                p += 2;
+                break;
+            case OperandKind::RK:
+                p += constantSize(byteFromCode(p));
+                break;
+        }
+        ++words;
+    }
+    
+    if (op == Op::LOADREFK || op == Op::STOREFK) {
+        ++words;
+    }
+    return words;
+}
+
+void ThreadedCode::translate(const Function* func, const void* const* handlers)
+{
+    _code.clear();
+    _constants.clear();
+    _refCaches.clear();
+    _switchTables.clear();
+    
+    _bytecode = func->code();
+    if (!_bytecode || _bytecode->empty()) {
+        return;
+    }
+    
+    // Constants, jump targets and switch tables aren't known until the whole
+    // function is translated. Remember where they go and fill them in at the end.
+    struct Fixup {
+        uint32_t _index;
+        uint32_t _value;
+    };
+    
+    struct SwitchFixup {
+        uint32_t _index;
+        uint32_t _addr;
+        uint16_t _table;
+    };
+    
+    // Word index of each instruction, by address. Only needed to resolve jumps
+    struct AddrEntry {
+        uint32_t _addr;
+        uint32_t _index;
+    };
+    
+    m8r::Vector<AddrEntry> addrs;
+    m8r::Vector<uint32_t> constantKeys;
+    m8r::Vector<uint16_t> constantSlots;
+    m8r::Vector<Fixup> constantFixups;
+    m8r::Vector<Fixup> jumpFixups;
+    m8r::Vector<SwitchFixup> switchFixups;
+    m8r::Vector<uint32_t> refCacheFixups;
+    
+    const uint8_t* start = &(_bytecode->at(0));
+    const uint8_t* end = start + _bytecode->size();
+    const uint8_t* p = start;
+    
+    while (p < end) {
+        uint32_t addr = static_cast<uint32_t>(p - start);
+        addrs.push_back({ addr, static_cast<uint32_t>(_code.size()) });
+
+        uint8_t opByte = byteFromCode(p);
+        Op op = opFromByte(opByte);
+        _code.push_back(reinterpret_cast<Word>(handlers[static_cast<uint8_t>(op)]));
+        _code.push_back(opByte);
+        
+        OperandKind kinds[4];
+        operandKinds(op, kinds);
+        
+        for (OperandKind kind : kinds) {
+            switch (kind) {
+                case OperandKind::None:
+                    break;
+                case OperandKind::R:
+                case OperandKind::Byte:
+                    _code.push_back(byteFromCode(p));
+                    break;
+                case OperandKind::UN:
+                    if (op == Op::SWITCH) {
+                        switchFixups.push_back({ static_cast<uint32_t>(_code.size()), addr, uNFromCode(p) });
+                        _code.push_back(0);
+                    } else {
+                        _code.push_back(uNFromCode(p));
+                    }
+                    break;
+                case OperandKind::SN:
+                    jumpFixups.push_back({ static_cast<uint32_t>(_code.size()), static_cast<uint32_t>(static_cast<int32_t>(addr) + sNFromCode(p)) });
+                    _code.push_back(0);
+                    break;
+                case OperandKind::RK: {
+                    uint8_t r = byteFromCode(p);
+                    if (r <= MaxRegister) {
+                        _code.push_back(r);
+                        break;
+                    }
+                    
+                    // Key is the constant id in the upper bits, with the atom for atom constants
+                    Value value;
+                    uint32_t key = static_cast<uint32_t>(r) << 16;
+                    if (shortSharedAtomConstant(r)) {
+                        uint16_t atom = byteFromCode(p);
+                        value = Value(Atom(atom));
+                        key |= atom;
+                    } else if (longSharedAtomConstant(r)) {
+                        uint16_t atom = uNFromCode(p);
+                        value = Value(Atom(atom));
+                        key |= atom;
+                    } else {
+                        func->constant(r, value);
+                    }
+                    
+                    // Slots hold the index in constantKeys + 1
+                    const uint16_t* slot = OpenAddressing::find(constantSlots.empty() ? nullptr : &(constantSlots[0]), constantSlots.size(), OpenAddressing::mix(key), [&constantKeys, key](uint16_t slot) {
+                        return constantKeys[slot - 1] == key;
+                    });
+                    uint32_t i;
+                    if (slot) {
+                        i = *slot - 1;
+                    } else {
+                        i = static_cast<uint32_t>(constantKeys.size());
+                        size_t size = OpenAddressing::sizeToAdd(i, constantSlots.size(), 16);
+                        if (size) {
+                            constantSlots.clear();
+                            constantSlots.resize(size);
+                            std::fill(constantSlots.begin(), constantSlots.end(), 0);
+                            for (uint32_t k = 0; k < i; ++k) {
+                                OpenAddressing::insert(&(constantSlots[0]), size, OpenAddressing::mix(constantKeys[k]), static_cast<uint16_t>(k + 1));
+                            }
+                        }
+                        OpenAddressing::insert(&(constantSlots[0]), constantSlots.size(), OpenAddressing::mix(key), static_cast<uint16_t>(i + 1));
+                        constantKeys.push_back(key);
+                        _constants.push_back(value);
+                    }
+                    constantFixups.push_back({ static_cast<uint32_t>(_code.size()), i });
+                    _code.push_back(0);
+                    break;
+                }
+            }
+        }
+        
+        if (op == Op::LOADREFK || op == Op::STOREFK) {
+            refCacheFixups.push_back(static_cast<uint32_t>(_code.size()));
+            _code.push_back(0);
+        }
+    }
+    
+    // Sentinel so a jump to the end of the code can be found
+    addrs.push_back({ static_cast<uint32_t>(_bytecode->size()), static_cast<uint32_t>(_code.size()) });
+    
+    auto indexFromAddr = [&addrs](uint32_t addr)
+    {
+        const AddrEntry* first = &(addrs[0]);
+        const AddrEntry* entry = std::lower_bound(first, first + addrs.size(), addr, [](const AddrEntry& entry, uint32_t addr) {
+            return entry._addr < addr;
+        });
+        assert(entry != first + addrs.size() && entry->_addr == addr);
+        return entry->_index;
+    };
+    
+#if M8RSCRIPT_OPCODE_STATS
+    _counts.clear();
+    _counts.resize(_code.size());
+    for (uint32_t i = 0; i < _counts.size(); ++i) {
+        _counts[i] = 0;
+    }
+#endif
+    
+    for (uint32_t i = 0; i < constantFixups.size(); ++i) {
+        _code[constantFixups[i]._index] = reinterpret_cast<Word>(&(_constants[constantFixups[i]._value]));
+    }
+    
+    _refCaches.resize(refCacheFixups.size());
+    for (uint32_t i = 0; i < refCacheFixups.size(); ++i) {
+        _code[refCacheFixups[i]] = reinterpret_cast<Word>(&(_refCaches[i]));
+    }
+    
+    for (uint32_t i = 0; i < jumpFixups.size(); ++i) {
+        int32_t offset = static_cast<int32_t>(indexFromAddr(jumpFixups[i]._value)) - static_cast<int32_t>(jumpFixups[i]._index + 1);
+        _code[jumpFixups[i]._index] = static_cast<Word>(static_cast<intptr_t>(offset));
+    }
+    
+    // Each SWITCH gets its own table with targets in words, so it is a
+    // single add at runtime rather than a search for the target's word
+    _switchTables.resize(switchFixups.size());
+    for (uint32_t i = 0; i < switchFixups.size(); ++i) {
+        const SwitchFixup& fixup = switchFixups[i];
+        const SwitchTable* table = func->switchTable(fixup._table);
+        assert(table);
+        _switchTables[i] = *table;
+        _switchTables[i].mapTargets([&indexFromAddr, &fixup](int16_t offset) {
+            int32_t words = static_cast<int32_t>(indexFromAddr(fixup._addr + offset)) - static_cast<int32_t>(fixup._index + 1);
+            assert(words >= std::numeric_limits<int16_t>::min() && words <= std::numeric_limits<int16_t>::max());
+            return static_cast<int16_t>(words);
+        });
+        _code[fixup._index] = reinterpret_cast<Word>(&(_switchTables[i]));
+    }
+}
+
+uint32_t ThreadedCode::addrFromIndex(uint32_t index) const
+{
+    if (!_bytecode || _bytecode->empty()) {
+        return 0;
+    }
+    
+    const uint8_t* start = &(_bytecode->at(0));
+    const uint8_t* end = start + _bytecode->size();
+    const uint8_t* p = start;
+    uint32_t next = 0;
+    while (p < end) {
+        const uint8_t* instruction = p;
+        next += skipInstruction(p);
+        if (index < next) {
+            return static_cast<uint32_t>(instruction - start);
+        }
+    }
+    return static_cast<uint32_t>(_bytecode->size());
+}
+
+uint32_t ThreadedCode::indexFromAddr(uint32_t addr) const
+{
+    assert(_bytecode);
+    const uint8_t* start = &(_bytecode->at(0));
+    const uint8_t* p = start;
+    uint32_t index = 0;
+    while (p < start + addr) {
+        index += skipInstruction(p);
+    }
+    assert(p == start + addr);
+    return index;
+}
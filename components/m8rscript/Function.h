@@ -13,9 +13,156 @@
 #include "Containers.h"
 #include "MachineCode.h"
 #include "Object.h"
+#include "OpcodeStats.h"
 
 namespace m8rscript {
 
+class Function;
+class Program;
+
+// SwitchTable - Jump table used by the SWITCH instruction
+//
+// Built by the Parser when every case value of a switch statement is an
+// Integer constant in a dense range, or a string literal. Targets are
+// stored as offsets from the SWITCH instruction. Integer tables index
+// directly by value. String tables are open addressed by hash. Values of
+// any other type do a linear compare of the case values, which gives the
+// same result as the EQ chain the table replaces.
+class SwitchTable {
+public:
+    enum class Type : uint8_t { Integer, String };
+    
+    // Returns false if caseValues can't be put in a table
+    bool init(const m8r::Vector<Value>& caseValues, const Program*);
+    
+    // Set the target for a case value. If the value was already seen the
+    // first target is kept, just like the EQ chain would do
+    void setTarget(const Value& caseValue, int16_t offset, const Program*);
+    
+    // Set the default target. This fills any holes in an Integer table
+    void setDefaultTarget(int16_t offset);
+    
+    // Returns the offset of the jump target from the SWITCH instruction
+    int16_t find(ExecutionUnit*, const Value&) const;
+    
+    void enumerate(std::function<void(const Value& caseValue, int16_t offset)>) const;
+    int16_t defaultOffset() const { return _defaultOffset; }
+    
+    // Replace every target, including the default, with func(target)
+    void mapTargets(std::function<int16_t(int16_t offset)>);
+
+private:
+    static constexpr int64_t MaxIntegerRange = 256;
+    
+    struct Entry {
+        explicit operator bool() const { return bool(_key); }
+        
+        StringLiteral _key;
+        uint32_t _hash = 0;
+        int16_t _offset = 0;
+    };
+    
+    const Entry* findEntry(const char*, uint32_t hash, const Program*) const;
+    
+    Type _type = Type::Integer;
+    int16_t _defaultOffset = 0;
+    int32_t _min = 0;
+    m8r::Vector<int16_t> _offsets;
+    m8r::Vector<Entry> _entries;
+};
+
+// LineTable - Maps code addresses to source line numbers
+//
+// Built by the Parser as it emits code. Each entry is the address where a
+// new line starts and its line number, stored as the difference from the
+// previous entry. Both are variable length numbers, 7 bits per byte with
+// the high bit set on all but the last byte. Line deltas are zigzag encoded
+// so they can be negative. Most entries take 2 bytes. Lookup walks the
+// table from the start, which only happens when printing errors or code.
+class LineTable {
+public:
+    // Entries must be added in increasing address order
+    void add(uint32_t addr, uint32_t lineno);
+    
+    // Returns the line number of the code at addr, or 0 if there is none
+    uint32_t lineno(uint32_t addr) const;
+    
+    bool empty() const { return _table.empty(); }
+    uint32_t size() const { return static_cast<uint32_t>(_table.size()); }
+
+private:
+    void addNumber(uint32_t);
+    static uint32_t numberFromTable(const uint8_t*&);
+    
+    m8r::Vector<uint8_t> _table;
+    uint32_t _lastAddr = 0;
+    uint32_t _lastLineno = 0;
+};
+
+// ThreadedCode - Pre-decoded form of a Function's code, run by the ExecutionUnit
+//
+// The bytecode stays the stored form. The first time a Function is executed it
+// is translated into a series of words. Each instruction is the address of its
+// handler in ExecutionUnit::execute(), the opcode byte (with its immediate bits),
+// then one word per operand. Registers and counts are stored as numbers. Constants
+// are stored as pointers to a Value, so there is no decoding of atoms or lookup
+// of the constant pool at runtime. Registers are never above MaxRegister and
+// pointers always are, which is how the two are told apart. Jump offsets are in
+// words, from the end of the jump instruction. LOADREFK and STOREFK have one more
+// word after their operands, a pointer to the RefCache for that instruction. The
+// table operand of a SWITCH is a pointer to a copy of its SwitchTable, whose
+// targets are in words from the end of the SWITCH like a jump.
+//
+// No map from words to bytecode addresses is kept. Every instruction has a fixed
+// number of words, so addrFromIndex() and indexFromAddr() walk the bytecode from
+// the start. They are only used for line numbers and instruction counts.
+class ThreadedCode {
+public:
+    using Word = uintptr_t;
+    
+    // Where a LOADREFK or STOREFK last found its name outside of 'this', either
+    // a slot in the Program or a Global value. Global values never change. Slots
+    // can only move when a property is added to a Program, so the cache is good
+    // while _epoch is the propertyEpoch() of _program
+    struct RefCache {
+        uint32_t _epoch = 0;
+        const Program* _program = nullptr;
+        Value* _slot = nullptr;
+        Value _value;
+    };
+    
+    void translate(const Function*, const void* const* handlers);
+    
+    bool empty() const { return _code.empty(); }
+    const Word* code() const { return &(_code[0]); }
+    
+    // Convert between word indexes and bytecode addresses. addrFromIndex takes
+    // any index inside an instruction. indexFromAddr needs the start of one.
+    uint32_t addrFromIndex(uint32_t index) const;
+    uint32_t indexFromAddr(uint32_t addr) const;
+
+    // Times each instruction has run. Only kept in a build with M8RSCRIPT_OPCODE_STATS.
+    // count() takes the index of the instruction's first word, executionCount() the
+    // bytecode address of the instruction
+#if M8RSCRIPT_OPCODE_STATS
+    void count(uint32_t index) const { ++_counts[index]; }
+    uint32_t executionCount(uint32_t addr) const { return _counts.empty() ? 0 : _counts[indexFromAddr(addr)]; }
+#else
+    void count(uint32_t) const { }
+    uint32_t executionCount(uint32_t) const { return 0; }
+#endif
+
+private:
+    const InstructionVector* _bytecode = nullptr;
+    m8r::Vector<Word> _code;
+    m8r::Vector<Value> _constants;
+    m8r::Vector<RefCache> _refCaches;
+    m8r::Vector<SwitchTable> _switchTables;
+#if M8RSCRIPT_OPCODE_STATS
+    mutable m8r::Vector<uint32_t> _counts;
+#endif
+};
+
 class Function : public MaterObject {
 public:
     Function();
@@ -37,15 +184,35 @@ public:
         }
     }
 
+    virtual void heapSnapshot(HeapSnapshot&) const override;
+
     virtual const InstructionVector* code() const override { return &_code; }
-    void setCode(const m8r::Vector<uint8_t>& code) { _code = code; }
+    virtual const ThreadedCode* threadedCode(const void* const* handlers) const override
+    {
+        if (_threadedCode.empty()) {
+            _threadedCode.translate(this, handlers);
+        }
+        return &_threadedCode;
+    }
+    // The code and constants are copied in once, when the parser has the
+    // whole function, so each is allocated at its exact size
+    void setCode(const uint8_t* code, uint32_t size);
 
     void setLocalCount(uint16_t size) { _localSize = size; }
     virtual uint16_t localCount() const override { return _localSize; }
     
     virtual m8r::CallReturnValue call(ExecutionUnit*, Value thisValue, uint32_t nparams) override;
 
-    void setConstants(const m8r::Vector<Value>& constants) { _constants = constants; }
+    void setConstants(const Value* constants, uint32_t size);
+    
+    void setSwitchTables(const m8r::Vector<SwitchTable>& tables) { _switchTables = tables; }
+    virtual const SwitchTable* switchTable(uint16_t index) const override
+    {
+        return (index < _switchTables.size()) ? &(_switchTables[index]) : nullptr;
+    }
+
+    void setLineTable(const LineTable& table) { _lineTable = table; }
+    virtual uint32_t lineno(uint32_t addr) const override { return _lineTable.lineno(addr); }
 
     void enumerateConstants(std::function<void(const Value&, const ConstantId&)> func)
     {
@@ -109,8 +276,11 @@ private:
     m8r::Vector<UpValueEntry> _upValues;
     uint16_t _formalParamCount = 0;
     InstructionVector _code;
+    mutable ThreadedCode _threadedCode;
     uint16_t _localSize = 0;
     m8r::Vector<Value> _constants;
+    m8r::Vector<SwitchTable> _switchTables;
+    LineTable _lineTable;
     m8r::Atom _name;
 };
 
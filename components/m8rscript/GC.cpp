@@ -9,11 +9,17 @@
 
 #include "GC.h"
 
+#include "AllocationTracker.h"
+#include "ExecutionUnit.h"
+#include "HeapSnapshot.h"
+#include "Metrics.h"
+#include "Trace.h"
 #include "Containers.h"
 #include "Executable.h"
 #include "Object.h"
 #include "MStream.h"
 #include "SystemInterface.h"
+#include "SystemTime.h"
 
 using namespace m8rscript;
 using namespace m8r;
@@ -29,17 +35,36 @@ uint32_t GC::prevGCStrings = 0;
 uint8_t GC::countSinceLastGC = 0;
 bool GC::inGC = false;
 
+// Adds the time spent in gc() to the pause metric, whichever way it returns
+class GCPauseTimer {
+public:
+    GCPauseTimer() : _start(Metrics::enabled() ? Time::now().us() : 0) { }
+    ~GCPauseTimer()
+    {
+        if (Metrics::enabled()) {
+            Metrics::increment(Metrics::Counter::GCPauseUs, static_cast<uint32_t>(Time::now().us() - _start));
+        }
+    }
+
+private:
+    uint64_t _start;
+};
+
 void GC::gc(bool force)
 {
     if (inGC) {
         return;
     }
     
+    GCPauseTimer pauseTimer;
+    
     force = true;
     
     inGC = true;
     bool didFullCycle = gcState == GCState::ClearMarkedObj;
     while (1) {
+        // Each GCState has a span, in the same order
+        Trace::SpanScope traceSpan(static_cast<Trace::Span>(static_cast<uint16_t>(Trace::Span::GCClearMarkedObj) + static_cast<uint16_t>(gcState)));
         switch(gcState) {
             case GCState::ClearMarkedObj:
                 if (!force && _objectStore.size() - prevGCObjects < MaxGCObjectDiff && _stringStore.size() - prevGCStrings < MaxGCStringDiff && ++countSinceLastGC < MaxCountSinceLastGC) {
@@ -73,9 +98,18 @@ void GC::gc(bool force)
                 gcState = GCState::SweepObj;
                 break;
             case GCState::SweepObj: {
+                // A __destructor can be found through a proto which is garbage
+                // too, so run them all before anything is freed
+                for (RawMad& m : _objectStore) {
+                    Mad<Object> obj = Mad<Object>(m);
+                    if (!obj->isMarked()) {
+                        obj->runDestructor();
+                    }
+                }
                 auto it = std::remove_if(_objectStore.begin(), _objectStore.end(), [](RawMad m) {
                     Mad<Object> obj = Mad<Object>(m);
                     if (!obj->isMarked()) {
+                        AllocationTracker::freed(obj.get());
                         delete obj.get();
                         return true;
                     }
@@ -89,6 +123,7 @@ void GC::gc(bool force)
                 auto it = std::remove_if(_stringStore.begin(), _stringStore.end(), [](RawMad m) {
                     Mad<String> str = Mad<String>(m);
                     if (!str->isMarked()) {
+                        AllocationTracker::freed(str.get());
                         str.destroy();
                         return true;
                     }
@@ -96,6 +131,7 @@ void GC::gc(bool force)
                 });
                 _stringStore.erase(it, _stringStore.end());
                 gcState = GCState::ClearMarkedObj;
+                Metrics::increment(Metrics::Counter::GCCycles);
                 
                 if (!force || didFullCycle) {
                     inGC = false;
@@ -132,6 +168,7 @@ void GC::removeFromStore<MemoryType::Object>(RawMad v)
 {
     auto it = std::find(_objectStore.begin(), _objectStore.end(), v);
     if (it != _objectStore.end()) {
+        AllocationTracker::freed(Mad<Object>(v).get());
         _objectStore.erase(it);
     }
 }
@@ -141,6 +178,7 @@ void GC::removeFromStore<MemoryType::String>(RawMad v)
 {
     auto it = std::find(_stringStore.begin(), _stringStore.end(), v);
     if (it != _stringStore.end()) {
+        AllocationTracker::freed(Mad<String>(v).get());
         _stringStore.erase(it);
     }
 }
@@ -172,3 +210,64 @@ void GC::removeExecutable(const SharedPtr<Executable>& eu)
         _executableStore.erase(it);
     }
 }
+
+void GC::heapSnapshot(HeapSnapshot& snapshot)
+{
+    // Marks are always cleared at the start of a cycle. A cycle left partly
+    // done would have stale marks, so don't snapshot in the middle of one
+    if (inGC || gcState != GCState::ClearMarkedObj) {
+        return;
+    }
+    
+    for (RawMad& it : _objectStore) {
+        Mad<Object>(it)->setMarked(false);
+    }
+    for (RawMad& it : _stringStore) {
+        Mad<String>(it)->setMarked(false);
+    }
+    for (auto it : _executableStore) {
+        it->gcMark();
+    }
+    for (RawMad& it : _staticObjects) {
+        Mad<Object>(it)->gcMark();
+    }
+    
+    for (RawMad& it : _objectStore) {
+        Mad<Object> obj = Mad<Object>(it);
+        if (obj->isMarked()) {
+            snapshot.addNodeId(obj.get());
+        }
+    }
+    for (RawMad& it : _stringStore) {
+        Mad<String> str = Mad<String>(it);
+        if (str->isMarked()) {
+            snapshot.addNodeId(str.get());
+        }
+    }
+    
+    snapshot.startWriting();
+    
+    for (RawMad& it : _objectStore) {
+        Mad<Object> obj = Mad<Object>(it);
+        if (obj->isMarked()) {
+            snapshot.startObjectNode(obj.get());
+            obj->heapSnapshot(snapshot);
+            snapshot.endObjectNode();
+        }
+    }
+    for (RawMad& it : _stringStore) {
+        Mad<String> str = Mad<String>(it);
+        if (str->isMarked()) {
+            snapshot.writeStringNode(str.get(), static_cast<uint32_t>(sizeof(String) + str->size()));
+        }
+    }
+    
+    for (RawMad& it : _staticObjects) {
+        snapshot.addRoot("static", Value(Mad<Object>(it)));
+    }
+    
+    // Only ExecutionUnits are added to the executable store
+    for (auto it : _executableStore) {
+        static_cast<ExecutionUnit*>(it.get())->heapSnapshotRoots(snapshot);
+    }
+}
@@ -15,6 +15,8 @@
 
 namespace m8rscript {
 
+class HeapSnapshot;
+
 class GC {
 public:
     static void gc(bool force = false);
@@ -29,6 +31,10 @@ public:
     static void removeStaticObject(m8r::RawMad);
     static void addExecutable(const m8r::SharedPtr<m8r::Executable>&);
     static void removeExecutable(const m8r::SharedPtr<m8r::Executable>&);
+    
+    // Runs a full mark and writes the marked objects and strings and the roots.
+    // Nothing is swept, so it is safe to call from a native function
+    static void heapSnapshot(HeapSnapshot&);
 
 private:
     static constexpr int32_t MaxGCObjectDiff = 10;
@@ -20,15 +20,15 @@ using namespace m8r;
 PinMode GPIO::_pinMode;
 Trigger GPIO::_trigger;
 
-static StaticObject::StaticFunctionProperty _funcPropsGPIO[] =
+static const StaticObject::StaticFunctionProperty _funcPropsGPIO[] =
 {
-    { SA::setPinMode, GPIO::setPinMode },
-    { SA::digitalWrite, GPIO::digitalWrite },
     { SA::digitalRead, GPIO::digitalRead },
+    { SA::digitalWrite, GPIO::digitalWrite },
     { SA::onInterrupt, GPIO::onInterrupt },
+    { SA::setPinMode, GPIO::setPinMode },
 };
 
-static StaticObject::StaticObjectProperty  _objPropsGPIO[] =
+static const StaticObject::StaticObjectProperty  _objPropsGPIO[] =
 {
     { SA::PinMode, &GPIO::_pinMode },
     { SA::Trigger, &GPIO::_trigger },
@@ -76,13 +76,13 @@ CallReturnValue GPIO::onInterrupt(ExecutionUnit* eu, Value thisValue, uint32_t n
     return CallReturnValue(Error::Code::Unimplemented);
 }
 
-static StaticObject::StaticProperty _propsPinMode[] =
+static const StaticObject::StaticProperty _propsPinMode[] =
 {
-    { SA::Output, Value(static_cast<int32_t>(GPIOInterface::PinMode::Output)) },
-    { SA::OutputOpenDrain, Value(static_cast<int32_t>(GPIOInterface::PinMode::OutputOpenDrain)) },
-    { SA::Input, Value(static_cast<int32_t>(GPIOInterface::PinMode::Input)) },
-    { SA::InputPullup, Value(static_cast<int32_t>(GPIOInterface::PinMode::InputPullup)) },
-    { SA::InputPulldown, Value(static_cast<int32_t>(GPIOInterface::PinMode::InputPulldown)) },
+    { SA::Input, static_cast<int32_t>(GPIOInterface::PinMode::Input) },
+    { SA::InputPulldown, static_cast<int32_t>(GPIOInterface::PinMode::InputPulldown) },
+    { SA::InputPullup, static_cast<int32_t>(GPIOInterface::PinMode::InputPullup) },
+    { SA::Output, static_cast<int32_t>(GPIOInterface::PinMode::Output) },
+    { SA::OutputOpenDrain, static_cast<int32_t>(GPIOInterface::PinMode::OutputOpenDrain) },
 };
 
 PinMode::PinMode()
@@ -90,14 +90,14 @@ PinMode::PinMode()
     setProperties(_propsPinMode, sizeof(_propsPinMode) / sizeof(StaticProperty));
 }
 
-static StaticObject::StaticProperty _propsTrigger[] =
+static const StaticObject::StaticProperty _propsTrigger[] =
 {
-    { SA::None, Value(static_cast<int32_t>(GPIOInterface::Trigger::None)) },
-    { SA::RisingEdge, Value(static_cast<int32_t>(GPIOInterface::Trigger::RisingEdge)) },
-    { SA::FallingEdge, Value(static_cast<int32_t>(GPIOInterface::Trigger::FallingEdge)) },
-    { SA::BothEdges, Value(static_cast<int32_t>(GPIOInterface::Trigger::BothEdges)) },
-    { SA::Low, Value(static_cast<int32_t>(GPIOInterface::Trigger::Low)) },
-    { SA::High, Value(static_cast<int32_t>(GPIOInterface::Trigger::High)) },
+    { SA::BothEdges, static_cast<int32_t>(GPIOInterface::Trigger::BothEdges) },
+    { SA::FallingEdge, static_cast<int32_t>(GPIOInterface::Trigger::FallingEdge) },
+    { SA::High, static_cast<int32_t>(GPIOInterface::Trigger::High) },
+    { SA::Low, static_cast<int32_t>(GPIOInterface::Trigger::Low) },
+    { SA::None, static_cast<int32_t>(GPIOInterface::Trigger::None) },
+    { SA::RisingEdge, static_cast<int32_t>(GPIOInterface::Trigger::RisingEdge) },
 };
 
 Trigger::Trigger()
@@ -33,6 +33,7 @@ static const char _Once[] = "Once";
 static const char _Output[] = "Output";
 static const char _OutputOpenDrain[] = "OutputOpenDrain";
 static const char _PinMode[] = "PinMode";
+static const char _Profiler[] = "Profiler";
 static const char _ReceivedData[] = "ReceivedData";
 static const char _Reconnected[] = "Reconnected";
 static const char _Repeating[] = "Repeating";
@@ -50,8 +51,10 @@ static const char ___impl[] = "__impl";
 static const char ___index[] = "__index";
 static const char ___nativeObject[] = "__nativeObject";
 static const char ___object[] = "__object";
+static const char _annotatedCode[] = "annotatedCode";
 static const char _arguments[] = "arguments";
 static const char _back[] = "back";
+static const char _begin[] = "begin";
 static const char _call[] = "call";
 static const char _close[] = "close";
 static const char _consoleListener[] = "consoleListener";
@@ -64,6 +67,7 @@ static const char _digitalWrite[] = "digitalWrite";
 static const char _disconnect[] = "disconnect";
 static const char _done[] = "done";
 static const char _encode[] = "encode";
+static const char _end[] = "end";
 static const char _env[] = "env";
 static const char _eof[] = "eof";
 static const char _error[] = "error";
@@ -71,6 +75,7 @@ static const char _errorString[] = "errorString";
 static const char _format[] = "format";
 static const char _front[] = "front";
 static const char _getValue[] = "getValue";
+static const char _heapSnapshot[] = "heapSnapshot";
 static const char _import[] = "import";
 static const char _importString[] = "importString";
 static const char _iterator[] = "iterator";
@@ -80,12 +85,14 @@ static const char _length[] = "length";
 static const char _lookupHostname[] = "lookupHostname";
 static const char _makeDirectory[] = "makeDirectory";
 static const char _meminfo[] = "meminfo";
+static const char _metrics[] = "metrics";
 static const char _mount[] = "mount";
 static const char _mounted[] = "mounted";
 static const char _name[] = "name";
 static const char _next[] = "next";
 static const char _null[] = "null";
 static const char _onInterrupt[] = "onInterrupt";
+static const char _opcodeStats[] = "opcodeStats";
 static const char _open[] = "open";
 static const char _openDirectory[] = "openDirectory";
 static const char _parse[] = "parse";
@@ -99,6 +106,7 @@ static const char _push_front[] = "push_front";
 static const char _read[] = "read";
 static const char _remove[] = "remove";
 static const char _rename[] = "rename";
+static const char _result[] = "result";
 static const char _run[] = "run";
 static const char _seek[] = "seek";
 static const char _send[] = "send";
@@ -114,6 +122,8 @@ static const char _toFloat[] = "toFloat";
 static const char _toInt[] = "toInt";
 static const char _toString[] = "toString";
 static const char _toUInt[] = "toUInt";
+static const char _trace[] = "trace";
+static const char _trackAllocations[] = "trackAllocations";
 static const char _trim[] = "trim";
 static const char _type[] = "type";
 static const char _undefined[] = "undefined";
@@ -151,6 +161,7 @@ const char* _m8rscript_sharedAtoms[] = {
     _Output,
     _OutputOpenDrain,
     _PinMode,
+    _Profiler,
     _ReceivedData,
     _Reconnected,
     _Repeating,
@@ -168,8 +179,10 @@ const char* _m8rscript_sharedAtoms[] = {
     ___index,
     ___nativeObject,
     ___object,
+    _annotatedCode,
     _arguments,
     _back,
+    _begin,
     _call,
     _close,
     _consoleListener,
@@ -182,6 +195,7 @@ const char* _m8rscript_sharedAtoms[] = {
     _disconnect,
     _done,
     _encode,
+    _end,
     _env,
     _eof,
     _error,
@@ -189,6 +203,7 @@ const char* _m8rscript_sharedAtoms[] = {
     _format,
     _front,
     _getValue,
+    _heapSnapshot,
     _import,
     _importString,
     _iterator,
@@ -198,12 +213,14 @@ const char* _m8rscript_sharedAtoms[] = {
     _lookupHostname,
     _makeDirectory,
     _meminfo,
+    _metrics,
     _mount,
     _mounted,
     _name,
     _next,
     _null,
     _onInterrupt,
+    _opcodeStats,
     _open,
     _openDirectory,
     _parse,
@@ -217,6 +234,7 @@ const char* _m8rscript_sharedAtoms[] = {
     _read,
     _remove,
     _rename,
+    _result,
     _run,
     _seek,
     _send,
@@ -232,6 +250,8 @@ const char* _m8rscript_sharedAtoms[] = {
     _toInt,
     _toString,
     _toUInt,
+    _trace,
+    _trackAllocations,
     _trim,
     _type,
     _undefined,
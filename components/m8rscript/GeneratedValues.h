@@ -35,97 +35,109 @@ enum class SA : uint16_t {
     Output = 24,
     OutputOpenDrain = 25,
     PinMode = 26,
-    ReceivedData = 27,
-    Reconnected = 28,
-    Repeating = 29,
-    RisingEdge = 30,
-    SentData = 31,
-    TCP = 32,
-    TCPProto = 33,
-    Task = 34,
-    Timer = 35,
-    Trigger = 36,
-    UDP = 37,
-    UDPProto = 38,
-    __destructor = 39,
-    __impl = 40,
-    __index = 41,
-    __nativeObject = 42,
-    __object = 43,
-    arguments = 44,
-    back = 45,
-    call = 46,
-    close = 47,
-    consoleListener = 48,
-    constructor = 49,
-    currentTime = 50,
-    decode = 51,
-    delay = 52,
-    digitalRead = 53,
-    digitalWrite = 54,
-    disconnect = 55,
-    done = 56,
-    encode = 57,
-    env = 58,
-    eof = 59,
-    error = 60,
-    errorString = 61,
-    format = 62,
-    front = 63,
-    getValue = 64,
-    import = 65,
-    importString = 66,
-    iterator = 67,
-    join = 68,
-    lastError = 69,
-    length = 70,
-    lookupHostname = 71,
-    makeDirectory = 72,
-    meminfo = 73,
-    mount = 74,
-    mounted = 75,
-    name = 76,
-    next = 77,
-    null = 78,
-    onInterrupt = 79,
-    open = 80,
-    openDirectory = 81,
-    parse = 82,
-    pop_back = 83,
-    pop_front = 84,
-    print = 85,
-    printf = 86,
-    println = 87,
-    push_back = 88,
-    push_front = 89,
-    read = 90,
-    remove = 91,
-    rename = 92,
-    run = 93,
-    seek = 94,
-    send = 95,
-    setPinMode = 96,
-    setValue = 97,
-    size = 98,
-    split = 99,
-    start = 100,
-    stat = 101,
-    stop = 102,
-    stringify = 103,
-    toFloat = 104,
-    toInt = 105,
-    toString = 106,
-    toUInt = 107,
-    trim = 108,
-    type = 109,
-    undefined = 110,
-    unmount = 111,
-    valid = 112,
-    value = 113,
-    waitForEvent = 114,
-    write = 115,
+    Profiler = 27,
+    ReceivedData = 28,
+    Reconnected = 29,
+    Repeating = 30,
+    RisingEdge = 31,
+    SentData = 32,
+    TCP = 33,
+    TCPProto = 34,
+    Task = 35,
+    Timer = 36,
+    Trigger = 37,
+    UDP = 38,
+    UDPProto = 39,
+    __destructor = 40,
+    __impl = 41,
+    __index = 42,
+    __nativeObject = 43,
+    __object = 44,
+    annotatedCode = 45,
+    arguments = 46,
+    back = 47,
+    begin = 48,
+    call = 49,
+    close = 50,
+    consoleListener = 51,
+    constructor = 52,
+    currentTime = 53,
+    decode = 54,
+    delay = 55,
+    digitalRead = 56,
+    digitalWrite = 57,
+    disconnect = 58,
+    done = 59,
+    encode = 60,
+    end = 61,
+    env = 62,
+    eof = 63,
+    error = 64,
+    errorString = 65,
+    format = 66,
+    front = 67,
+    getValue = 68,
+    heapSnapshot = 69,
+    import = 70,
+    importString = 71,
+    iterator = 72,
+    join = 73,
+    lastError = 74,
+    length = 75,
+    lookupHostname = 76,
+    makeDirectory = 77,
+    meminfo = 78,
+    metrics = 79,
+    mount = 80,
+    mounted = 81,
+    name = 82,
+    next = 83,
+    null = 84,
+    onInterrupt = 85,
+    opcodeStats = 86,
+    open = 87,
+    openDirectory = 88,
+    parse = 89,
+    pop_back = 90,
+    pop_front = 91,
+    print = 92,
+    printf = 93,
+    println = 94,
+    push_back = 95,
+    push_front = 96,
+    read = 97,
+    remove = 98,
+    rename = 99,
+    result = 100,
+    run = 101,
+    seek = 102,
+    send = 103,
+    setPinMode = 104,
+    setValue = 105,
+    size = 106,
+    split = 107,
+    start = 108,
+    stat = 109,
+    stop = 110,
+    stringify = 111,
+    toFloat = 112,
+    toInt = 113,
+    toString = 114,
+    toUInt = 115,
+    trace = 116,
+    trackAllocations = 117,
+    trim = 118,
+    type = 119,
+    undefined = 120,
+    unmount = 121,
+    valid = 122,
+    value = 123,
+    waitForEvent = 124,
+    write = 125,
 };
 
+static constexpr uint16_t SharedAtomCount = 126;
+
 const char** sharedAtoms(uint16_t& nelts);
 const char* specialChars();
 static inline m8r::Atom SAtom(SA sa) { return m8r::Atom(static_cast<m8r::Atom::value_type>(sa)); }
@@ -9,8 +9,11 @@
 
 #include "Global.h"
 
+#include "BufferedFileStream.h"
 #include "ExecutionUnit.h"
-#include "FileStream.h"
+#include "GC.h"
+#include "HeapSnapshot.h"
+#include "Metrics.h"
 #include "StringStream.h"
 #include "SystemInterface.h"
 
@@ -26,38 +29,44 @@ IPAddrProto Global::_ipAddr;
 Iterator Global::_iterator;
 TaskProto Global::_task;
 TimerProto Global::_timer;
+ProfilerProto Global::_profiler;
+TraceProto Global::_trace;
 FSProto Global::_fs;
 FileProto Global::_file;
 DirectoryProto Global::_directory;
 
-static StaticObject::StaticFunctionProperty _functionProps[] =
+static const StaticObject::StaticFunctionProperty _functionProps[] =
 {
+    { SA::arguments, Global::arguments },
     { SA::currentTime, Global::currentTime },
     { SA::delay, Global::delay },
+    { SA::heapSnapshot, Global::heapSnapshot },
+    { SA::import, Global::import },
+    { SA::importString, Global::importString },
+    { SA::meminfo, Global::meminfo },
+    { SA::metrics, Global::metrics },
     { SA::print, Global::print },
     { SA::println, Global::println },
     { SA::toFloat, Global::toFloat },
     { SA::toInt, Global::toInt },
     { SA::toUInt, Global::toUInt },
-    { SA::arguments, Global::arguments },
-    { SA::import, Global::import },
-    { SA::importString, Global::importString },
     { SA::waitForEvent, Global::waitForEvent },
-    { SA::meminfo, Global::meminfo },
 };
 
-static StaticObject::StaticObjectProperty _objectProps[] =
+static const StaticObject::StaticObjectProperty _objectProps[] =
 {
+    { SA::Directory, &Global::_directory },
+    { SA::FS, &Global::_fs },
+    { SA::File, &Global::_file },
     { SA::GPIO, &Global::_gpio },
-    { SA::JSON, &Global::_json },
-    { SA::TCP, &Global::_tcp },
     { SA::IPAddr, &Global::_ipAddr },
     { SA::Iterator, &Global::_iterator },
+    { SA::JSON, &Global::_json },
+    { SA::Profiler, &Global::_profiler },
+    { SA::TCP, &Global::_tcp },
     { SA::Task, &Global::_task },
     { SA::Timer, &Global::_timer },
-    { SA::FS, &Global::_fs },
-    { SA::File, &Global::_file },
-    { SA::Directory, &Global::_directory },
+    { SA::trace, &Global::_trace },
 };
 
 Global::Global()
@@ -192,7 +201,7 @@ CallReturnValue Global::import(ExecutionUnit* eu, Value thisValue, uint32_t npar
     
     String s = eu->stack().top(1 - nparams).toStringValue(eu);
     Mad<File> file = system()->fileSystem()->open(s.c_str(), FS::FileOpenMode::Read);
-    CallReturnValue ret = eu->import(FileStream(file), thisValue);
+    CallReturnValue ret = eu->import(BufferedFileStream(file), thisValue);
     file.destroy(MemoryType::Native);
     return ret;
 }
@@ -247,6 +256,71 @@ CallReturnValue Global::meminfo(ExecutionUnit* eu, Value thisValue, uint32_t npa
     obj->setProperty(eu->program()->atomizeString("allocationsByType"),
                      Value(allocationsByType), Value::SetType::AlwaysAdd);
 
+    if (Metrics::enabled()) {
+        // Counters can pass the range of an Integer, so those are Floats
+        Mad<Object> metrics = Object::create<MaterObject>();
+        for (uint8_t i = 0; i < static_cast<uint8_t>(Metrics::Counter::NumCounters); ++i) {
+            Metrics::Counter counter = static_cast<Metrics::Counter>(i);
+            if (!Metrics::counted(counter)) {
+                continue;
+            }
+            uint64_t v = Metrics::value(counter);
+            metrics->setProperty(eu->program()->atomizeString(Metrics::name(counter)),
+                                 (v > 0x7fffffff) ? Value(static_cast<float>(v)) : Value(static_cast<int32_t>(v)), Value::SetType::AlwaysAdd);
+        }
+        for (uint8_t i = 0; i < static_cast<uint8_t>(Metrics::Gauge::NumGauges); ++i) {
+            Metrics::Gauge gauge = static_cast<Metrics::Gauge>(i);
+            metrics->setProperty(eu->program()->atomizeString(Metrics::name(gauge)),
+                                 Value(Metrics::value(gauge)), Value::SetType::AlwaysAdd);
+        }
+        obj->setProperty(eu->program()->atomizeString("metrics"), Value(metrics), Value::SetType::AlwaysAdd);
+    }
+
+    // meminfo(n) adds the n allocation sites with the most live bytes, if
+    // allocations have been tracked. See Profiler.trackAllocations()
+    if (nparams > 0) {
+        int32_t n = eu->stack().top(1 - nparams).toIntValue(eu);
+        Mad<Object> allocationSites = Object::create<MaterArray>();
+        for (const auto& site : AllocationTracker::topSites(n > 0 ? static_cast<uint32_t>(n) : 0)) {
+            Mad<Object> entry = Object::create<MaterObject>();
+            entry->setProperty(eu->program()->atomizeString("name"),
+                             Value(ExecutionUnit::createString(site._name)), Value::SetType::AlwaysAdd);
+            entry->setProperty(eu->program()->atomizeString("line"),
+                             Value(static_cast<int32_t>(site._lineno)), Value::SetType::AlwaysAdd);
+            entry->setProperty(eu->program()->atomizeString("type"),
+                             Value(ExecutionUnit::createString(Mallocator::stringFromMemoryType(site._type))), Value::SetType::AlwaysAdd);
+            entry->setProperty(eu->program()->atomizeString("liveCount"),
+                             Value(static_cast<int32_t>(site._liveCount)), Value::SetType::AlwaysAdd);
+            entry->setProperty(eu->program()->atomizeString("liveSize"),
+                             Value(static_cast<int32_t>(site._liveBytes)), Value::SetType::AlwaysAdd);
+            entry->setProperty(eu->program()->atomizeString("totalCount"),
+                             Value(static_cast<int32_t>(site._totalCount)), Value::SetType::AlwaysAdd);
+            entry->setProperty(eu->program()->atomizeString("totalSize"),
+                             Value(static_cast<int32_t>(site._totalBytes)), Value::SetType::AlwaysAdd);
+
+            allocationSites->setElement(eu, Value(0), Value(entry), Value::SetType::AlwaysAdd);
+        }
+        
+        obj->setProperty(eu->program()->atomizeString("allocationSites"),
+                         Value(allocationSites), Value::SetType::AlwaysAdd);
+    }
+
     eu->stack().push(Value(obj));
     return CallReturnValue(CallReturnValue::Type::ReturnCount, 1);
 }
+
+CallReturnValue Global::heapSnapshot(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
+{
+    // Returns the snapshot as a String, in the format described in HeapSnapshot.h
+    HeapSnapshot snapshot(eu->program().get());
+    GC::heapSnapshot(snapshot);
+    eu->stack().push(Value(ExecutionUnit::createString(snapshot.takeOutput())));
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 1);
+}
+
+CallReturnValue Global::metrics(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
+{
+    // Returns the counters and gauges as Prometheus text, to serve from a script
+    eu->stack().push(Value(ExecutionUnit::createString(Metrics::prometheus())));
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 1);
+}
@@ -15,9 +15,11 @@
 #include "Iterator.h"
 #include "JSONProto.h"
 #include "Object.h"
+#include "ProfilerProto.h"
 #include "SystemTime.h"
 #include "TaskProto.h"
 #include "TimerProto.h"
+#include "TraceProto.h"
 #include "TCPProto.h"
 
 namespace m8rscript {
@@ -35,6 +37,8 @@ public:
     static Iterator _iterator;
     static TaskProto _task;
     static TimerProto _timer;
+    static ProfilerProto _profiler;
+    static TraceProto _trace;
     static FSProto _fs;
     static FileProto _file;
     static DirectoryProto _directory;
@@ -51,6 +55,8 @@ public:
     static m8r::CallReturnValue importString(ExecutionUnit*, Value thisValue, uint32_t nparams);
     static m8r::CallReturnValue waitForEvent(ExecutionUnit*, Value thisValue, uint32_t nparams);
     static m8r::CallReturnValue meminfo(ExecutionUnit*, Value thisValue, uint32_t nparams);
+    static m8r::CallReturnValue heapSnapshot(ExecutionUnit*, Value thisValue, uint32_t nparams);
+    static m8r::CallReturnValue metrics(ExecutionUnit*, Value thisValue, uint32_t nparams);
     
     static const Global* shared() { return &_global; }
     
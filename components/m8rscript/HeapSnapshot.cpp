@@ -0,0 +1,162 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "HeapSnapshot.h"
+
+#include "Object.h"
+#include "Program.h"
+#include <algorithm>
+
+using namespace m8rscript;
+using namespace m8r;
+
+static const char* edgeNames[] = { "property", "element", "constant", "upvalue", "proto", "function", "this" };
+
+// Property names can be any string, so escape anything that would break the line
+static void appendEscaped(String& s, const char* name)
+{
+    for ( ; name && *name; ++name) {
+        if (*name == '"' || *name == '\\') {
+            s += '\\';
+        }
+        s += (*name == '\n') ? ' ' : *name;
+    }
+}
+
+void HeapSnapshot::startWriting()
+{
+    std::sort(_nodeIds.begin(), _nodeIds.end());
+    write("{\"snapshot\":1,\"nodes\":");
+    write(static_cast<uint32_t>(_nodeIds.size()));
+    write("}\n");
+}
+
+int32_t HeapSnapshot::nodeId(const Value& value) const
+{
+    const void* node = nullptr;
+    if (value.asString().valid()) {
+        node = value.asString().get();
+    } else if (value.asObject().valid()) {
+        node = value.asObject().get();
+    }
+    if (!node) {
+        return -1;
+    }
+
+    auto it = std::lower_bound(_nodeIds.begin(), _nodeIds.end(), node);
+    return (it != _nodeIds.end() && *it == node) ? static_cast<int32_t>(it - _nodeIds.begin()) : -1;
+}
+
+void HeapSnapshot::writeStringNode(const void* string, uint32_t size)
+{
+    auto it = std::lower_bound(_nodeIds.begin(), _nodeIds.end(), string);
+    write("{\"id\":");
+    write(static_cast<uint32_t>(it - _nodeIds.begin()));
+    write(",\"type\":\"String\",\"size\":");
+    write(size);
+    write("}\n");
+}
+
+void HeapSnapshot::startObjectNode(const void* object)
+{
+    auto it = std::lower_bound(_nodeIds.begin(), _nodeIds.end(), object);
+    write("{\"id\":");
+    write(static_cast<uint32_t>(it - _nodeIds.begin()));
+
+    _type = "Object";
+    _name = Atom();
+    _fixedSize = 0;
+    _size = 0;
+    _firstEdge = true;
+    _edges = String();
+}
+
+void HeapSnapshot::endObjectNode()
+{
+    write(",\"type\":");
+    writeQuoted(_type);
+    if (_name && _program) {
+        write(",\"name\":");
+        writeQuoted(_program->stringFromAtom(_name));
+    }
+    write(",\"size\":");
+    write(_fixedSize + _size);
+    write(",\"edges\":[");
+    write(_edges.c_str());
+    write("]}\n");
+}
+
+void HeapSnapshot::startEdge(Edge edge)
+{
+    if (!_firstEdge) {
+        _edges += ",";
+    }
+    _firstEdge = false;
+    _edges += "[\"";
+    _edges += edgeNames[static_cast<uint32_t>(edge)];
+    _edges += "\",";
+}
+
+void HeapSnapshot::addEdge(Edge edge, Atom name, const Value& value)
+{
+    int32_t id = nodeId(value);
+    if (id < 0) {
+        return;
+    }
+
+    startEdge(edge);
+    _edges += "\"";
+    if (name && _program) {
+        appendEscaped(_edges, _program->stringFromAtom(name));
+    }
+    _edges += "\",";
+    _edges += String(id);
+    _edges += "]";
+}
+
+void HeapSnapshot::addEdge(Edge edge, uint32_t index, const Value& value)
+{
+    int32_t id = nodeId(value);
+    if (id < 0) {
+        return;
+    }
+
+    startEdge(edge);
+    _edges += String(index);
+    _edges += ",";
+    _edges += String(id);
+    _edges += "]";
+}
+
+void HeapSnapshot::addRoot(const char* label, const Value& value)
+{
+    int32_t id = nodeId(value);
+    if (id < 0) {
+        return;
+    }
+
+    write("{\"root\":");
+    writeQuoted(label);
+    write(",\"to\":");
+    write(static_cast<uint32_t>(id));
+    write("}\n");
+}
+
+void HeapSnapshot::write(uint32_t v)
+{
+    write(String(v).c_str());
+}
+
+void HeapSnapshot::writeQuoted(const char* s)
+{
+    String quoted("\"");
+    appendEscaped(quoted, s);
+    quoted += "\"";
+    write(quoted.c_str());
+}
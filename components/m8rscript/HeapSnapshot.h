@@ -0,0 +1,89 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Atom.h"
+#include "Containers.h"
+#include "Value.h"
+
+namespace m8rscript {
+
+class Program;
+
+// HeapSnapshot - Writes the live heap as a graph for offline leak analysis
+//
+// Taken by GC::heapSnapshot(), which marks from the roots without sweeping.
+// Only the marked objects and strings are written, so garbage still in the
+// stores is left out. The output is one JSON object per line. The first
+// line is a header. Then comes a line for each node (Object or String) with its
+// shallow size and its outgoing edges, and a line for each root:
+//
+//      {"snapshot":1,"nodes":3}
+//      {"id":0,"type":"MaterObject","name":"Point","size":96,"edges":[["property","x",2],["proto","",1]]}
+//      {"id":2,"type":"String","size":40}
+//      {"root":"stack","to":0}
+//
+// An edge is [kind, label, to]. The label is a property or upvalue name, or an
+// index for elements and constants. Values that aren't on the heap (numbers,
+// string literals, native functions) have no node and no edge. mac/tools/
+// heapsnapshot.cpp reads this format and computes retained sizes and the
+// dominator path to the largest retainers.
+class HeapSnapshot {
+public:
+    enum class Edge { Property, Element, Constant, UpValue, Proto, Function, This };
+
+    HeapSnapshot(const Program* program) : _program(program) { }
+    
+    // The output is moved out, so the snapshot isn't held twice
+    m8r::String takeOutput() { return std::move(_output); }
+
+    // Node ids must be set for all objects and strings before any node is written
+    void addNodeId(const void* node) { _nodeIds.push_back(node); }
+    void startWriting();
+
+    void writeStringNode(const void* string, uint32_t size);
+
+    // Objects describe themselves in Object::heapSnapshot(), between these two calls
+    void startObjectNode(const void* object);
+    void endObjectNode();
+
+    // Each class sets its type and fixed size after calling its base class. Sizes of
+    // storage the object owns are added to that
+    void setType(const char* type, uint32_t size) { _type = type; _fixedSize = size; }
+    void setName(m8r::Atom name) { _name = name; }
+    void addSize(uint32_t size) { _size += size; }
+    void addEdge(Edge, m8r::Atom name, const Value&);
+    void addEdge(Edge, uint32_t index, const Value&);
+    void addEdge(Edge edge, const Value& value) { addEdge(edge, m8r::Atom(), value); }
+
+    void addRoot(const char* label, const Value&);
+
+private:
+    int32_t nodeId(const Value&) const;
+    void write(const char* s) { _output += s; }
+    void write(uint32_t);
+    void writeQuoted(const char*);
+    void startEdge(Edge);
+
+    m8r::String _output;
+    const Program* _program;
+
+    // Sorted after all ids are added, so lookup is a binary search
+    m8r::Vector<const void*> _nodeIds;
+
+    const char* _type = nullptr;
+    m8r::Atom _name;
+    uint32_t _fixedSize = 0;
+    uint32_t _size = 0;
+    bool _firstEdge = true;
+    m8r::String _edges;
+};
+
+}
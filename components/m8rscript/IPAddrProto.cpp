@@ -16,12 +16,11 @@
 using namespace m8rscript;
 using namespace m8r;
 
-static StaticObject::StaticFunctionProperty _props[] =
+static const StaticObject::StaticFunctionProperty _props[] =
 {
     { SA::constructor, IPAddrProto::constructor },
-    { SA::toString, IPAddrProto::toString },
     { SA::lookupHostname, IPAddrProto::lookupHostname },
-
+    { SA::toString, IPAddrProto::toString },
 };
 
 IPAddrProto::IPAddrProto()
@@ -16,12 +16,12 @@
 using namespace m8rscript;
 using namespace m8r;
 
-static StaticObject::StaticFunctionProperty _props[] =
+static const StaticObject::StaticFunctionProperty _props[] =
 {
     { SA::constructor, Iterator::constructor },
     { SA::done, Iterator::done },
-    { SA::next, Iterator::next },
     { SA::getValue, Iterator::getValue },
+    { SA::next, Iterator::next },
     { SA::setValue, Iterator::setValue },
 };
 
@@ -18,7 +18,7 @@
 using namespace m8rscript;
 using namespace m8r;
 
-static StaticObject::StaticFunctionProperty _props[] =
+static const StaticObject::StaticFunctionProperty _props[] =
 {
     { SA::parse, JSONProto::parseFunc },
     { SA::stringify, JSONProto::stringifyFunc },
@@ -21,8 +21,18 @@ public:
     virtual const char* suffix() const override { return "m8r"; }
     virtual m8r::SharedPtr<m8r::Executable> create() const override
     {
-        return m8r::SharedPtr<m8r::Executable>(new ExecutionUnit());
+        ExecutionUnit* eu = new ExecutionUnit();
+        if (_profileIntervalUs) {
+            eu->startProfiling(_profileIntervalUs, true);
+        }
+        return m8r::SharedPtr<m8r::Executable>(eu);
     }
+    
+    // When non-zero, every script is profiled and prints its folded stacks when it ends
+    void setProfileInterval(uint32_t us) { _profileIntervalUs = us; }
+
+private:
+    uint32_t _profileIntervalUs = 0;
 };
 
 }
@@ -39,10 +39,12 @@ namespace m8rscript {
 
     R       - Register (0..127)
     RK      - Register (0..127) or Constant (128..255)
-    UN      - Line number (0..64K)
+    UN      - Unsigned number (0..64K)
     SN      - Address (-32K..32K)
     L       - Local variable (0..127) - only used during initial code generation
     NPARAMS - Param count (0..255)
+    ITEROP  - Iteration operation (see IterOp)
+    IMM     - Immediate value in upper 2 bits of opcode byte
     
     Local vs Register parameters
     ----------------------------
@@ -108,6 +110,7 @@ namespace m8rscript {
     POSTDEC     R[d], R[s]
 
     CALL        RK[call], RK[this], NPARAMS
+    TAILCALL    RK[call], RK[this], NPARAMS
     NEW         RK[call], NPARAMS
     CALLPROP    RK[o], RK[p], NPARAMS
     CLOSURE     R[d], RK[s]
@@ -115,9 +118,21 @@ namespace m8rscript {
     JMP         SN
     JT          RK[s], SN
     JF          RK[s], SN
-    LINENO      UN
+    SWITCH      RK[s], UN
+    
+    ITERINIT    RK[o], IMM
+    ITERNEXT    R[i], RK[o], ITEROP
+    
+    FORPREP     R[i], RK[e], SN, IMM
+    FORLOOP     R[i], RK[e], RK[s], SN, IMM
  
-    Total: 51 instructions
+    Total: 56 instructions
+    
+    TAILCALL is a CALL whose result is returned from the current Function. It
+    is always followed by the same POP, PUSH and RET 1 as a CALL would be. If
+    the callee is a Function it replaces the current frame and returns
+    directly to the caller, so the instructions after it never run. Otherwise
+    it acts like CALL.
 */
 
 static constexpr uint32_t MaxRegister = 127;
@@ -146,10 +161,14 @@ enum class Op : uint8_t {
     POSTINC, POSTDEC, CALL, NEW,
     CALLPROP, JMP, JT, JF,
 
-    LINENO = 0x30, LOADTHIS, LOADUP,
+    // 0x30 open
+    
+    LOADTHIS = 0x31, LOADUP,
     CLOSURE, YIELD, POPX, RETI, 
+    SWITCH,
     
-    // 0x37 - 0x3c open
+    ITERINIT = 0x38, ITERNEXT, FORPREP, FORLOOP,
+    TAILCALL = 0x3c,
 
     END = 0x3d, RET = 0x3e, UNKNOWN = 0x3f,
     
@@ -158,6 +177,19 @@ enum class Op : uint8_t {
 
 static_assert(static_cast<uint32_t>(Op::LAST) <= 0x40, "Opcode must fit in 6 bits");
 
+// Operations performed by ITERNEXT. Each leaves one value on the stack, like CALL.
+// When iterating an Array, Object or String directly, R[i] holds an integer cursor.
+// Otherwise R[i] holds an Iterator object and the operation is a call to
+// done(), next(), getValue() or setValue() on it. ITERINIT always makes an
+// Iterator object if its immediate bits are 1.
+enum class IterOp : uint8_t { Done = 0, Next = 1, GetValue = 2, SetValue = 3 };
+
+// Comparison done by FORPREP and FORLOOP, held in the immediate bits. FORPREP
+// tests R[i] against the end value RK[e] and jumps to SN (the loop exit) if
+// the test fails. FORLOOP adds the step RK[s] to R[i] and jumps back to SN
+// (the loop body) if the test passes.
+enum class ForTest : uint8_t { LT = 0, LE = 1, GT = 2, GE = 3 };
+
 class OpInfo
 {
 public:
@@ -189,9 +221,12 @@ private:
         P       = static_cast<uint8_t>(Flags::P),
         BP      = static_cast<uint8_t>(Flags::b) | static_cast<uint8_t>(Flags::P),
         BCP     = static_cast<uint8_t>(Flags::b) | static_cast<uint8_t>(Flags::c) | static_cast<uint8_t>(Flags::P),
+        ABP     = static_cast<uint8_t>(Flags::a) | static_cast<uint8_t>(Flags::b) | static_cast<uint8_t>(Flags::P),
         N       = static_cast<uint8_t>(Flags::N),
         AN      = static_cast<uint8_t>(Flags::a) | static_cast<uint8_t>(Flags::N),
+        BN      = static_cast<uint8_t>(Flags::b) | static_cast<uint8_t>(Flags::N),
         ABN     = static_cast<uint8_t>(Flags::a) | static_cast<uint8_t>(Flags::b) | static_cast<uint8_t>(Flags::N),
+        ABCN    = static_cast<uint8_t>(Flags::a) | static_cast<uint8_t>(Flags::b) | static_cast<uint8_t>(Flags::c) | static_cast<uint8_t>(Flags::N),
     };
     
     static bool flagFromLayout(Op op, Flags flag)
@@ -261,20 +296,20 @@ private:
             { Layout::AN,   3 },   // JT           RK[s], SN
             { Layout::AN,   3 },   // JF           RK[s], SN
              
-/*0x30 */   { Layout::N,    2 },   // LINENO       UN
+/*0x30 */   { Layout::None, 0 },   // unused
             { Layout::A,    1 },   // LOADTHIS     R[d]
             { Layout::AD,   2 },   // LOADUP       R[d], U[s]
             { Layout::AB,   2 },   // CLOSURE      R[d], RK[s]
             { Layout::None, 0 },   // YIELD
             { Layout::None, 0 },   // POPX
             { Layout::IMM,  0 },   // RETI
+            { Layout::BN,   3 },   // SWITCH       RK[s], UN
             
-/*0x37 */   { Layout::None, 0 },   // unused
-            { Layout::None, 0 },   // unused
-            { Layout::None, 0 },   // unused
-            { Layout::None, 0 },   // unused
-            { Layout::None, 0 },   // unused
-/*0x3c */   { Layout::None, 0 },   // unused
+/*0x38 */   { Layout::B,    1 },   // ITERINIT     RK[o]
+            { Layout::ABP,  3 },   // ITERNEXT     R[i], RK[o], ITEROP
+            { Layout::ABN,  4 },   // FORPREP      R[i], RK[e], SN
+            { Layout::ABCN, 5 },   // FORLOOP      R[i], RK[e], RK[s], SN
+/*0x3c */   { Layout::BCP,  3 },   // TAILCALL     RK[call], RK[this], NPARAMS
 
 /*0x3d */   { Layout::None, 0 },   // END
 /*0x3e */   { Layout::P,    1 },   // RET          NPARAMS
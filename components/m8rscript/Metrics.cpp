@@ -0,0 +1,77 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "Metrics.h"
+
+#include <cstdio>
+
+using namespace m8rscript;
+using namespace m8r;
+
+#if M8RSCRIPT_METRICS
+uint64_t Metrics::_counters[static_cast<uint8_t>(Counter::NumCounters)];
+int32_t Metrics::_gauges[static_cast<uint8_t>(Gauge::NumGauges)];
+#endif
+
+static const char* counterNames[] = {
+    "instructions",
+    "calls",
+    "objects_allocated",
+    "strings_allocated",
+    "gc_cycles",
+    "gc_pause_us",
+    "events_run",
+};
+
+static const char* gaugeNames[] = {
+    "event_queue_depth",
+    "timers_live",
+    "tcp_connections_live",
+};
+
+static_assert(sizeof(counterNames) / sizeof(const char*) == static_cast<uint8_t>(Metrics::Counter::NumCounters), "counterNames is wrong size");
+static_assert(sizeof(gaugeNames) / sizeof(const char*) == static_cast<uint8_t>(Metrics::Gauge::NumGauges), "gaugeNames is wrong size");
+
+const char* Metrics::name(Counter counter)
+{
+    return counterNames[static_cast<uint8_t>(counter)];
+}
+
+const char* Metrics::name(Gauge gauge)
+{
+    return gaugeNames[static_cast<uint8_t>(gauge)];
+}
+
+String Metrics::prometheus()
+{
+    String s;
+    char buf[24];
+    for (uint8_t i = 0; i < static_cast<uint8_t>(Counter::NumCounters); ++i) {
+        if (!counted(static_cast<Counter>(i))) {
+            continue;
+        }
+        s += "# TYPE m8rscript_";
+        s += counterNames[i];
+        s += "_total counter\nm8rscript_";
+        s += counterNames[i];
+        s += "_total ";
+        snprintf(buf, sizeof(buf), "%llu\n", static_cast<unsigned long long>(value(static_cast<Counter>(i))));
+        s += buf;
+    }
+    for (uint8_t i = 0; i < static_cast<uint8_t>(Gauge::NumGauges); ++i) {
+        s += "# TYPE m8rscript_";
+        s += gaugeNames[i];
+        s += " gauge\nm8rscript_";
+        s += gaugeNames[i];
+        s += " ";
+        snprintf(buf, sizeof(buf), "%d\n", static_cast<int>(value(static_cast<Gauge>(i))));
+        s += buf;
+    }
+    return s;
+}
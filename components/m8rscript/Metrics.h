@@ -0,0 +1,85 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <cstdint>
+
+#include "Containers.h"
+
+// Set to 0 to compile out all counters and gauges
+#ifndef M8RSCRIPT_METRICS
+#define M8RSCRIPT_METRICS 1
+#endif
+
+// Set to 1 to count instructions. That is an increment on every dispatch, so
+// it is off by default and the instructions counter is left out
+#ifndef M8RSCRIPT_INSTRUCTION_METRICS
+#define M8RSCRIPT_INSTRUCTION_METRICS 0
+#endif
+
+namespace m8rscript {
+
+// Metrics - Runtime counters and gauges
+//
+// Counters only go up. Gauges go up and down with the number of something
+// that is live. Both are global, across all ExecutionUnits. Updating one is an
+// add to a static array, and when M8RSCRIPT_METRICS is 0 the update functions
+// are empty, so they compile to nothing. Scripts read them with meminfo().
+// prometheus() formats them as Prometheus text for the shell to serve.
+class Metrics {
+public:
+    enum class Counter : uint8_t {
+        Instructions,
+        Calls,
+        ObjectsAllocated,
+        StringsAllocated,
+        GCCycles,
+        GCPauseUs,
+        EventsRun,
+        NumCounters
+    };
+
+    enum class Gauge : uint8_t {
+        EventQueueDepth,
+        TimersLive,
+        TCPConnectionsLive,
+        NumGauges
+    };
+
+#if M8RSCRIPT_METRICS
+    static constexpr bool enabled() { return true; }
+    static constexpr bool counted(Counter counter) { return counter != Counter::Instructions || M8RSCRIPT_INSTRUCTION_METRICS; }
+    static void increment(Counter counter, uint32_t n = 1) { _counters[static_cast<uint8_t>(counter)] += n; }
+    static void adjust(Gauge gauge, int32_t delta) { _gauges[static_cast<uint8_t>(gauge)] += delta; }
+    static uint64_t value(Counter counter) { return _counters[static_cast<uint8_t>(counter)]; }
+    static int32_t value(Gauge gauge) { return _gauges[static_cast<uint8_t>(gauge)]; }
+#else
+    static constexpr bool enabled() { return false; }
+    static constexpr bool counted(Counter) { return false; }
+    static void increment(Counter, uint32_t = 1) { }
+    static void adjust(Gauge, int32_t) { }
+    static uint64_t value(Counter) { return 0; }
+    static int32_t value(Gauge) { return 0; }
+#endif
+
+    // Names are in the snake_case used by Prometheus
+    static const char* name(Counter);
+    static const char* name(Gauge);
+
+    static m8r::String prometheus();
+
+private:
+#if M8RSCRIPT_METRICS
+    static uint64_t _counters[static_cast<uint8_t>(Counter::NumCounters)];
+    static int32_t _gauges[static_cast<uint8_t>(Gauge::NumGauges)];
+#endif
+};
+
+}
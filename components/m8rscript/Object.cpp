@@ -12,6 +12,7 @@
 #include "ExecutionUnit.h"
 #include "Function.h"
 #include "GC.h"
+#include "HeapSnapshot.h"
 #include "MStream.h"
 #include "Program.h"
 #include "SystemInterface.h"
@@ -116,11 +117,7 @@ m8r::String Object::toString(ExecutionUnit* eu, bool typeOnly) const
 
 MaterObject::~MaterObject()
 {
-    // Call destructor, if any
-    Value dtor = property(SAtom(SA::__destructor));
-    if (dtor.isNativeFunction()) {
-        dtor.asNativeFunction()(nullptr, Value(Mad<Object>(this)), 0);
-    }
+    runDestructor();
     
     for (auto it : _properties) {
         Mad<NativeObject> obj = it.value.asNativeObject();
@@ -131,6 +128,19 @@ MaterObject::~MaterObject()
     }
 }
 
+void MaterObject::runDestructor()
+{
+    if (_destructorRun) {
+        return;
+    }
+    _destructorRun = true;
+    
+    Value dtor = property(SAtom(SA::__destructor));
+    if (dtor.isNativeFunction()) {
+        dtor.asNativeFunction()(nullptr, Value(Mad<Object>(this)), 0);
+    }
+}
+
 m8r::String MaterObject::toString(ExecutionUnit* eu, bool typeOnly) const
 {
     String s = Object::toString(eu, typeOnly);
@@ -217,9 +227,43 @@ void MaterArray::gcMark()
     }
 }
 
+void Object::heapSnapshot(HeapSnapshot& snapshot) const
+{
+    snapshot.setType("Object", sizeof(Object));
+    snapshot.setName(_typeName);
+    snapshot.addEdge(HeapSnapshot::Edge::Proto, _proto);
+}
+
+void MaterObject::heapSnapshot(HeapSnapshot& snapshot) const
+{
+    Object::heapSnapshot(snapshot);
+    snapshot.setType("MaterObject", sizeof(MaterObject));
+    snapshot.addSize(static_cast<uint32_t>(_properties.size() * (sizeof(Atom) + sizeof(Value))));
+    for (auto entry : _properties) {
+        snapshot.addEdge(HeapSnapshot::Edge::Property, entry.key, entry.value);
+    }
+}
+
+void MaterArray::heapSnapshot(HeapSnapshot& snapshot) const
+{
+    Object::heapSnapshot(snapshot);
+    snapshot.setType("MaterArray", sizeof(MaterArray));
+    snapshot.addSize(static_cast<uint32_t>(_array.size() * sizeof(Value)));
+    for (uint32_t i = 0; i < _array.size(); ++i) {
+        snapshot.addEdge(HeapSnapshot::Edge::Element, i, _array[i]);
+    }
+}
+
+// Strings, literals and ids are atomized where they are, without a copy
+static Atom elementAtom(ExecutionUnit* eu, const Value& elt)
+{
+    const char* s = elt.toStringPointer(eu);
+    return eu->program()->atomizeString((s && s[0]) ? s : elt.toStringValue(eu).c_str());
+}
+
 const Value MaterObject::element(ExecutionUnit* eu, const Value& elt) const
 {
-    Atom prop = eu->program()->atomizeString(elt.toStringValue(eu).c_str());
+    Atom prop = elementAtom(eu, elt);
     return property(prop);
 }
 
@@ -231,7 +275,7 @@ const Value MaterArray::element(ExecutionUnit* eu, const Value& elt) const
 
 bool MaterObject::setElement(ExecutionUnit* eu, const Value& elt, const Value& value, Value::SetType type)
 {
-    Atom prop = eu->program()->atomizeString(elt.toStringValue(eu).c_str());
+    Atom prop = elementAtom(eu, elt);
     return setProperty(prop, value, type);
 }
 
@@ -361,6 +405,12 @@ const Value MaterArray::property(const Atom& prop) const
     return Value();
 }
 
+int32_t MaterObject::iterationCount() const
+{
+    // Objects which supply their own iterator (directly or through their proto) use it
+    return property(SAtom(SA::iterator)) ? -1 : static_cast<int32_t>(numProperties());
+}
+
 bool MaterObject::setProperty(const Atom& prop, const Value& v, Value::SetType type)
 {
     Value oldValue = property(prop);
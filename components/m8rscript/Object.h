@@ -10,7 +10,9 @@
 #pragma once
 
 #include "Mallocator.h"
+#include "AllocationTracker.h"
 #include "Defines.h"
+#include "Metrics.h"
 #include "GeneratedValues.h"
 #include "SharedPtr.h"
 #include "Value.h"
@@ -20,7 +22,10 @@
 namespace m8rscript {
 
 class ExecutionUnit;
+class HeapSnapshot;
 class Object;
+class SwitchTable;
+class ThreadedCode;
 
 using InstructionVector = m8r::Vector<uint8_t>;
 using PropertyMap = m8r::Map<m8r::Atom, Value>;
@@ -32,12 +37,15 @@ public:
         return m8r::CallReturnValue(m8r::Error::Code::Unimplemented);
     }
     virtual const InstructionVector* code() const { return nullptr; }
+    virtual const ThreadedCode* threadedCode(const void* const* handlers) const { return nullptr; }
     virtual uint16_t localCount() const { return 0; }
     virtual bool constant(uint8_t reg, Value&) const { return false; }
     virtual uint16_t formalParamCount() const { return 0; }
     virtual bool loadUpValue(ExecutionUnit*, uint32_t index, Value&) const { return false; }
     virtual uint32_t upValueCount() const { return 0; }
     virtual bool upValue(uint32_t i, uint32_t& index, uint16_t& frame, m8r::Atom& name) const { return false; }
+    virtual const SwitchTable* switchTable(uint16_t index) const { return nullptr; }
+    virtual uint32_t lineno(uint32_t addr) const { return 0; }
 
     virtual m8r::Atom name() const { return m8r::Atom(); }
 };
@@ -47,13 +55,22 @@ public:
     Object()
         :  _marked(true)
         , _isDestroyed(false)
+        , _isFunction(false)
+        , _isClosure(false)
     { }
     virtual ~Object() { _isDestroyed = true; }
     
     static m8r::MemoryType memoryType() { return m8r::MemoryType::Object; }
     
     template<typename T>
-    static m8r::Mad<T> create() { m8r::Mad<T> obj = m8r::Mad<T>::create(m8r::MemoryType::Object); addToObjectStore(obj.raw()); return obj; }
+    static m8r::Mad<T> create()
+    {
+        m8r::Mad<T> obj = m8r::Mad<T>::create(m8r::MemoryType::Object);
+        addToObjectStore(obj.raw());
+        Metrics::increment(Metrics::Counter::ObjectsAllocated);
+        AllocationTracker::allocated(obj.get(), m8r::MemoryType::Object, sizeof(T));
+        return obj;
+    }
 
     virtual m8r::String toString(ExecutionUnit* eu, bool typeOnly = false) const;
     
@@ -61,6 +78,13 @@ public:
     
     virtual void gcMark() { gcMark(this); _proto.gcMark(); }
     
+    // Calls the native __destructor, if any. The GC calls it on all dead
+    // objects before freeing any of them
+    virtual void runDestructor() { }
+    
+    // Describe this object to a heap snapshot. Follows the same references as gcMark()
+    virtual void heapSnapshot(HeapSnapshot&) const;
+    
     virtual const Value property(const m8r::Atom&) const { return Value(); }
     
     virtual bool setProperty(const m8r::Atom& prop, const Value& value, Value::Value::SetType = Value::Value::SetType::AddIfNeeded) { return false; }
@@ -75,6 +99,12 @@ public:
     virtual uint32_t numProperties() const { return 0; }
     virtual m8r::Atom propertyKeyforIndex(uint32_t i) const { return m8r::Atom(); }
     
+    // Native for-in iteration. iterationCount() returns the number of entries to
+    // iterate or -1 if the object must be iterated using its 'iterator' property
+    virtual int32_t iterationCount() const { return -1; }
+    virtual const Value iterationValue(ExecutionUnit* eu, uint32_t index) const { return Value(); }
+    virtual bool setIterationValue(ExecutionUnit* eu, uint32_t index, const Value& value) { return false; }
+    
     virtual m8r::CallReturnValue callProperty(ExecutionUnit*, m8r::Atom prop, uint32_t nparams) { return m8r::CallReturnValue(m8r::Error::Code::Unimplemented); }
     
     void setMarked(bool b) { _marked = b; }
@@ -100,8 +130,16 @@ public:
     }
     
     virtual bool canMakeClosure() const { return false; }
+    
+    // Function and Closure are called directly by the ExecutionUnit
+    // rather than through the virtual call()
+    bool isFunction() const { return _isFunction; }
+    bool isClosure() const { return _isClosure; }
 
 protected:
+    void setIsFunction() { _isFunction = true; }
+    void setIsClosure() { _isClosure = true; }
+    
     void setProto(const Value& val) { _proto = val; }
     Value proto() const { return _proto; }
     
@@ -111,6 +149,8 @@ private:
     Value _proto;
     bool _marked : 1;
     bool _isDestroyed : 1;
+    bool _isFunction : 1;
+    bool _isClosure : 1;
     m8r::Atom _typeName;
     m8r::SharedPtr<NativeObject> _nativeObject;
 };
@@ -123,6 +163,8 @@ public:
     virtual m8r::String toString(ExecutionUnit*, bool typeOnly = false) const override;
 
     virtual void gcMark() override;
+    virtual void heapSnapshot(HeapSnapshot&) const override;
+    virtual void runDestructor() override;
     
     virtual const Value element(ExecutionUnit* eu, const Value& elt) const override;
     virtual bool setElement(ExecutionUnit* eu, const Value& elt, const Value& value, Value::SetType) override;
@@ -131,11 +173,23 @@ public:
     virtual const Value property(const m8r::Atom& prop) const override;
     virtual bool setProperty(const m8r::Atom& prop, const Value& v, Value::Value::SetType type = Value::Value::SetType::AddIfNeeded) override;
 
+    // Where prop is stored in this object, not in its protos, or nullptr if
+    // it isn't. Adding a property can move it
+    Value* propertySlot(const m8r::Atom& prop)
+    {
+        auto it = _properties.find(prop);
+        return (it == _properties.end()) ? nullptr : &(it->value);
+    }
+
     virtual uint32_t numProperties() const override { return static_cast<int32_t>(_properties.size()); }
     virtual m8r::Atom propertyKeyforIndex(uint32_t i) const override { return (i < numProperties()) ? (_properties.begin() + i)->key : m8r::Atom(); }
 
+    virtual int32_t iterationCount() const override;
+    virtual const Value iterationValue(ExecutionUnit* eu, uint32_t index) const override { return Value(propertyKeyforIndex(index)); }
+
 private:
     PropertyMap _properties;
+    bool _destructorRun = false;
 };
 
 class MaterArray : public Object {
@@ -146,6 +200,7 @@ public:
     virtual m8r::String toString(ExecutionUnit*, bool typeOnly = false) const override;
 
     virtual void gcMark() override;
+    virtual void heapSnapshot(HeapSnapshot&) const override;
     
     virtual const Value element(ExecutionUnit* eu, const Value& elt) const override;
     virtual bool setElement(ExecutionUnit* eu, const Value& elt, const Value& value, Value::SetType) override;
@@ -154,6 +209,13 @@ public:
     virtual const Value property(const m8r::Atom& prop) const override;
     virtual bool setProperty(const m8r::Atom& prop, const Value& v, Value::Value::SetType type = Value::Value::SetType::AddIfNeeded) override;
     
+    virtual int32_t iterationCount() const override { return static_cast<int32_t>(_array.size()); }
+    virtual const Value iterationValue(ExecutionUnit* eu, uint32_t index) const override { return (index < _array.size()) ? _array[index] : Value(); }
+    virtual bool setIterationValue(ExecutionUnit* eu, uint32_t index, const Value& value) override
+    {
+        return setElement(eu, Value(static_cast<int32_t>(index)), value, Value::SetType::NeverAdd);
+    }
+
     size_t size() const { return _array.size(); }
     bool empty() const { return _array.empty(); }
     void clear() { _array.clear(); }
@@ -190,15 +252,20 @@ protected:
 class StaticObject
 {
 public:
+    // Static properties are Integer constants, so this is pod like the other
+    // property types. Tables are then initialized at compile time, before any
+    // StaticObject constructor reads them
     struct StaticProperty
     {
         SA name() const { return _name; }
-        Value value() const { return _value; }
+        Value value() const { return Value(_value); }
 
         bool operator==(const m8r::Atom& atom) const { return SAtom(name()) == atom; }
         SA _name;
-        Value _value;
+        int32_t _value;
     };
+
+    static_assert(std::is_pod<StaticProperty>::value, "StaticProperty must be pod");
     
     struct StaticFunctionProperty
     {
@@ -229,40 +296,61 @@ public:
         return const_cast<StaticObject*>(this)->property(name);
     }
 
+    // Only shared atoms can name a static property. Others are turned away
+    // without a search, and the tables are searched by halves
     Value property(const m8r::Atom& name)
     {
-        auto it = std::find_if(_functionProperties, _functionProperties + _functionPropertiesCount, 
-                               [name](const StaticFunctionProperty& p) { return name == SAtom(p.name()); });
-        if (it != _functionProperties + _functionPropertiesCount) {
-            return Value(it->func());
+        if (name.raw() >= SharedAtomCount) {
+            return Value();
+        }
+        if (const StaticFunctionProperty* p = findProperty(_functionProperties, _functionPropertiesCount, name)) {
+            return Value(p->func());
         }
-        auto it2 = std::find_if(_objectProperties, _objectProperties + _objectPropertiesCount,
-                                [name](const StaticObjectProperty& p) { return name == SAtom(p.name()); });
-        if (it2 != _objectProperties + _objectPropertiesCount) {
-            return Value(it2->obj());
+        if (const StaticObjectProperty* p = findProperty(_objectProperties, _objectPropertiesCount, name)) {
+            return Value(p->obj());
         }
-        auto it3 = std::find(_properties, _properties + _propertiesCount, name);
-        return (it3 == _properties + _propertiesCount) ? Value() : it3->value();
+        const StaticProperty* p = findProperty(_properties, _propertiesCount, name);
+        return p ? p->value() : Value();
     }
     
-    void setProperties(StaticProperty* props, size_t count)
+    // Tables must be written in SA order, which is the order of their names,
+    // so they can be const and searched without sorting them first
+    void setProperties(const StaticProperty* props, size_t count)
     {
+        assert(isSorted(props, count));
         _properties = props;
         _propertiesCount = count;
     }
 
-    void setProperties(StaticFunctionProperty* props, size_t count)
+    void setProperties(const StaticFunctionProperty* props, size_t count)
     {
+        assert(isSorted(props, count));
         _functionProperties = props;
         _functionPropertiesCount = count;
     }
 
-    void setProperties(StaticObjectProperty* props, size_t count)
+    void setProperties(const StaticObjectProperty* props, size_t count)
     {
+        assert(isSorted(props, count));
         _objectProperties = props;
         _objectPropertiesCount = count;
     }
 
+private:
+    template<typename T>
+    static bool isSorted(const T* props, size_t count)
+    {
+        return std::adjacent_find(props, props + count, [](const T& a, const T& b) { return !(a.name() < b.name()); }) == props + count;
+    }
+    
+    template<typename T>
+    static const T* findProperty(const T* props, uint16_t count, const m8r::Atom& name)
+    {
+        SA sa = static_cast<SA>(name.raw());
+        const T* it = std::lower_bound(props, props + count, sa, [](const T& p, SA sa) { return p.name() < sa; });
+        return (it != props + count && it->name() == sa) ? it : nullptr;
+    }
+
 protected:
     const StaticFunctionProperty* _functionProperties = nullptr;
     const StaticObjectProperty* _objectProperties = nullptr;
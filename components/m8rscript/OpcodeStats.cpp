@@ -0,0 +1,128 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "OpcodeStats.h"
+
+#include "CodePrinter.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+
+using namespace m8rscript;
+using namespace m8r;
+
+#if M8RSCRIPT_OPCODE_STATS
+
+uint64_t OpcodeStats::_ops[NumOps];
+uint64_t OpcodeStats::_pairs[NumOps][NumOps];
+uint64_t OpcodeStats::_fallbacks[static_cast<uint8_t>(Fallback::NumFallbacks)];
+uint8_t OpcodeStats::_prevOp = static_cast<uint8_t>(Op::UNKNOWN);
+
+struct FallbackInfo {
+    const char* name;
+    Op op;
+};
+
+static const FallbackInfo fallbackInfo[] = {
+    { "ADD float", Op::ADD },
+    { "ADD string", Op::ADD },
+    { "LOADELT non-int index", Op::LOADELT },
+    { "CALL native", Op::CALL },
+};
+
+static_assert(sizeof(fallbackInfo) / sizeof(FallbackInfo) == static_cast<uint8_t>(OpcodeStats::Fallback::NumFallbacks), "fallbackInfo is wrong size");
+
+struct Row {
+    uint64_t count;
+    uint32_t index;
+};
+
+static void sortRows(Vector<Row>& rows)
+{
+    std::sort(rows.begin(), rows.end(), [](const Row& a, const Row& b) {
+        return (a.count != b.count) ? (a.count > b.count) : (a.index < b.index);
+    });
+}
+
+static void appendRow(String& s, uint64_t count, uint64_t total, const char* label)
+{
+    char buf[80];
+    snprintf(buf, sizeof(buf), "%12llu %6.2f%%  %s\n", static_cast<unsigned long long>(count),
+             total ? (100.0 * count / total) : 0.0, label);
+    s += buf;
+}
+
+void OpcodeStats::clear()
+{
+    memset(_ops, 0, sizeof(_ops));
+    memset(_pairs, 0, sizeof(_pairs));
+    memset(_fallbacks, 0, sizeof(_fallbacks));
+    _prevOp = static_cast<uint8_t>(Op::UNKNOWN);
+}
+
+String OpcodeStats::table(uint32_t n)
+{
+    uint64_t total = 0;
+    Vector<Row> rows;
+    for (uint32_t i = 0; i < NumOps; ++i) {
+        if (_ops[i]) {
+            total += _ops[i];
+            rows.push_back({ _ops[i], i });
+        }
+    }
+    sortRows(rows);
+
+    char buf[80];
+    String s;
+    snprintf(buf, sizeof(buf), "Opcodes: %llu dispatched\n", static_cast<unsigned long long>(total));
+    s += buf;
+    for (uint32_t i = 0; i < rows.size() && i < n; ++i) {
+        appendRow(s, rows[i].count, total, CodePrinter::stringFromOp(static_cast<Op>(rows[i].index)));
+    }
+
+    // The first instruction of a run has no predecessor, so isn't in a pair
+    rows.clear();
+    for (uint32_t i = 0; i < NumOps; ++i) {
+        for (uint32_t j = 0; j < NumOps; ++j) {
+            if (_pairs[i][j] && i != static_cast<uint8_t>(Op::UNKNOWN)) {
+                rows.push_back({ _pairs[i][j], i * NumOps + j });
+            }
+        }
+    }
+    sortRows(rows);
+
+    s += "\nPairs:\n";
+    for (uint32_t i = 0; i < rows.size() && i < n; ++i) {
+        String label = CodePrinter::stringFromOp(static_cast<Op>(rows[i].index / NumOps));
+        label += " -> ";
+        label += CodePrinter::stringFromOp(static_cast<Op>(rows[i].index % NumOps));
+        appendRow(s, rows[i].count, total, label.c_str());
+    }
+
+    // Fallbacks are a percentage of the instruction they are in
+    s += "\nFallbacks:\n";
+    for (uint32_t i = 0; i < static_cast<uint8_t>(Fallback::NumFallbacks); ++i) {
+        Op op = fallbackInfo[i].op;
+        uint64_t opCount = _ops[static_cast<uint8_t>(op)];
+        if (op == Op::CALL) {
+            opCount += _ops[static_cast<uint8_t>(Op::TAILCALL)];
+        }
+        appendRow(s, _fallbacks[i], opCount, fallbackInfo[i].name);
+    }
+    return s;
+}
+
+#else
+
+String OpcodeStats::table(uint32_t)
+{
+    return String("Opcode stats are not in this build. Build with M8RSCRIPT_OPCODE_STATS=1\n");
+}
+
+#endif
@@ -0,0 +1,72 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <cstdint>
+
+#include "Containers.h"
+#include "MachineCode.h"
+
+// Set to 1 to count every instruction dispatched by ExecutionUnit::execute()
+#ifndef M8RSCRIPT_OPCODE_STATS
+#define M8RSCRIPT_OPCODE_STATS 0
+#endif
+
+namespace m8rscript {
+
+// OpcodeStats - Histograms of the instructions a workload executes
+//
+// Counts each opcode dispatched, each pair of consecutive opcodes and each
+// time ADD, LOADELT or CALL takes its slower path. The pairs show which
+// superinstructions would pay off and the fallbacks show where a quickened
+// variant would.
+class OpcodeStats {
+public:
+    enum class Fallback : uint8_t {
+        AddFloat,           // ADD of two numbers that aren't both ints
+        AddString,          // ADD that concatenates strings
+        LoadEltByName,      // LOADELT with an index that isn't an int
+        CallNative,         // CALL of anything but a script function or closure
+        NumFallbacks
+    };
+
+#if M8RSCRIPT_OPCODE_STATS
+    static constexpr bool enabled() { return true; }
+    static void dispatched(Op op)
+    {
+        uint8_t o = static_cast<uint8_t>(op);
+        ++_ops[o];
+        ++_pairs[_prevOp][o];
+        _prevOp = o;
+    }
+    static void fallback(Fallback f) { ++_fallbacks[static_cast<uint8_t>(f)]; }
+    static void clear();
+#else
+    static constexpr bool enabled() { return false; }
+    static void dispatched(Op) { }
+    static void fallback(Fallback) { }
+    static void clear() { }
+#endif
+
+    // Each section is sorted by count, most first, and shows at most n rows
+    static m8r::String table(uint32_t n = 20);
+
+private:
+#if M8RSCRIPT_OPCODE_STATS
+    static constexpr uint32_t NumOps = 64;
+    
+    static uint64_t _ops[NumOps];
+    static uint64_t _pairs[NumOps][NumOps];
+    static uint64_t _fallbacks[static_cast<uint8_t>(Fallback::NumFallbacks)];
+    static uint8_t _prevOp;
+#endif
+};
+
+}
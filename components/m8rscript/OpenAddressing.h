@@ -0,0 +1,109 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+namespace m8rscript {
+
+// OpenAddressing - Probing for the tables which find things by hash
+//
+// A table is a power of 2 number of slots, which the caller owns. An entry
+// goes in the first empty slot at or after the one its hash picks, wrapping
+// at the end. A slot is empty when it converts to false. Tables are kept at
+// most half full, so most searches are a probe or two.
+namespace OpenAddressing {
+
+    // Hashes are FNV-1a, started with HashStart and fed a byte at a time
+    static constexpr uint32_t HashStart = 2166136261u;
+    
+    inline uint32_t hashByte(uint32_t hash, uint8_t byte)
+    {
+        return (hash ^ byte) * 16777619u;
+    }
+    
+    // Feeds the 4 bytes of word, low byte first
+    inline uint32_t hashWord(uint32_t hash, uint32_t word)
+    {
+        for (uint32_t i = 0; i < 4; ++i, word >>= 8) {
+            hash = hashByte(hash, static_cast<uint8_t>(word));
+        }
+        return hash;
+    }
+    
+    // Hash of up to length chars, stopping at a '\0' or any char at or
+    // above end. Sets length to the number hashed
+    inline uint32_t hash(const char* s, size_t& length, uint8_t end = 0xff)
+    {
+        uint32_t h = HashStart;
+        size_t i = 0;
+        for ( ; i < length && s[i] && static_cast<uint8_t>(s[i]) < end; ++i) {
+            h = hashByte(h, static_cast<uint8_t>(s[i]));
+        }
+        length = i;
+        return h;
+    }
+    
+    // Hash of a '\0' terminated string
+    inline uint32_t hash(const char* s)
+    {
+        size_t length = SIZE_MAX;
+        return hash(s, length);
+    }
+
+    // Spreads a hash of numbers which differ mostly in their low bits, like
+    // Atoms or ids, over the bits find() and insert() use
+    inline uint32_t mix(uint32_t hash)
+    {
+        hash *= 2654435761u;
+        return hash ^ (hash >> 16);
+    }
+
+    // Number of slots a table of size slots holding count entries needs to
+    // add one more, or 0 when it has room
+    inline size_t sizeToAdd(uint32_t count, size_t size, size_t minSize)
+    {
+        if ((count + 1) * 2 <= size) {
+            return 0;
+        }
+        return size ? size * 2 : minSize;
+    }
+
+    // Returns the slot of the entry for which match returns true, or null
+    template<typename T, typename Match>
+    const T* find(const T* slots, size_t size, uint32_t hash, Match match)
+    {
+        if (!size) {
+            return nullptr;
+        }
+        uint32_t mask = static_cast<uint32_t>(size) - 1;
+        for (uint32_t i = hash & mask; slots[i]; i = (i + 1) & mask) {
+            if (match(slots[i])) {
+                return &slots[i];
+            }
+        }
+        return nullptr;
+    }
+
+    template<typename T>
+    void insert(T* slots, size_t size, uint32_t hash, const T& slot)
+    {
+        uint32_t mask = static_cast<uint32_t>(size) - 1;
+        uint32_t i = hash & mask;
+        while (slots[i]) {
+            i = (i + 1) & mask;
+        }
+        slots[i] = slot;
+    }
+
+}
+
+}
@@ -0,0 +1,127 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "ParseArena.h"
+
+using namespace m8rscript;
+using namespace m8r;
+
+void* ParseArena::alloc(uint32_t size)
+{
+    size = align(size);
+    
+    // First fit. What is left of a larger block stays on the list
+    for (FreeBlock** prev = &_free; *prev; prev = &((*prev)->_next)) {
+        FreeBlock* block = *prev;
+        if (block->_size < size) {
+            continue;
+        }
+        
+        // The header of the rest can overlap this one
+        FreeBlock* next = block->_next;
+        uint32_t restSize = block->_size - size;
+        if (restSize >= align(sizeof(FreeBlock))) {
+            FreeBlock* rest = reinterpret_cast<FreeBlock*>(reinterpret_cast<uint8_t*>(block) + size);
+            rest->_next = next;
+            rest->_size = restSize;
+            *prev = rest;
+        } else {
+            *prev = next;
+        }
+        return block;
+    }
+    
+    if (!_chunks || _chunks->_used + size > _chunks->_size) {
+        // Whatever is left at the end of the current chunk is wasted
+        uint32_t chunkSize = (size > ChunkSize) ? size : ChunkSize;
+        Mad<char> mem = Mad<char>::create(align(sizeof(Chunk)) + chunkSize);
+        Chunk* chunk = reinterpret_cast<Chunk*>(mem.get());
+        chunk->_mem = mem;
+        chunk->_prev = _chunks;
+        chunk->_size = chunkSize;
+        chunk->_used = 0;
+        _chunks = chunk;
+    }
+
+    void* p = _chunks->data() + _chunks->_used;
+    _chunks->_used += size;
+    return p;
+}
+
+void ParseArena::free(void* p, uint32_t size)
+{
+    size = align(size);
+    if (isLast(p, size)) {
+        _chunks->_used -= size;
+        return;
+    }
+    if (size < align(sizeof(FreeBlock))) {
+        return;
+    }
+    
+    FreeBlock* block = static_cast<FreeBlock*>(p);
+    block->_next = _free;
+    block->_size = size;
+    _free = block;
+}
+
+bool ParseArena::extend(void* p, uint32_t oldSize, uint32_t newSize)
+{
+    oldSize = align(oldSize);
+    newSize = align(newSize);
+    if (!isLast(p, oldSize) || _chunks->_used - oldSize + newSize > _chunks->_size) {
+        return false;
+    }
+    _chunks->_used = _chunks->_used - oldSize + newSize;
+    return true;
+}
+
+uint32_t ParseArena::sizeKept(const void* p, uint32_t size, const Mark& mark) const
+{
+    const uint8_t* block = static_cast<const uint8_t*>(p);
+    for (Chunk* chunk = _chunks; chunk != mark.chunk; chunk = chunk->_prev) {
+        if (block >= chunk->data() && block < chunk->data() + chunk->_size) {
+            return 0;
+        }
+    }
+    if (!mark.chunk || block < mark.chunk->data() || block >= mark.chunk->data() + mark.chunk->_size) {
+        return size;
+    }
+    
+    // A block can be extended past the mark if it was the last one
+    const uint8_t* end = mark.chunk->data() + mark.used;
+    if (block + size <= end) {
+        return size;
+    }
+    return (block < end) ? static_cast<uint32_t>(end - block) : 0;
+}
+
+void ParseArena::rewind(const Mark& mark)
+{
+    // Free blocks past the mark go with it
+    for (FreeBlock** prev = &_free; *prev; ) {
+        FreeBlock* block = *prev;
+        block->_size = sizeKept(block, block->_size, mark);
+        if (block->_size < align(sizeof(FreeBlock))) {
+            *prev = block->_next;
+        } else {
+            prev = &(block->_next);
+        }
+    }
+    
+    while (_chunks && _chunks != mark.chunk) {
+        Chunk* chunk = _chunks;
+        _chunks = chunk->_prev;
+        Mad<char> mem = chunk->_mem;
+        mem.destroy();
+    }
+    if (_chunks) {
+        _chunks->_used = mark.used;
+    }
+}
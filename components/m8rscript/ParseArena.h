@@ -0,0 +1,190 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Mallocator.h"
+#include <cassert>
+#include <cstdint>
+#include <new>
+
+namespace m8rscript {
+
+// ParseArena - Bump allocator for the temporaries of a compile
+//
+// Blocks are carved out of chunks of at least ChunkSize bytes, one after the
+// other. mark() saves the current end and rewind() frees everything allocated
+// since, and release() frees it all. So a compile makes a few large
+// allocations rather than many small ones that would be freed at different
+// times and fragment the heap. A block given back with free() goes on a free
+// list, which alloc() looks at before carving a new one, so a vector that
+// grows doesn't leave every size it has been behind it.
+class ParseArena {
+    struct Chunk;
+
+public:
+    struct Mark {
+        Chunk* chunk = nullptr;
+        uint32_t used = 0;
+    };
+
+    ParseArena() { }
+    ParseArena(const ParseArena&) = delete;
+    ParseArena& operator=(const ParseArena&) = delete;
+    ~ParseArena() { release(); }
+
+    void* alloc(uint32_t size);
+    void free(void* p, uint32_t size);
+
+    // Grow the block at p from oldSize to newSize bytes without moving it.
+    // Only possible if it is the last block allocated and the chunk has room
+    bool extend(void* p, uint32_t oldSize, uint32_t newSize);
+
+    Mark mark() const { return { _chunks, _chunks ? _chunks->_used : 0 }; }
+    void rewind(const Mark&);
+    void release() { rewind({ nullptr, 0 }); }
+
+private:
+    static constexpr uint32_t Align = 8;
+    static constexpr uint32_t ChunkSize = 512;
+
+    static uint32_t align(uint32_t size) { return (size + Align - 1) & ~(Align - 1); }
+
+    // Kept in the block it describes, so smaller blocks aren't listed
+    struct FreeBlock {
+        FreeBlock* _next;
+        uint32_t _size;
+    };
+
+    bool isLast(const void* p, uint32_t size) const
+    {
+        return _chunks && p == _chunks->data() + _chunks->_used - size;
+    }
+    
+    // How much of a free block is left after rewinding to the mark
+    uint32_t sizeKept(const void* p, uint32_t size, const Mark&) const;
+
+    struct Chunk {
+        m8r::Mad<char> _mem;
+        Chunk* _prev;
+        uint32_t _size;
+        uint32_t _used;
+
+        uint8_t* data() { return reinterpret_cast<uint8_t*>(this) + align(sizeof(Chunk)); }
+    };
+
+    // Newest first
+    Chunk* _chunks = nullptr;
+    FreeBlock* _free = nullptr;
+};
+
+// ArenaVector - Vector whose storage is in a ParseArena
+//
+// It has the parts of the Vector interface the Parser uses. When it grows it
+// extends its block if that was the last one allocated, otherwise it copies
+// itself to a new block twice the size and frees the old one. Copies share
+// storage, so only one of them may grow or be discarded. Elements are never
+// destroyed, so T must not own anything.
+template<typename T>
+class ArenaVector {
+public:
+    using iterator = T*;
+    using const_iterator = const T*;
+
+    ArenaVector() { }
+    explicit ArenaVector(ParseArena* arena) : _arena(arena) { }
+
+    ParseArena* arena() const { return _arena; }
+
+    iterator begin() { return _data; }
+    const_iterator begin() const { return _data; }
+    iterator end() { return _data + _size; }
+    const_iterator end() const { return _data + _size; }
+
+    T* data() { return _data; }
+    const T* data() const { return _data; }
+    size_t size() const { return _size; }
+    bool empty() const { return _size == 0; }
+
+    T& operator[](size_t i) { return _data[i]; }
+    const T& operator[](size_t i) const { return _data[i]; }
+    T& at(size_t i) { assert(i < _size); return _data[i]; }
+    const T& at(size_t i) const { assert(i < _size); return _data[i]; }
+    T& back() { assert(_size); return _data[_size - 1]; }
+    const T& back() const { assert(_size); return _data[_size - 1]; }
+
+    void push_back(const T& value)
+    {
+        // value can be in the block that growing frees
+        T v = value;
+        ensureCapacity(_size + 1);
+        new(_data + _size++) T(v);
+    }
+
+    void pop_back() { assert(_size); --_size; }
+
+    void resize(size_t size)
+    {
+        ensureCapacity(static_cast<uint32_t>(size));
+        while (_size < size) {
+            new(_data + _size++) T();
+        }
+        _size = static_cast<uint32_t>(size);
+    }
+
+    // clear() keeps the storage. discard() gives it back to the arena and
+    // release() forgets it, for when the arena has been rewound past it
+    void clear() { _size = 0; }
+    void discard()
+    {
+        if (_data) {
+            _arena->free(_data, _capacity * sizeof(T));
+        }
+        release();
+    }
+    void release() { _data = nullptr; _size = 0; _capacity = 0; }
+
+private:
+    static constexpr uint32_t MinCapacity = 8;
+
+    void ensureCapacity(uint32_t size)
+    {
+        if (size <= _capacity) {
+            return;
+        }
+
+        assert(_arena);
+        uint32_t capacity = _capacity ? (_capacity * 2) : MinCapacity;
+        if (capacity < size) {
+            capacity = size;
+        }
+
+        if (_data && _arena->extend(_data, _capacity * sizeof(T), capacity * sizeof(T))) {
+            _capacity = capacity;
+            return;
+        }
+
+        T* data = static_cast<T*>(_arena->alloc(capacity * sizeof(T)));
+        for (uint32_t i = 0; i < _size; ++i) {
+            new(data + i) T(_data[i]);
+        }
+        if (_data) {
+            _arena->free(_data, _capacity * sizeof(T));
+        }
+        _data = data;
+        _capacity = capacity;
+    }
+
+    ParseArena* _arena = nullptr;
+    T* _data = nullptr;
+    uint32_t _size = 0;
+    uint32_t _capacity = 0;
+};
+
+}
@@ -9,6 +9,9 @@
 
 #include "ParseEngine.h"
 
+#include "OpenAddressing.h"
+#include <limits>
+
 using namespace m8rscript;
 using namespace m8r;
 
@@ -54,7 +57,18 @@ static const char _keywordString[] =
     "\xff"
 ;
 
-static const char* keywordString(_keywordString);
+static_assert(sizeof(_keywordString) <= 256, "keyword offsets must fit in a byte");
+
+// Keywords and operators are found with OpenAddressing tables, built the first
+// time a ParseEngine is made. Keyword slots hold the offset in _keywordString
+// of a keyword and operator slots hold the index in _opInfos + 1. Either is 0
+// when the slot is empty.
+static constexpr uint32_t KeywordSlots = 128;
+static constexpr uint32_t OperatorSlotBits = 6;
+static constexpr uint32_t OperatorSlots = 1 << OperatorSlotBits;
+static uint8_t keywordSlots[KeywordSlots];
+static uint8_t operatorSlots[OperatorSlots];
+static bool lookupTablesBuilt = false;
 
 static inline ParseEngine::Token keywordCharToToken(char c)
 {
@@ -62,14 +76,29 @@ static inline ParseEngine::Token keywordCharToToken(char c)
     return static_cast<ParseEngine::Token>(uint16_t(uint8_t(c)) + 0x100);
 }
 
+// A word ends at a null or at the token char of the next keyword
+static inline uint32_t keywordHash(const char* s)
+{
+    size_t length = std::numeric_limits<size_t>::max();
+    return OpenAddressing::hash(s, length, 0x80);
+}
+
 static inline ParseEngine::Token findKeyword(const char* s)
 {
-    int32_t len = static_cast<int32_t>(strlen(s));
-    const char* result = ::strstr(keywordString, s);
-    if (!result || uint8_t(result[len]) < 0x80 || uint8_t(result[-1]) < 0x80) {
-        return ParseEngine::Token::None;
-    }
-    return keywordCharToToken(result[-1]);
+    const uint8_t* slot = OpenAddressing::find(keywordSlots, KeywordSlots, keywordHash(s), [s](uint8_t offset) {
+        const char* keyword = _keywordString + offset;
+        uint32_t len = 0;
+        while (s[len] && s[len] == keyword[len]) {
+            ++len;
+        }
+        return !s[len] && uint8_t(keyword[len]) >= 0x80;
+    });
+    return slot ? keywordCharToToken(_keywordString[*slot - 1]) : ParseEngine::Token::None;
+}
+
+static inline uint32_t operatorSlot(ParseEngine::Token token)
+{
+    return (static_cast<uint32_t>(token) * 2654435761u) >> (32 - OperatorSlotBits);
 }
 
 // If the word is a keyword, return the enum for it, otherwise return Unknown
@@ -79,6 +108,9 @@ ParseEngine::Token ParseEngine::getToken()
         return _currentToken;
     }
     
+    // Finding keywords and multi-char operators counts as scanning
+    CompileStats::Scope statsScope(CompileStats::Phase::Scan);
+    
     Token token = (_currentToken == Token::None) ? Token(_parser->_scanner.getToken()) : _currentToken;
     
     if (token == Token::Identifier) {
@@ -196,6 +228,34 @@ ParseEngine::OperatorInfo ParseEngine::_opInfos[ ] = {
 ParseEngine::ParseEngine(Parser* parser)
     : _parser(parser)
 {
+    if (!lookupTablesBuilt) {
+        buildLookupTables();
+        lookupTablesBuilt = true;
+    }
+}
+
+void ParseEngine::buildLookupTables()
+{
+    for (uint32_t offset = 0; uint8_t(_keywordString[offset]) != 0xff; ++offset) {
+        if (uint8_t(_keywordString[offset]) < 0x80) {
+            continue;
+        }
+        ++offset;
+        OpenAddressing::insert(keywordSlots, KeywordSlots, keywordHash(_keywordString + offset), static_cast<uint8_t>(offset));
+    }
+    
+    static_assert(sizeof(_opInfos) / sizeof(OperatorInfo) * 2 <= OperatorSlots, "too many operators for the table");
+    for (uint32_t index = 0; index < sizeof(_opInfos) / sizeof(OperatorInfo); ++index) {
+        OpenAddressing::insert(operatorSlots, OperatorSlots, operatorSlot(_opInfos[index].token()), static_cast<uint8_t>(index + 1));
+    }
+}
+
+const ParseEngine::OperatorInfo* ParseEngine::findOperator(Token token)
+{
+    const uint8_t* slot = OpenAddressing::find(operatorSlots, OperatorSlots, operatorSlot(token), [token](uint8_t index) {
+        return _opInfos[index - 1].token() == token;
+    });
+    return slot ? &_opInfos[*slot - 1] : nullptr;
 }
 
 bool ParseEngine::expect(Token token)
@@ -351,6 +411,8 @@ bool ParseEngine::switchStatement()
     expect(Token::RParen);
     expect(Token::LBrace);
     
+    int32_t caseTestStart = _parser->startSwitch();
+    
     // This pushes a deferral block onto the deferred stack.
     // We use resumeDeferred()/endDeferred() for each statement block
     int32_t deferredStatementStart = _parser->startDeferred();
@@ -369,26 +431,50 @@ bool ParseEngine::switchStatement()
     
     expect(Token::RBrace);
     
-    // We need a JMP statement here. It will either jump after all the case
-    // statements or to the default statement
+    // If all the case values are constants, try to replace the case tests
+    // with a SWITCH through a jump table
+    Vector<Value> caseValues;
+    for (auto it : cases) {
+        if (!it.isConstant) {
+            caseValues.clear();
+            break;
+        }
+        caseValues.push_back(it.value);
+    }
+    
+    int32_t switchAddr = caseValues.empty() ? -1 : _parser->emitSwitch(caseTestStart, caseValues);
+
+    // Otherwise we need a JMP statement here. It will either jump after all
+    // the case statements or to the default statement
     Parser::Label endJumpLabel = _parser->label();
-    _parser->addMatchedJump(Op::JMP, endJumpLabel);
+    if (switchAddr < 0) {
+        _parser->addMatchedJump(Op::JMP, endJumpLabel);
+    }
     
     int32_t statementStart = _parser->emitDeferred();
     Parser::Label afterStatementsLabel = _parser->label();
+    int32_t defaultAddr = afterStatementsLabel.label;
     
     if (haveDefault) {
-        _parser->matchJump(endJumpLabel, defaultStatement - deferredStatementStart + statementStart);
+        defaultAddr = defaultStatement - deferredStatementStart + statementStart;
 
         // Adjust the matchedAddr in the defaultFromStatementLabel into the code space it got copied to
         defaultFromStatementLabel.matchedAddr += statementStart - deferredStatementStart;
         _parser->matchJump(defaultFromStatementLabel, afterStatementsLabel);
-    } else {
-        _parser->matchJump(endJumpLabel, afterStatementsLabel);
+    }
+    
+    if (switchAddr < 0) {
+        _parser->matchJump(endJumpLabel, defaultAddr);
     }
 
+    Vector<int32_t> caseAddrs;
     for (auto it : cases) {
-        _parser->matchJump(it.toStatement, it.statementAddr - deferredStatementStart + statementStart);
+        int32_t statementAddr = it.statementAddr - deferredStatementStart + statementStart;
+        if (switchAddr < 0) {
+            _parser->matchJump(it.toStatement, statementAddr);
+        } else {
+            caseAddrs.push_back(statementAddr);
+        }
         
         if (it.fromStatement.label >= 0) {
             // Adjust the matchedAddr in the fromStatement into the code space it got copied to
@@ -397,6 +483,10 @@ bool ParseEngine::switchStatement()
         }
     }
     
+    if (switchAddr >= 0) {
+        _parser->matchSwitch(switchAddr, caseValues, caseAddrs, defaultAddr);
+    }
+    
     _parser->discardResult();
     return true;
 }
@@ -436,7 +526,9 @@ bool ParseEngine::iterationStatement()
             _parser->matchJump(it);
         }
 
-        expect(Expect::While);
+        if (expect(Expect::While, getToken() == Token::While)) {
+            retireToken();
+        }
         expect(Token::LParen);
         commaExpression();
         _parser->jumpToLabel(Op::JT, label);
@@ -619,12 +711,16 @@ bool ParseEngine::caseClause(Vector<CaseEntry>& cases,
     if (token == Token::Case || token == Token::Default) {
         bool isDefault = token == Token::Default;
         retireToken();
+        
+        Value value;
+        bool isConstant = false;
 
         if (isDefault) {
             expect(Expect::DuplicateDefault, !haveDefault);
             haveDefault = true;
         } else {
             commaExpression();
+            isConstant = _parser->topConstantValue(value);
             _parser->emitCaseTest();
         }
         
@@ -648,6 +744,8 @@ bool ParseEngine::caseClause(Vector<CaseEntry>& cases,
                 entry.fromStatement.label = -1;
             }
             _parser->endDeferred();
+            entry.value = value;
+            entry.isConstant = isConstant;
             cases.push_back(entry);
         }
         return true;
@@ -668,6 +766,20 @@ void ParseEngine::forLoopCondAndIt()
     _parser->discardResult();
     _parser->endDeferred();
     expect(Token::RParen);
+    
+    Parser::ForLoop forLoop;
+    if (_parser->startForLoop(label, forLoop)) {
+        statement();
+
+        // The continue statements go to the FORLOOP
+        for (auto it : _continueStack.back()) {
+            _parser->matchJump(it);
+        }
+        
+        _parser->endForLoop(forLoop);
+        return;
+    }
+    
     statement();
 
     // resolve the continue statements
@@ -693,6 +805,29 @@ void ParseEngine::forIteration(Atom iteratorName)
     commaExpression();
     expect(Token::RParen);
 
+    // Arrays, Objects and Strings can be iterated natively when the iterator is a
+    // local. ITERINIT falls back to an Iterator object for anything else
+    if (_parser->startIteration()) {
+        Parser::Label label = _parser->label();
+        _parser->emitIterNext(IterOp::Done);
+        _parser->addMatchedJump(Op::JT, label);
+
+        statement();
+
+        // resolve the continue statements
+        for (auto it : _continueStack.back()) {
+            _parser->matchJump(it);
+        }
+
+        _parser->emitIterNext(IterOp::Next);
+        _parser->discardResult();
+
+        _parser->jumpToLabel(Op::JMP, label);
+        _parser->matchJump(label);
+        _parser->endIteration();
+        return;
+    }
+    
     _parser->emitDup();
     _parser->emitPush();
     _parser->emitId(SAtom(SA::iterator), Parser::IdType::NotLocal);
@@ -1036,9 +1171,8 @@ bool ParseEngine::arithmeticExpression(uint8_t minPrec)
     }
     
     while(1) {
-        OperatorInfo* endit = _opInfos + sizeof(_opInfos) / sizeof(OperatorInfo);
-        OperatorInfo* it = std::find(_opInfos, endit, getToken());
-        if (it == endit || it->prec() < minPrec) {
+        const OperatorInfo* it = findOperator(getToken());
+        if (!it || it->prec() < minPrec) {
             break;
         }
         uint8_t nextMinPrec = (it->assoc() == OperatorInfo::Assoc::Left) ? (it->prec() + 1) : it->prec();
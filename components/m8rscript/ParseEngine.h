@@ -10,6 +10,7 @@
 #pragma once
 
 #include "Atom.h"
+#include "CompileStats.h"
 #include "Containers.h"
 #include "Parser.h"
 
@@ -399,6 +400,7 @@ private:
     const m8r::Scanner::TokenType& getTokenValue() { return _parser->_scanner.getTokenValue(); }
     void retireToken()
     {
+        CompileStats::token();
         if (_retireScannerToken) {
             _parser->_scanner.retireToken();
         }
@@ -418,7 +420,7 @@ private:
     bool varStatement();
     bool expressionStatement();
     
-    using CaseEntry = struct { Parser::Label toStatement; Parser::Label fromStatement; int32_t statementAddr; };
+    using CaseEntry = struct { Parser::Label toStatement; Parser::Label fromStatement; int32_t statementAddr; Value value; bool isConstant; };
 
     bool caseClause(m8r::Vector<CaseEntry>& cases, int32_t &defaultStatement, 
                     Parser::Label& defaultFromStatementLabel, bool& haveDefault);
@@ -456,6 +458,9 @@ private:
         int operator()(const Token& lhs, const Token& rhs) const { return static_cast<int>(lhs) - static_cast<int>(rhs); }
     };
 
+    static void buildLookupTables();
+    static const OperatorInfo* findOperator(Token);
+
     static OperatorInfo _opInfos[ ];
 };
 
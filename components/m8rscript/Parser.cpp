@@ -10,6 +10,7 @@
 #include "Parser.h"
 
 #include "ParseEngine.h"
+#include "CompileStats.h"
 #include "ExecutionUnit.h"
 #include "GC.h"
 #include <limits>
@@ -22,6 +23,9 @@ uint32_t Parser::_nextLabelId = 1;
 Parser::Parser(Mad<Program> program)
     : _parseStack(this)
     , _program(program.valid() ? program : Object::create<Program>())
+    , _deferredCodeBlocks(&_arena)
+    , _deferredLineNumbers(&_arena)
+    , _deferredCode(&_arena)
 {
     // While parsing the program is unprotected. It could get collected.
     // Register it to protect it during the compile
@@ -36,6 +40,7 @@ Parser::~Parser()
 Mad<Function> Parser::parse(const m8r::Stream& stream, ExecutionUnit* eu, Debug debug, Mad<Function> parent)
 {
     assert(eu);
+    CompileStats::Scope statsScope(CompileStats::Phase::Parse);
     _eu = eu;
     _debug = debug;
     _scanner.setStream(&stream);
@@ -43,9 +48,19 @@ Mad<Function> Parser::parse(const m8r::Stream& stream, ExecutionUnit* eu, Debug
     if (!parent.valid()) {
         parent = _program;
     }
-    _functions.emplace_back(parent, false);
+    _functions.emplace_back(&_functionArena, parent, false);
     p.program();
-    return functionEnd();
+    Mad<Function> function = functionEnd();
+    
+    // Everything left is garbage now, even after an error
+    _functions.clear();
+    _parseStack.release();
+    _deferredCodeBlocks.release();
+    _deferredLineNumbers.release();
+    _deferredCode.release();
+    _functionArena.release();
+    _arena.release();
+    return function;
 }
 
 void Parser::recordError(const char* format, ...)
@@ -57,6 +72,28 @@ void Parser::recordError(const char* format, ...)
     va_end(args);
 }
 
+void Parser::IndexTable::add(uint32_t hash, uint16_t index)
+{
+    size_t size = OpenAddressing::sizeToAdd(_count, _slots.size(), MinSlots);
+    if (size) {
+        ArenaVector<Slot> slots = _slots;
+        _slots = ArenaVector<Slot>(slots.arena());
+        _slots.resize(size);
+        for (const Slot& it : slots) {
+            if (it) {
+                OpenAddressing::insert(_slots.data(), _slots.size(), OpenAddressing::mix(it._hash), it);
+            }
+        }
+        slots.discard();
+    }
+    
+    Slot slot;
+    slot._hash = hash;
+    slot._index = index + 1;
+    OpenAddressing::insert(_slots.data(), _slots.size(), OpenAddressing::mix(hash), slot);
+    ++_count;
+}
+
 Parser::Label Parser::label()
 {
     Label label;
@@ -128,13 +165,11 @@ void Parser::jumpToLabel(Op op, Label& label)
     }
 }
 
-void Parser::addCode(Op op, RegOrConst reg0, RegOrConst reg1, RegOrConst reg2, uint16_t n)
+void Parser::addCode(Op op, RegOrConst reg0, RegOrConst reg1, RegOrConst reg2, uint16_t n, uint8_t imm)
 {
-    if (op != Op::LINENO && op != Op::JF && op != Op::JT && op != Op::JMP) {
-        emitLineNumber();
-    }
+    emitLineNumber();
     
-    Vector<uint8_t>* vec;
+    ArenaVector<uint8_t>* vec;
     if (_deferred) {
         assert(_deferredCodeBlocks.size() > 0);
         vec = &_deferredCode;
@@ -146,7 +181,7 @@ void Parser::addCode(Op op, RegOrConst reg0, RegOrConst reg1, RegOrConst reg2, u
         op = Op::RETI;
         vec->push_back(static_cast<uint8_t>(op) | n << 6);
     } else {
-        vec->push_back(static_cast<uint8_t>(op));
+        vec->push_back(byteFromOp(op, imm));
     }
     
     RegOrConst regs[4] = { reg0, reg1, reg2 };
@@ -182,12 +217,36 @@ void Parser::addCode(Op op, RegOrConst reg0, RegOrConst reg1, RegOrConst reg2, u
     if (OpInfo::params(op)) {
         vec->push_back(static_cast<uint8_t>(n));
     }
+}
 
-    if (op == Op::JF || op == Op::JT || op == Op::JMP) {
-        emitLineNumber();
+void Parser::emitLineNumber()
+{
+    uint32_t lineno = _scanner.lineno();
+    if (static_cast<int32_t>(lineno) == _emittedLineNumber) {
+        return;
+    }
+    _emittedLineNumber = lineno;
+    
+    ArenaVector<LineNumber>& lineNumbers = _deferred ? _deferredLineNumbers : _functions.back()._lineNumbers;
+    int32_t addr = static_cast<int32_t>(_deferred ? _deferredCode.size() : currentCode().size());
+    if (!lineNumbers.empty() && lineNumbers.back().addr == addr) {
+        lineNumbers.back().lineno = lineno;
+    } else {
+        lineNumbers.push_back({ addr, lineno });
     }
 }
 
+void Parser::truncateCode(int32_t addr)
+{
+    ArenaVector<uint8_t>& code = _deferred ? _deferredCode : currentCode();
+    ArenaVector<LineNumber>& lineNumbers = _deferred ? _deferredLineNumbers : _functions.back()._lineNumbers;
+    code.resize(addr);
+    while (!lineNumbers.empty() && lineNumbers.back().addr >= addr) {
+        lineNumbers.pop_back();
+    }
+    _emittedLineNumber = -1;
+}
+
 Parser::RegOrConst Parser::addConstant(const Value& v)
 {
     if (currentConstants().size() >= std::numeric_limits<uint8_t>::max()) {
@@ -216,14 +275,15 @@ Parser::RegOrConst Parser::addConstant(const Value& v)
         default: break;
     }
     
-    for (ConstantId::value_type id = 0; id < currentConstants().size(); ++id) {
-        if (currentConstants()[id] == v) {
-            return RegOrConst(ConstantId(id + builtinConstantOffset()));
-        }
+    ArenaVector<Value>& constants = currentConstants();
+    int32_t index = _functions.back()._constantIndex.find(v.hash(), [&constants, &v](uint32_t i) { return constants[i] == v; });
+    if (index >= 0) {
+        return RegOrConst(ConstantId(static_cast<ConstantId::value_type>(index + builtinConstantOffset())));
     }
     
-    ConstantId r(static_cast<ConstantId::value_type>(currentConstants().size() + builtinConstantOffset()));
-    currentConstants().push_back(v);
+    ConstantId r(static_cast<ConstantId::value_type>(constants.size() + builtinConstantOffset()));
+    _functions.back()._constantIndex.add(v.hash(), static_cast<uint16_t>(constants.size()));
+    constants.push_back(v);
     return RegOrConst(r);
 }
 
@@ -245,8 +305,16 @@ void Parser::addNamedFunction(Mad<Function> func, const Atom& name)
 {
     if (nerrors()) return;
 
-    addConstant(Value(func));
+    RegOrConst r = addConstant(Value(func));
     func->setName(name);
+    if (nerrors()) return;
+    
+    // Only the first function of a name is found, as with a search of the constants
+    int32_t index = r.index() - (MaxRegister + 1) - builtinConstantOffset();
+    FunctionEntry& entry = _functions.back();
+    if (entry._functionIndex.find(name.raw(), [&entry, &name](uint32_t i) { return entry._constants[i].asObject()->name() == name; }) < 0) {
+        entry._functionIndex.add(name.raw(), static_cast<uint16_t>(index));
+    }
 }
 
 void Parser::pushThis()
@@ -274,14 +342,11 @@ void Parser::emitId(const Atom& atom, IdType type)
     
     if (type == IdType::MightBeLocal || type == IdType::MustBeLocal) {
         // See if it's a local function
-        for (uint32_t i = 0; i < currentConstants().size(); ++i) {
-            Mad<Object> func = currentConstants().at(ConstantId(i).raw()).asObject();
-            if (func.valid()) {
-                if (func->name() == atom) {
-                    _parseStack.pushConstant(RegOrConst(ConstantId(i + builtinConstantOffset())));
-                    return;
-                }
-            }
+        const FunctionEntry& entry = _functions.back();
+        int32_t index = entry._functionIndex.find(atom.raw(), [&entry, &atom](uint32_t i) { return entry._constants[i].asObject()->name() == atom; });
+        if (index >= 0) {
+            _parseStack.pushConstant(RegOrConst(ConstantId(static_cast<ConstantId::value_type>(index + builtinConstantOffset()))));
+            return;
         }
         
         // Find the id in the function chain
@@ -291,6 +356,7 @@ void Parser::emitId(const Atom& atom, IdType type)
             int32_t index = _functions[i].localIndex(atom);
             
             if (index >= 0) {
+                countIteratorUse(i, RegOrConst(static_cast<uint32_t>(index)), false);
                 if (local) {
                     _parseStack.push(ParseStack::Type::Local, RegOrConst(static_cast<uint32_t>(index)));
                     return;
@@ -343,18 +409,32 @@ void Parser::emitMove()
         case ParseStack::Type::PropRef:
         case ParseStack::Type::EltRef: {
             if (_parseStack.topIsValue()) {
+                RegOrConst collection;
+                if (dstType == ParseStack::Type::PropRef && findIteration(_parseStack.topReg(), collection)) {
+                    // TOS is the value of a native for-in iterator. Push the source and
+                    // emit ITERNEXT with SetValue, the equivalent of setValue(src).
+                    // Leave the source on the stack as the result
+                    RegOrConst iterator = _parseStack.topReg();
+                    _parseStack.pop();
+                    emitCode(Op::PUSH, srcReg);
+                    emitCode(Op::ITERNEXT, iterator, collection, static_cast<uint8_t>(IterOp::SetValue));
+                    emitPop();
+                    discardResult();
+                    return;
+                }
+                
+
                 // Currently TOS is a PropRef and TOS-1 is the source. We need to convert the
-                // PropRef into a simple register, then swap it back to its original position,
-                // then push a "setValue" atom, the swap again. Then we will have:
-                // TOS=>src, Atom(setValue), dst. Now we need to generate the equivalent of:
+                // PropRef into a simple register, push the source and then push a "setValue"
+                // atom. Then we will have TOS=>Atom(setValue), dst, src. Now we need to generate
+                // the equivalent of:
                 //
-                //      dst.setValue(src
+                //      dst.setValue(src)
                 //
+                // The source is left on the stack as the result
                 _parseStack.propRefToReg();
-                _parseStack.swap();
+                emitCode(Op::PUSH, srcReg);
                 emitId(SAtom(SA::setValue), IdType::NotLocal);
-                _parseStack.swap();
-                emitPush();
                 RegOrConst objReg = emitDeref(DerefType::Prop);
                 emitCallRet(Op::CALL, objReg, 1);
                 discardResult();
@@ -389,6 +469,9 @@ Parser::RegOrConst Parser::emitDeref(DerefType type)
     bool isValue = _parseStack.topIsValue();
     RegOrConst derefReg = _parseStack.bake();
     _parseStack.swap();
+    if (isValue && type == DerefType::Prop && _parseStack.topType() == ParseStack::Type::Local) {
+        countIteratorUse(static_cast<uint32_t>(_functions.size() - 1), _parseStack.topReg(), true);
+    }
     RegOrConst objectReg = _parseStack.bake();
     _parseStack.swap();
     _parseStack.pop();
@@ -490,6 +573,159 @@ void Parser::emitCaseTest()
     emitCode(Op::EQ, dst, leftReg, rightReg);
 }
 
+int32_t Parser::startSwitch()
+{
+    if (nerrors()) return 0;
+    
+    // Bake now so the code for the switch value is not part of the case tests
+    _parseStack.bake();
+    return static_cast<int32_t>(_deferred ? _deferredCode.size() : currentCode().size());
+}
+
+bool Parser::topConstantValue(Value& value)
+{
+    if (nerrors() || _parseStack.topType() != ParseStack::Type::Constant) {
+        return false;
+    }
+    
+    RegOrConst r = _parseStack.topReg();
+    if (r.isShortAtom() || r.isLongAtom()) {
+        value = Value(r.atom());
+        return true;
+    }
+    
+    if (Function::builtinConstant(r.index(), value)) {
+        return true;
+    }
+    
+    value = currentConstants()[r.index() - (MaxRegister + 1) - builtinConstantOffset()];
+    return true;
+}
+
+int32_t Parser::emitSwitch(int32_t caseTestAddr, const Vector<Value>& caseValues)
+{
+    if (nerrors() || caseValues.size() < MinSwitchTableCases) {
+        return -1;
+    }
+    
+    SwitchTable table;
+    if (!table.init(caseValues, _program.get())) {
+        return -1;
+    }
+    
+    // Throw away the case tests and replace them with a SWITCH
+    truncateCode(caseTestAddr);
+
+    int32_t switchAddr = static_cast<int32_t>((_deferred ? _deferredCode : currentCode()).size());
+    uint16_t tableIndex = static_cast<uint16_t>(_functions.back()._switchTables.size());
+    _functions.back()._switchTables.push_back(table);
+    emitCode(Op::SWITCH, _parseStack.topReg(), static_cast<int16_t>(tableIndex));
+    return switchAddr;
+}
+
+void Parser::matchSwitch(int32_t switchAddr, const Vector<Value>& caseValues, const Vector<int32_t>& caseAddrs, int32_t defaultAddr)
+{
+    if (nerrors()) return;
+    
+    assert(caseValues.size() == caseAddrs.size());
+    
+    const uint8_t* code = &((_deferred ? _deferredCode : currentCode())[switchAddr]);
+    Op op = opFromCode(code);
+    assert(op == Op::SWITCH);
+    (void) op;
+    code += constantSize(byteFromCode(code));
+    SwitchTable& table = _functions.back()._switchTables[uNFromCode(code)];
+
+    for (uint32_t i = 0; i < caseValues.size(); ++i) {
+        int32_t offset = caseAddrs[i] - switchAddr;
+        if (offset < -MaxJump || offset > MaxJump) {
+            recordError("JUMP ADDRESS TOO BIG TO EXIT LOOP. CODE WILL NOT WORK!\n");
+            return;
+        }
+        table.setTarget(caseValues[i], static_cast<int16_t>(offset), _program.get());
+    }
+    
+    table.setDefaultTarget(static_cast<int16_t>(defaultAddr - switchAddr));
+}
+
+bool Parser::startIteration()
+{
+    if (nerrors()) return false;
+    
+    // TOS is the collection and TOS-1 is the iterator. The iterator register
+    // holds the cursor, so it must be a local
+    _parseStack.swap();
+    bool isLocal = _parseStack.topType() == ParseStack::Type::Local;
+    RegOrConst iterator = _parseStack.topReg();
+    _parseStack.swap();
+    
+    if (!isLocal) {
+        return false;
+    }
+    
+    // Keep the collection in its own register for the life of the loop
+    RegOrConst collection = _parseStack.bake();
+    if (_parseStack.topType() != ParseStack::Type::Register) {
+        _parseStack.pop();
+        RegOrConst r = _parseStack.pushRegister();
+        emitCode(Op::MOVE, r, collection);
+        collection = r;
+    }
+    
+    int32_t initAddr = static_cast<int32_t>(_deferred ? _deferredCode.size() : currentCode().size());
+    emitCode(Op::ITERINIT, collection);
+    emitCode(Op::POP, iterator);
+    _functions.back()._iterations.push_back({ iterator, collection, initAddr, 0, 0 });
+    return true;
+}
+
+void Parser::emitIterNext(IterOp iterOp)
+{
+    if (nerrors()) return;
+    
+    const Iteration& iteration = _functions.back()._iterations.back();
+    emitCode(Op::ITERNEXT, iteration._iterator, iteration._collection, static_cast<uint8_t>(iterOp));
+    emitPop();
+}
+
+void Parser::endIteration()
+{
+    if (nerrors()) return;
+    
+    // If the iterator was used as anything but 'iterator.value' it has to be
+    // an Iterator object, so make ITERINIT always create one
+    const Iteration& iteration = _functions.back()._iterations.back();
+    if (iteration._uses != iteration._valueUses) {
+        uint8_t& opByte = (_deferred ? _deferredCode : currentCode())[iteration._initAddr];
+        assert(opFromByte(opByte) == Op::ITERINIT);
+        opByte = byteFromOp(Op::ITERINIT, 1);
+    }
+    
+    _functions.back()._iterations.pop_back();
+    _parseStack.pop();
+    _parseStack.pop();
+}
+
+void Parser::countIteratorUse(uint32_t function, RegOrConst local, bool isValue)
+{
+    for (auto& it : _functions[function]._iterations) {
+        if (it._iterator == local) {
+            ++(isValue ? it._valueUses : it._uses);
+        }
+    }
+}
+
+bool Parser::findIteration(RegOrConst iterator, RegOrConst& collection) const
+{
+    for (auto it : _functions.back()._iterations) {
+        if (it._iterator == iterator) {
+            collection = it._collection;
+            return true;
+        }
+    }
+    return false;
+}
+
 void Parser::emitUnOp(Op op)
 {
     if (nerrors()) return;
@@ -511,6 +747,104 @@ void Parser::emitUnOp(Op op)
     emitCode(op, dst, srcReg);
 }
 
+// Return the register or plain constant in an operand byte, or false if it is
+// a temp register or needs more bytes
+static bool localOrConstantFromCode(const uint8_t*& code, uint32_t numLocals, uint8_t& reg)
+{
+    reg = byteFromCode(code);
+    return (reg <= MaxRegister) ? (reg < numLocals) : (constantSize(reg) == 0);
+}
+
+bool Parser::startForLoop(const Label& condLabel, ForLoop& forLoop)
+{
+    if (nerrors()) return false;
+    
+    uint32_t numLocals = static_cast<uint32_t>(_functions.back()._locals.size());
+    uint8_t ra, rb, rc;
+    
+    if (_deferredCode.size() <= _deferredCodeBlocks.back() || currentCode().size() <= static_cast<size_t>(condLabel.label)) {
+        return false;
+    }
+    
+    // The cond must be '<local> <op> <local or constant>' followed by the JF
+    const uint8_t* code = &(currentCode()[condLabel.label]);
+    const uint8_t* end = &(currentCode()[0]) + currentCode().size();
+    Op op = opFromByte(*code++);
+    switch (op) {
+        case Op::LT: forLoop.test = ForTest::LT; break;
+        case Op::LE: forLoop.test = ForTest::LE; break;
+        case Op::GT: forLoop.test = ForTest::GT; break;
+        case Op::GE: forLoop.test = ForTest::GE; break;
+        default: return false;
+    }
+    
+    ra = byteFromCode(code);
+    if (!localOrConstantFromCode(code, numLocals, rb) || rb > MaxRegister || !localOrConstantFromCode(code, numLocals, rc)) {
+        return false;
+    }
+    if (opFromByte(*code++) != Op::JF || byteFromCode(code) != ra) {
+        return false;
+    }
+    code += 2;
+    if (code != end) {
+        return false;
+    }
+    
+    // The iterator must be a pre or post increment or decrement of the same local
+    code = &(_deferredCode[_deferredCodeBlocks.back()]);
+    end = &(_deferredCode[0]) + _deferredCode.size();
+    op = opFromByte(*code++);
+    if (op != Op::PREINC && op != Op::POSTINC && op != Op::PREDEC && op != Op::POSTDEC) {
+        return false;
+    }
+    code++;
+    if (byteFromCode(code) != rb) {
+        return false;
+    }
+    
+    // Assigning the result back to the local leaves a MOVE of it to itself
+    if (code < end && opFromByte(*code) == Op::MOVE && code[1] == rb && code[2] == rb) {
+        code += OpInfo::size(Op::MOVE) + 1;
+    }
+    if (code != end) {
+        return false;
+    }
+
+    forLoop.index = RegOrConst(rb);
+    forLoop.end = (rc <= MaxRegister) ? RegOrConst(rc) : RegOrConst(ConstantId(rc - MaxRegister - 1));
+    forLoop.step = addConstant(Value((op == Op::PREINC || op == Op::POSTINC) ? 1 : -1));
+    
+    // Throw away the cond, JF and iterator and replace them with a FORPREP, whose
+    // exit address is filled in by endForLoop()
+    discardDeferred();
+    truncateCode(condLabel.label);
+    
+    forLoop.prepAddr = static_cast<int32_t>(currentCode().size());
+    addCode(Op::FORPREP, forLoop.index, forLoop.end, RegOrConst(), 0, static_cast<uint8_t>(forLoop.test));
+    forLoop.bodyAddr = static_cast<int32_t>(currentCode().size());
+    return true;
+}
+
+void Parser::endForLoop(const ForLoop& forLoop)
+{
+    if (nerrors()) return;
+    
+    int32_t loopAddr = static_cast<int32_t>(currentCode().size());
+    int32_t jumpAddr = forLoop.bodyAddr - loopAddr;
+    int32_t exitAddr = loopAddr + OpInfo::size(Op::FORLOOP) + 1 - forLoop.prepAddr;
+    if (jumpAddr < -MaxJump || exitAddr > MaxJump) {
+        recordError("JUMP ADDRESS TOO BIG TO EXIT LOOP. CODE WILL NOT WORK!\n");
+        return;
+    }
+    
+    addCode(Op::FORLOOP, forLoop.index, forLoop.end, forLoop.step, static_cast<uint16_t>(jumpAddr), static_cast<uint8_t>(forLoop.test));
+    assert(opFromByte(currentCode()[loopAddr]) == Op::FORLOOP);
+    
+    uint8_t* code = &(currentCode()[forLoop.prepAddr + OpInfo::size(Op::FORPREP) - 1]);
+    code[0] = static_cast<uint8_t>(exitAddr >> 8);
+    code[1] = static_cast<uint8_t>(exitAddr);
+}
+
 void Parser::emitLoadLit(bool array)
 {
     if (nerrors()) return;
@@ -575,6 +909,10 @@ void Parser::emitCallRet(Op op, RegOrConst thisReg, uint8_t nparams)
         calleeReg = _parseStack.bake();
         _parseStack.pop();
     } else {
+        if (nparams == 1) {
+            markTailCall();
+        }
+        
         // If there is a return value, push it onto the runtime stack
         for (uint8_t i = 0; i < nparams; ++i) {
             emitPush();
@@ -586,7 +924,13 @@ void Parser::emitCallRet(Op op, RegOrConst thisReg, uint8_t nparams)
     } else if (op == Op::NEW) {
         emitCode(op, calleeReg, nparams);
     } else {
+        if (!_deferred) {
+            _functions.back()._lastCallAddr = static_cast<int32_t>(currentCode().size());
+        }
         emitCode(op, calleeReg, thisReg, nparams);
+        if (!_deferred) {
+            _functions.back()._lastCallEnd = static_cast<int32_t>(currentCode().size());
+        }
     }
     
     if (op == Op::CALL || op == Op::NEW) {
@@ -595,22 +939,81 @@ void Parser::emitCallRet(Op op, RegOrConst thisReg, uint8_t nparams)
     }
 }
 
+void Parser::markTailCall()
+{
+    // If the value being returned was just popped from a CALL, change the CALL
+    // to a TAILCALL. The top level program and ctors always use CALL. The
+    // program has no caller to return to and ctors need the NEW to complete.
+    FunctionEntry& entry = _functions.back();
+    if (_deferred || _functions.size() < 2 || entry._ctor || entry._lastCallAddr < 0) {
+        return;
+    }
+    
+    ArenaVector<uint8_t>& code = currentCode();
+    int32_t popAddr = entry._lastCallEnd;
+    if (static_cast<int32_t>(code.size()) != popAddr + 2 || opFromByte(code[popAddr]) != Op::POP) {
+        return;
+    }
+    if (opFromByte(code[entry._lastCallAddr]) != Op::CALL) {
+        return;
+    }
+    
+    RegOrConst reg = _parseStack.topReg();
+    if (_parseStack.topType() != ParseStack::Type::Register || !reg.isReg() || reg.index() != code[popAddr + 1]) {
+        return;
+    }
+    
+    code[entry._lastCallAddr] = byteFromOp(Op::TAILCALL);
+}
+
 int32_t Parser::emitDeferred()
 {
     if (nerrors()) return 0;
     
+    CompileStats::Scope statsScope(CompileStats::Phase::Emit);
     assert(!_deferred);
     assert(_deferredCodeBlocks.size() > 0);
     int32_t start = static_cast<int32_t>(currentCode().size());
+    int32_t blockStart = static_cast<int32_t>(_deferredCodeBlocks.back());
     
     for (size_t i = _deferredCodeBlocks.back(); i < _deferredCode.size(); ++i) {
         currentCode().push_back(_deferredCode[i]);
     }
+    
+    // Move the line numbers for the block to their new addresses
+    ArenaVector<LineNumber>& lineNumbers = _functions.back()._lineNumbers;
+    size_t firstLineNumber = _deferredLineNumbers.size();
+    while (firstLineNumber > 0 && _deferredLineNumbers[firstLineNumber - 1].addr >= blockStart) {
+        --firstLineNumber;
+    }
+    for (size_t i = firstLineNumber; i < _deferredLineNumbers.size(); ++i) {
+        int32_t addr = _deferredLineNumbers[i].addr - blockStart + start;
+        if (!lineNumbers.empty() && lineNumbers.back().addr == addr) {
+            lineNumbers.back().lineno = _deferredLineNumbers[i].lineno;
+        } else {
+            lineNumbers.push_back({ addr, _deferredLineNumbers[i].lineno });
+        }
+    }
+    _deferredLineNumbers.resize(firstLineNumber);
+    _emittedLineNumber = -1;
+
     _deferredCode.resize(_deferredCodeBlocks.back());
     _deferredCodeBlocks.pop_back();
     return start;
 }
 
+void Parser::discardDeferred()
+{
+    assert(!_deferred);
+    assert(_deferredCodeBlocks.size() > 0);
+    int32_t blockStart = static_cast<int32_t>(_deferredCodeBlocks.back());
+    while (!_deferredLineNumbers.empty() && _deferredLineNumbers.back().addr >= blockStart) {
+        _deferredLineNumbers.pop_back();
+    }
+    _deferredCode.resize(_deferredCodeBlocks.back());
+    _deferredCodeBlocks.pop_back();
+}
+
 void Parser::discardResult()
 {
     _parseStack.pop();
@@ -633,7 +1036,8 @@ void Parser::functionStart(bool ctor)
     if (nerrors()) return;
     
     Mad<Function> func = Object::create<Function>();
-    _functions.emplace_back(func, ctor);
+    _functions.emplace_back(&_functionArena, func, ctor);
+    _emittedLineNumber = -1;
 }
 
 void Parser::functionParamsEnd()
@@ -664,11 +1068,26 @@ Mad<Function> Parser::functionEnd()
         
     // Place the current code and constants in this function
     Mad<Function> function = currentFunction();
-    function->setCode(currentCode());
-    function->setConstants(currentConstants());
+    function->setCode(currentCode().data(), static_cast<uint32_t>(currentCode().size()));
+    function->setConstants(currentConstants().data(), static_cast<uint32_t>(currentConstants().size()));
+    function->setSwitchTables(_functions.back()._switchTables);
     function->setLocalCount(_functions.back()._locals.size() + tempRegisterCount);
     
+    LineTable lineTable;
+    for (auto it : _functions.back()._lineNumbers) {
+        lineTable.add(it.addr, it.lineno);
+    }
+    function->setLineTable(lineTable);
+    CompileStats::function();
+    
+    // Nothing outside this function was allocated in the function arena
+    // since it started, so all of that can go. Blocks it reused from before
+    // then go back on the free list
+    _functions.back().discard();
+    ParseArena::Mark mark = _functions.back()._arenaMark;
     _functions.pop_back();
+    _functionArena.rewind(mark);
+    _emittedLineNumber = -1;
 
     return function;
 }
@@ -680,6 +1099,7 @@ static inline uint32_t regFromTempReg(uint32_t reg, uint32_t numLocals)
 
 void Parser::reconcileRegisters(uint16_t localCount)
 {
+    CompileStats::Scope statsScope(CompileStats::Phase::Emit);
     assert(currentCode().size());
     
     uint8_t* code = &(currentCode()[0]);
@@ -707,7 +1127,11 @@ void Parser::reconcileRegisters(uint16_t localCount)
         }
         if (OpInfo::dReg(op)) {
             assert(*p <= MaxRegister);
-            *p = regFromTempReg(*p, localCount);
+            
+            // The U[s] of LOADUP is an index into the UpValues, not a register
+            if (op != Op::LOADUP) {
+                *p = regFromTempReg(*p, localCount);
+            }
             p += constantSize(*p) + 1;
         }
         if (OpInfo::params(op)) {
@@ -722,7 +1146,7 @@ void Parser::reconcileRegisters(uint16_t localCount)
 void Parser::ParseStack::push(ParseStack::Type type, RegOrConst reg)
 {
     assert(type != Type::Register);
-    _stack.push({ type, reg });
+    _stack.push_back({ type, reg });
 }
 
 Parser::RegOrConst Parser::ParseStack::pushRegister()
@@ -732,7 +1156,7 @@ Parser::RegOrConst Parser::ParseStack::pushRegister()
     if (reg < entry._minReg) {
         entry._minReg = reg;
     }
-    _stack.push({ Type::Register, RegOrConst(reg) });
+    _stack.push_back({ Type::Register, RegOrConst(reg) });
     return RegOrConst(reg);
 }
 
@@ -741,29 +1165,38 @@ void Parser::ParseStack::pop()
     if (empty()) {
         return;
     }
-    if (_stack.top()._type == Type::Register) {
+    if (_stack.back()._type == Type::Register) {
         assert(_parser->_functions.back()._nextReg < MaxRegister);
         _parser->_functions.back()._nextReg++;
     }
-    _stack.pop();
+    _stack.pop_back();
 }
 
 void Parser::ParseStack::swap()
 {
     assert(_stack.size() >= 2);
-    Entry t = _stack.top();
-    _stack.top() = _stack.top(-1);
-    _stack.top(-1) = t;
+    Entry t = _stack.back();
+    _stack.back() = _stack[_stack.size() - 2];
+    _stack[_stack.size() - 2] = t;
 }
 
 Parser::RegOrConst Parser::ParseStack::bake(bool makeClosure)
 {
-    Entry entry = _stack.top();
+    Entry entry = _stack.back();
     
     switch(entry._type) {
         case Type::PropRef:
         case Type::EltRef: {
             if (entry._isValue) {
+                RegOrConst collection;
+                if (entry._type == Type::PropRef && _parser->findIteration(entry._reg, collection)) {
+                    // This is the value of a native for-in iterator
+                    pop();
+                    _parser->emitCode(Op::ITERNEXT, entry._reg, collection, static_cast<uint8_t>(IterOp::GetValue));
+                    _parser->emitPop();
+                    return _stack.back()._reg;
+                }
+                
                 // Currently TOS is a PropRef and TOS-1 is the source. We need to convert the
                 // PropRef into a simple register, then swap it back to its original position,
                 // then push a "setValue" atom, the swap again. Then we will have:
@@ -775,7 +1208,7 @@ Parser::RegOrConst Parser::ParseStack::bake(bool makeClosure)
                 _parser->emitId(SAtom(SA::getValue), Parser::IdType::NotLocal);
                 RegOrConst objectReg = _parser->emitDeref(Parser::DerefType::Prop);
                 _parser->emitCallRet(Op::CALL, objectReg, 0);
-                return _stack.top()._reg;
+                return _stack.back()._reg;
             } else {
                 pop();
                 RegOrConst r = pushRegister();
@@ -842,13 +1275,13 @@ Parser::RegOrConst Parser::ParseStack::bake(bool makeClosure)
 
 void Parser::ParseStack::replaceTop(Type type, RegOrConst reg, RegOrConst derefReg)
 {
-    _stack.setTop({ type, reg, derefReg });
+    _stack.back() = { type, reg, derefReg };
 }
 
 void Parser::ParseStack::propRefToReg()
 {
-    assert(_stack.top()._type == Type::PropRef);
-    RegOrConst r = _stack.top()._reg;
+    assert(_stack.back()._type == Type::PropRef);
+    RegOrConst r = _stack.back()._reg;
     Type type = r.isReg() ? ((r.index() < _parser->_functions.back()._minReg) ? Type::Local : Type::Register) : Type::Register;
     replaceTop(type, r, RegOrConst());
 }
@@ -10,6 +10,8 @@
 #pragma once
 
 #include "ExecutionUnit.h"
+#include "OpenAddressing.h"
+#include "ParseArena.h"
 #include "Scanner.h"
 #include "SystemInterface.h"
 
@@ -55,6 +57,9 @@ public:
     void endString() { _program->endStringLiteral(); }
     
 private:
+    // Fewer cases than this are faster as a chain of EQ/JT
+    static constexpr uint32_t MinSwitchTableCases = 3;
+    
     class RegOrConst
     {
     public:
@@ -72,7 +77,7 @@ private:
         bool isLongAtom() const { return !isReg() && static_cast<BuiltinConstants>(_reg) == BuiltinConstants::AtomLong; }
         m8r::Atom atom() const { return _atom; }
 
-        void push(m8r::Vector<uint8_t>* vec)
+        void push(ArenaVector<uint8_t>* vec)
         {
             vec->push_back(index());
             if (isShortAtom()) {
@@ -136,6 +141,7 @@ private:
     {
         assert(!_deferred);
         _deferred = true;
+        _emittedLineNumber = -1;
         _deferredCodeBlocks.push_back(_deferredCode.size());
         return static_cast<int32_t>(_deferredCode.size());
     }
@@ -144,11 +150,13 @@ private:
     {
         assert(!_deferred);
         _deferred = true;
+        _emittedLineNumber = -1;
         return static_cast<int32_t>(_deferredCode.size());
     }
     
-    void endDeferred() { assert(_deferred); _deferred = false; }
+    void endDeferred() { assert(_deferred); _deferred = false; _emittedLineNumber = -1; }
     int32_t emitDeferred();
+    void discardDeferred();
 
     void functionAddParam(const m8r::Atom& atom);
     void functionStart(bool ctor);
@@ -156,8 +164,8 @@ private:
     bool functionIsCtor() const { return _functions.back()._ctor; }
     m8r::Mad<Function> functionEnd();
     m8r::Mad<Function> currentFunction() const { assert(_functions.size()); return _functions.back()._function; }
-    m8r::Vector<uint8_t>& currentCode() { assert(_functions.size()); return _functions.back()._code; }
-    m8r::Vector<Value>& currentConstants() { assert(_functions.size()); return _functions.back()._constants; }
+    ArenaVector<uint8_t>& currentCode() { assert(_functions.size()); return _functions.back()._code; }
+    ArenaVector<Value>& currentConstants() { assert(_functions.size()); return _functions.back()._constants; }
 
     void classStart() { _classes.push_back(Object::create<MaterObject>()); }
     void classEnd() { pushK(Value(static_cast<m8r::Mad<Object>>(_classes.back()))); _classes.pop_back(); }
@@ -185,25 +193,61 @@ private:
     void emitUnOp(Op op);
     void emitBinOp(Op op);
     void emitCaseTest();
+    
+    // Switch statement support. startSwitch() bakes the switch value and
+    // returns the address where the case tests start. If all the case values
+    // can go in a SwitchTable, emitSwitch() replaces the case tests with a
+    // SWITCH instruction and returns its address, or -1 otherwise.
+    // matchSwitch() fills in the table once the case statements are placed.
+    int32_t startSwitch();
+    bool topConstantValue(Value&);
+    int32_t emitSwitch(int32_t caseTestAddr, const m8r::Vector<Value>& caseValues);
+    void matchSwitch(int32_t switchAddr, const m8r::Vector<Value>& caseValues, const m8r::Vector<int32_t>& caseAddrs, int32_t defaultAddr);
+
+    
+    // Native for-in support. If the iterator on the parse stack is a local,
+    // startIteration() emits ITERINIT, leaving the iterator and collection
+    // on the parse stack until endIteration(). Inside the loop, 'iterator.value'
+    // is done with ITERNEXT rather than calls to getValue() and setValue().
+    // The iterator only holds an integer cursor if the body uses it for nothing
+    // but 'iterator.value'. Otherwise endIteration() changes the ITERINIT so it
+    // makes an Iterator object, which ITERNEXT then calls.
+    bool startIteration();
+    void emitIterNext(IterOp);
+    void endIteration();
+    bool findIteration(RegOrConst iterator, RegOrConst& collection) const;
+    void countIteratorUse(uint32_t function, RegOrConst local, bool isValue);
+    
+    // Counted for loop support. If the cond expression starting at condLabel
+    // compares a local against a local or constant and the deferred iterator
+    // expression increments or decrements that same local, startForLoop()
+    // replaces both with a FORPREP and returns true. endForLoop() emits the
+    // matching FORLOOP at the bottom of the loop.
+    struct ForLoop {
+        RegOrConst index;
+        RegOrConst end;
+        RegOrConst step;
+        ForTest test = ForTest::LT;
+        int32_t prepAddr = 0;
+        int32_t bodyAddr = 0;
+    };
+    
+    bool startForLoop(const Label& condLabel, ForLoop&);
+    void endForLoop(const ForLoop&);
+    
     void emitLoadLit(bool array);
     void emitPush();
     void emitPop();
     void emitEnd();
     
-    void emitLineNumber()
-    {
-        if (_debug == Debug::None) {
-            return;
-        }
-        uint16_t lineno = _scanner.lineno();
-        if (lineno == _emittedLineNumber) {
-            return;
-        }
-        _emittedLineNumber = lineno;
-        emitCode(Op::LINENO, lineno);
-    }
+    // Line numbers go in a table for each function rather than in the code.
+    // emitLineNumber() adds an entry when the line changes. Entries for
+    // deferred code are kept separately until the code is emitted.
+    void emitLineNumber();
+    void truncateCode(int32_t addr);
     
     void emitCallRet(Op value, RegOrConst thisReg, uint8_t params);
+    void markTailCall();
     void addVar(const m8r::Atom& name) { _functions.back().addLocal(name); }
     
     void discardResult();
@@ -213,7 +257,7 @@ private:
     RegOrConst addConstant(const Value& v);
 
     
-    void addCode(Op, RegOrConst, RegOrConst, RegOrConst, uint16_t n);
+    void addCode(Op, RegOrConst, RegOrConst, RegOrConst, uint16_t n, uint8_t imm = 0);
     
     void emitCode(Op op, RegOrConst ra, RegOrConst rb, RegOrConst rc)   { addCode(op, ra, rb, rc, 0); }
     void emitCode(Op op, RegOrConst ra, RegOrConst rb, uint8_t nparams) { addCode(op, ra, rb, RegOrConst(), nparams); }
@@ -232,29 +276,30 @@ private:
     public:
         enum class Type { Unknown, Local, Constant, Register, RefK, PropRef, EltRef, This, UpValue };
         
-        ParseStack(Parser* parser) : _parser(parser) { }
+        ParseStack(Parser* parser) : _stack(&parser->_arena), _parser(parser) { }
         
         void push(Type, RegOrConst reg);
         RegOrConst pushRegister();
         void pushConstant(RegOrConst reg) { assert(!reg.isReg()); push(Type::Constant, reg); }
-        void setIsValue(bool b) { _stack.top()._isValue = b; }
+        void setIsValue(bool b) { _stack.back()._isValue = b; }
 
         void pop();
         void swap();
         
-        Type topType() const { return empty() ? Type::Unknown : _stack.top()._type; }
-        RegOrConst topReg() const { return empty() ? RegOrConst() : _stack.top()._reg; }
-        RegOrConst topDerefReg() const { return empty() ? RegOrConst() : _stack.top()._derefReg; }
-        bool topIsValue() const { return empty() ? false : _stack.top()._isValue; }
+        Type topType() const { return empty() ? Type::Unknown : _stack.back()._type; }
+        RegOrConst topReg() const { return empty() ? RegOrConst() : _stack.back()._reg; }
+        RegOrConst topDerefReg() const { return empty() ? RegOrConst() : _stack.back()._derefReg; }
+        bool topIsValue() const { return empty() ? false : _stack.back()._isValue; }
         bool empty() const { return _stack.empty(); }
         void clear() { _stack.clear(); }
+        void release() { _stack.release(); }
         
         RegOrConst bake(bool makeClosure = false);
-        bool needsBaking() const { return _stack.top()._type == Type::PropRef || _stack.top()._type == Type::EltRef || _stack.top()._type == Type::RefK; }
+        bool needsBaking() const { return _stack.back()._type == Type::PropRef || _stack.back()._type == Type::EltRef || _stack.back()._type == Type::RefK; }
         void replaceTop(Type, RegOrConst reg, RegOrConst derefReg);
         void dup() {
-            Entry entry = _stack.top();
-            _stack.push(entry);
+            Entry entry = _stack.back();
+            _stack.push_back(entry);
         }
         void propRefToReg();
         
@@ -276,42 +321,134 @@ private:
             bool _isValue = false;
         };
         
-        m8r::Stack<Entry> _stack;
+        ArenaVector<Entry> _stack;
         Parser* _parser;
     };
     
+    // Temporaries of the whole compile are in _arena. Those of a function are
+    // in _functionArena, which is rewound when the function ends. Both are
+    // released when parse() returns
+    ParseArena _arena;
+    ParseArena _functionArena;
+    
     ParseStack _parseStack;
 
+    struct LineNumber {
+        int32_t addr;
+        uint32_t lineno;
+    };
+    
+    struct Iteration {
+        RegOrConst _iterator;
+        RegOrConst _collection;
+        int32_t _initAddr;
+        
+        // Times the iterator is named in the body, and how many of those are 'iterator.value'
+        uint16_t _uses;
+        uint16_t _valueUses;
+    };
+    
+    // Finds entries of a Vector by hash, so adding a local or constant doesn't
+    // have to search all of them. It's an OpenAddressing table whose slots
+    // hold the hash and index + 1 of an entry, or 0 when empty. find() calls
+    // match with each index of the same hash, for the caller to compare with
+    // its own Vector.
+    class IndexTable {
+    public:
+        IndexTable() { }
+        explicit IndexTable(ParseArena* arena) : _slots(arena) { }
+        
+        template<typename Match>
+        int32_t find(uint32_t hash, Match match) const
+        {
+            const Slot* slot = OpenAddressing::find(_slots.data(), _slots.size(), OpenAddressing::mix(hash), [hash, &match](const Slot& slot) {
+                return slot._hash == hash && match(slot._index - 1);
+            });
+            return slot ? slot->_index - 1 : -1;
+        }
+        
+        void add(uint32_t hash, uint16_t index);
+        void discard() { _slots.discard(); _count = 0; }
+        
+    private:
+        static constexpr uint32_t MinSlots = 8;
+        
+        struct Slot {
+            explicit operator bool() const { return _index != 0; }
+            
+            uint32_t _hash = 0;
+            uint16_t _index = 0;
+        };
+        
+        ArenaVector<Slot> _slots;
+        uint32_t _count = 0;
+    };
+    
     struct FunctionEntry {
         FunctionEntry() { }
-        FunctionEntry(m8r::Mad<Function> function, bool ctor) : _function(function), _ctor(ctor) { }
-        m8r::Vector<uint8_t> _code;
-        m8r::Vector<Value> _constants;
-        m8r::Vector<m8r::Atom> _locals;
+        FunctionEntry(ParseArena* arena, m8r::Mad<Function> function, bool ctor)
+            : _code(arena)
+            , _constants(arena)
+            , _iterations(arena)
+            , _lineNumbers(arena)
+            , _locals(arena)
+            , _localIndex(arena)
+            , _constantIndex(arena)
+            , _functionIndex(arena)
+            , _arenaMark(arena->mark())
+            , _function(function)
+            , _ctor(ctor)
+        {
+        }
+        
+        void discard()
+        {
+            _code.discard();
+            _constants.discard();
+            _iterations.discard();
+            _lineNumbers.discard();
+            _locals.discard();
+            _localIndex.discard();
+            _constantIndex.discard();
+            _functionIndex.discard();
+        }
+        
+        ArenaVector<uint8_t> _code;
+        ArenaVector<Value> _constants;
+        m8r::Vector<SwitchTable> _switchTables;
+        ArenaVector<Iteration> _iterations;
+        ArenaVector<LineNumber> _lineNumbers;
+        ArenaVector<m8r::Atom> _locals;
+        IndexTable _localIndex;
+        IndexTable _constantIndex;
+        
+        // Constants which are named functions, by name
+        IndexTable _functionIndex;
+        
+        // Where the function arena was when this function started
+        ParseArena::Mark _arenaMark;
         m8r::Mad<Function> _function;
         uint8_t _nextReg = MaxRegister;
         uint8_t _minReg = MaxRegister + 1;
         bool _ctor = false;
+        
+        // Start and end of the last CALL, to find tail calls
+        int32_t _lastCallAddr = -1;
+        int32_t _lastCallEnd = -1;
 
         int16_t addLocal(const m8r::Atom& atom)
         {
-            for (auto name : _locals) {
-                if (name == atom) {
-                    return -1;
-                }
+            if (localIndex(atom) >= 0) {
+                return -1;
             }
             _locals.push_back(atom);
+            _localIndex.add(atom.raw(), static_cast<uint16_t>(_locals.size() - 1));
             return static_cast<int16_t>(_locals.size()) - 1;
         }
 
         int32_t localIndex(const m8r::Atom& name) const
         {
-            for (int16_t i = 0; i < static_cast<int16_t>(_locals.size()); ++i) {
-                if (_locals[i] == name) {
-                    return i;
-                }
-            }
-            return -1;
+            return _localIndex.find(name.raw(), [this, &name](uint32_t i) { return _locals[i] == name; });
         }
         
         void markParamEnd() { _function->setFormalParamCount(static_cast<uint16_t>(_locals.size())); }
@@ -326,8 +463,9 @@ private:
     m8r::Scanner _scanner;
     m8r::Mad<Program> _program;
     ExecutionUnit* _eu = nullptr;
-    m8r::Vector<size_t> _deferredCodeBlocks;
-    m8r::Vector<uint8_t> _deferredCode;
+    ArenaVector<size_t> _deferredCodeBlocks;
+    ArenaVector<LineNumber> _deferredLineNumbers;
+    ArenaVector<uint8_t> _deferredCode;
     bool _deferred = false;
     int32_t _emittedLineNumber = -1;
     Debug _debug;
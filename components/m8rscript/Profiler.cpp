@@ -0,0 +1,91 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "Profiler.h"
+
+#include "OpenAddressing.h"
+#include "Program.h"
+#include <algorithm>
+
+using namespace m8rscript;
+using namespace m8r;
+
+void Profiler::start(uint64_t now, uint32_t intervalUs)
+{
+    _intervalUs = intervalUs ? intervalUs : DefaultIntervalUs;
+    _nextSampleTime = now + _intervalUs;
+    _running = true;
+}
+
+void Profiler::clear()
+{
+    _frames.clear();
+    _stacks.clear();
+    _sampleCount = 0;
+}
+
+uint32_t Profiler::hash(const Frame* frames, uint32_t count)
+{
+    // Hash the name and line of each frame
+    uint32_t h = OpenAddressing::HashStart;
+    for (uint32_t i = 0; i < count; ++i) {
+        uint32_t v = (static_cast<uint32_t>(frames[i]._name.raw()) << 16) ^ (frames[i]._lineno << 1) ^ frames[i]._isProgram;
+        h = OpenAddressing::hashWord(h, v);
+    }
+    return h;
+}
+
+void Profiler::addSample(const Frame* frames, uint32_t count, uint32_t weight)
+{
+    _sampleCount++;
+
+    // There are rarely more than a few dozen distinct stacks, so a linear search
+    // comparing hashes first is fast enough at the sample rate
+    uint32_t h = hash(frames, count);
+    for (auto& stack : _stacks) {
+        if (stack._hash != h || stack._size != count) {
+            continue;
+        }
+        if (std::equal(frames, frames + count, &(_frames[stack._start]))) {
+            stack._count += weight;
+            return;
+        }
+    }
+
+    _stacks.push_back({ h, static_cast<uint32_t>(_frames.size()), count, weight });
+    for (uint32_t i = 0; i < count; ++i) {
+        _frames.push_back(frames[i]);
+    }
+}
+
+String Profiler::folded(const Program* program) const
+{
+    String s;
+    for (const auto& stack : _stacks) {
+        for (uint32_t i = stack._size; i > 0; --i) {
+            const Frame& frame = _frames[stack._start + i - 1];
+            if (i != stack._size) {
+                s += ";";
+            }
+            if (frame._isProgram) {
+                s += "<main>";
+            } else if (frame._name && program) {
+                s += program->stringFromAtom(frame._name);
+            } else {
+                s += "<anonymous>";
+            }
+            s += ":";
+            s += String(static_cast<uint32_t>(frame._lineno));
+        }
+        s += " ";
+        s += String(stack._count);
+        s += "\n";
+    }
+    return s;
+}
@@ -0,0 +1,99 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Atom.h"
+#include "Containers.h"
+
+namespace m8rscript {
+
+class Program;
+
+// Profiler - Sampling profiler for script code
+//
+// The ExecutionUnit takes a sample at most once per interval. It only looks at
+// the time when it checks its quantum at a safepoint, so a running profiler costs
+// nothing between samples. Each sample is the script call stack, outermost
+// frame first, with each frame reduced to its function name and line. Identical
+// stacks are kept once with a count, so memory only grows with the number of
+// distinct stacks, not with run time.
+//
+// Safepoints can be further apart than the interval, in a long native call or
+// a run of code without a backward jump or call. So a sample counts once for
+// each interval that has passed since the last one, and the counts stay
+// proportional to time.
+//
+// folded() returns one line per stack in the format read by flamegraph tools:
+//
+//      <main>:12;outer:30;inner:41 57
+//
+// Time spent in native functions is counted against the script line that called
+// them, since that is the next safepoint.
+class Profiler {
+public:
+    struct Frame {
+        bool operator==(const Frame& other) const
+        {
+            return _name == other._name && _lineno == other._lineno && _isProgram == other._isProgram;
+        }
+
+        m8r::Atom _name;
+        uint32_t _lineno : 31;
+        uint32_t _isProgram : 1;
+    };
+
+    static constexpr uint32_t DefaultIntervalUs = 1000;
+
+    // The first sample is due one interval after now
+    void start(uint64_t now, uint32_t intervalUs = DefaultIntervalUs);
+    void stop() { _running = false; }
+    void clear();
+
+    bool running() const { return _running; }
+    uint32_t sampleCount() const { return _sampleCount; }
+
+    // Called each time the quantum is checked. Returns the number of intervals
+    // the sample to take stands for, or 0 when no sample is due
+    uint32_t sampleDue(uint64_t now)
+    {
+        if (!_running || now < _nextSampleTime) {
+            return 0;
+        }
+        uint64_t weight = (now - _nextSampleTime) / _intervalUs + 1;
+        _nextSampleTime += weight * _intervalUs;
+        return static_cast<uint32_t>(weight);
+    }
+
+    // Frames are passed innermost first, as they are found walking the call records
+    void addSample(const Frame* frames, uint32_t count, uint32_t weight);
+
+    m8r::String folded(const Program*) const;
+
+private:
+    static uint32_t hash(const Frame* frames, uint32_t count);
+
+    struct Stack {
+        uint32_t _hash;
+        uint32_t _start;
+        uint32_t _size;
+        uint32_t _count;
+    };
+
+    // Stacks are stored innermost frame first, in one shared vector of frames
+    m8r::Vector<Frame> _frames;
+    m8r::Vector<Stack> _stacks;
+
+    uint64_t _nextSampleTime = 0;
+    uint32_t _intervalUs = DefaultIntervalUs;
+    uint32_t _sampleCount = 0;
+    bool _running = false;
+};
+
+}
@@ -0,0 +1,129 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "ProfilerProto.h"
+
+#include "CodePrinter.h"
+#include "ExecutionUnit.h"
+#include "OpcodeStats.h"
+
+using namespace m8rscript;
+using namespace m8r;
+
+static const StaticObject::StaticFunctionProperty _functionProps[] =
+{
+    { SA::annotatedCode, ProfilerProto::annotatedCode },
+    { SA::opcodeStats, ProfilerProto::opcodeStats },
+    { SA::result, ProfilerProto::result },
+    { SA::start, ProfilerProto::start },
+    { SA::stop, ProfilerProto::stop },
+    { SA::trackAllocations, ProfilerProto::trackAllocations },
+};
+
+ProfilerProto::ProfilerProto()
+{
+    setProperties(_functionProps, sizeof(_functionProps) / sizeof(StaticFunctionProperty));
+}
+
+CallReturnValue ProfilerProto::start(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
+{
+    if (nparams > 1) {
+        return CallReturnValue(Error::Code::WrongNumberOfParams);
+    }
+    
+    uint32_t intervalUs = Profiler::DefaultIntervalUs;
+    if (nparams == 1) {
+        float intervalMs = eu->stack().top().toFloatValue(eu);
+        if (intervalMs <= 0) {
+            return CallReturnValue(Error::Code::InvalidArgumentValue);
+        }
+        intervalUs = static_cast<uint32_t>(intervalMs * 1000);
+    }
+    
+    eu->startProfiling(intervalUs);
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 0);
+}
+
+CallReturnValue ProfilerProto::stop(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
+{
+    if (nparams != 0) {
+        return CallReturnValue(Error::Code::WrongNumberOfParams);
+    }
+    
+    eu->stopProfiling();
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 0);
+}
+
+CallReturnValue ProfilerProto::result(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
+{
+    if (nparams != 0) {
+        return CallReturnValue(Error::Code::WrongNumberOfParams);
+    }
+    
+    eu->stack().push(Value(ExecutionUnit::createString(eu->profiler().folded(eu->program().get()))));
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 1);
+}
+
+CallReturnValue ProfilerProto::trackAllocations(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
+{
+    if (nparams != 1) {
+        return CallReturnValue(Error::Code::WrongNumberOfParams);
+    }
+    
+    // Turning tracking on starts over. Turning it off keeps the sites for meminfo()
+    if (eu->stack().top().toBoolValue(eu)) {
+        AllocationTracker::clear();
+        AllocationTracker::start();
+    } else {
+        AllocationTracker::stop();
+    }
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 0);
+}
+
+// Optional param is the number of rows to show
+static CallReturnValue rowCount(ExecutionUnit* eu, uint32_t nparams, uint32_t& n)
+{
+    if (nparams > 1) {
+        return CallReturnValue(Error::Code::WrongNumberOfParams);
+    }
+    
+    if (nparams == 1) {
+        int32_t rows = eu->stack().top().toIntValue(eu);
+        if (rows <= 0) {
+            return CallReturnValue(Error::Code::InvalidArgumentValue);
+        }
+        n = static_cast<uint32_t>(rows);
+    }
+    return CallReturnValue();
+}
+
+CallReturnValue ProfilerProto::opcodeStats(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
+{
+    uint32_t n = 20;
+    CallReturnValue result = rowCount(eu, nparams, n);
+    if (result.isError()) {
+        return result;
+    }
+    
+    eu->stack().push(Value(ExecutionUnit::createString(OpcodeStats::table(n))));
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 1);
+}
+
+CallReturnValue ProfilerProto::annotatedCode(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
+{
+    uint32_t n = 10;
+    CallReturnValue result = rowCount(eu, nparams, n);
+    if (result.isError()) {
+        return result;
+    }
+    
+    CodePrinter printer;
+    eu->stack().push(Value(ExecutionUnit::createString(printer.generateAnnotatedCodeString(eu, n))));
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 1);
+}
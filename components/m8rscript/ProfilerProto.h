@@ -0,0 +1,35 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Object.h"
+
+namespace m8rscript {
+
+// Profiler.start(<intervalMs>), Profiler.stop() and Profiler.result(). The
+// result is the folded stacks of the samples taken since the last start.
+// Profiler.trackAllocations(true) starts charging allocations to script lines,
+// which are reported by meminfo(n). Profiler.opcodeStats(<n>) is the table of
+// opcode counts from a build with M8RSCRIPT_OPCODE_STATS and
+// Profiler.annotatedCode(<n>) is the disassembly with the count of each
+// instruction and the n hottest functions and blocks
+class ProfilerProto : public StaticObject {
+public:
+    ProfilerProto();
+
+    static m8r::CallReturnValue start(ExecutionUnit*, Value thisValue, uint32_t nparams);
+    static m8r::CallReturnValue stop(ExecutionUnit*, Value thisValue, uint32_t nparams);
+    static m8r::CallReturnValue result(ExecutionUnit*, Value thisValue, uint32_t nparams);
+    static m8r::CallReturnValue trackAllocations(ExecutionUnit*, Value thisValue, uint32_t nparams);
+    static m8r::CallReturnValue opcodeStats(ExecutionUnit*, Value thisValue, uint32_t nparams);
+    static m8r::CallReturnValue annotatedCode(ExecutionUnit*, Value thisValue, uint32_t nparams);
+};
+
+}
@@ -10,10 +10,13 @@
 #include "Program.h"
 
 #include "ExecutionUnit.h"
+#include "HeapSnapshot.h"
 
 using namespace m8rscript;
+using namespace m8r;
 
 Program::Program()
+    : _propertyEpoch(++_lastPropertyEpoch)
 {
     // Set a dummy 'consoleListener' property so it can be overwritten
     setProperty(SAtom(SA::consoleListener), Value::NullValue());
@@ -27,3 +30,83 @@ Program::Program()
 Program::~Program()
 {
 }
+
+// Epochs start past the one of an empty RefCache
+uint32_t Program::_lastPropertyEpoch = 0;
+
+bool Program::setProperty(const Atom& prop, const Value& v, Value::SetType type)
+{
+    uint32_t count = numProperties();
+    bool result = Function::setProperty(prop, v, type);
+    if (numProperties() != count) {
+        _propertyEpoch = ++_lastPropertyEpoch;
+    }
+    return result;
+}
+
+void Program::heapSnapshot(HeapSnapshot& snapshot) const
+{
+    Function::heapSnapshot(snapshot);
+    snapshot.setType("Program", sizeof(Program));
+    snapshot.addSize(static_cast<uint32_t>(_stringLiteralTable.size()) + _atomIndex.size() + _stringLiteralIndex.size());
+}
+
+Atom Program::atomizeString(const char* s, size_t length) const
+{
+    auto string = [this](uint16_t raw) { return _atomTable.stringFromAtom(Atom(raw)); };
+    uint32_t hash = StringIndex<uint16_t>::hash(s, length);
+    uint16_t raw;
+    if (_atomIndex.find(s, length, hash, raw, string)) {
+        return Atom(raw);
+    }
+    
+    // The AtomTable takes a '\0' terminated string
+    Atom atom;
+    if (s[length] == '\0') {
+        atom = _atomTable.atomizeString(s);
+    } else {
+        atom = _atomTable.atomizeString(String(s, static_cast<int32_t>(length)).c_str());
+    }
+    if (atom) {
+        _atomIndex.add(atom.raw(), hash, string);
+    }
+    return atom;
+}
+
+StringLiteral Program::addStringLiteral(const char* s)
+{
+    auto string = [this](uint32_t index) { return &(_stringLiteralTable[index]); };
+    size_t length = std::numeric_limits<size_t>::max();
+    uint32_t hash = StringIndex<uint32_t>::hash(s, length);
+    uint32_t index;
+    if (_stringLiteralIndex.find(s, length, hash, index, string)) {
+        return StringLiteral(StringLiteral::Raw(index));
+    }
+    
+    index = static_cast<uint32_t>(_stringLiteralTable.size());
+    _stringLiteralTable.resize(index + length + 1);
+    memcpy(&(_stringLiteralTable[index]), s, length + 1);
+    _stringLiteralIndex.add(index, hash, string);
+    return StringLiteral(StringLiteral::Raw(index));
+}
+
+void Program::endStringLiteral()
+{
+    _stringLiteralTable.push_back('\0');
+    
+    // A literal built a char at a time can't be interned, because its
+    // StringLiteral was handed out when it started. Index it so later ones
+    // can use it
+    size_t index = _stringLiteralTable.size() - 1;
+    while (index > 0 && _stringLiteralTable[index - 1] != '\0') {
+        --index;
+    }
+    
+    auto string = [this](uint32_t index) { return &(_stringLiteralTable[index]); };
+    size_t length = std::numeric_limits<size_t>::max();
+    uint32_t hash = StringIndex<uint32_t>::hash(&(_stringLiteralTable[index]), length);
+    uint32_t other;
+    if (!_stringLiteralIndex.find(&(_stringLiteralTable[index]), length, hash, other, string)) {
+        _stringLiteralIndex.add(static_cast<uint32_t>(index), hash, string);
+    }
+}
@@ -12,9 +12,66 @@
 #include "Atom.h"
 #include "Function.h"
 #include "Global.h"
+#include "OpenAddressing.h"
+#include <limits>
 
 namespace m8rscript {
 
+// StringIndex - Hash index of strings kept somewhere else
+//
+// A string is found with a probe of an OpenAddressing table, without
+// comparing it with the others or allocating. The strings stay where they
+// are, in the AtomTable or the string literal table, and are named by an id
+// of type T. Slots hold an id + 1, or 0 when empty. Hashes aren't kept, so
+// find() and add() take a function which returns the string of an id.
+template<typename T>
+class StringIndex {
+public:
+    static uint32_t hash(const char* s, size_t& length) { return OpenAddressing::hash(s, length); }
+    
+    template<typename F>
+    bool find(const char* s, size_t length, uint32_t hash, T& id, F string) const
+    {
+        const T* slot = OpenAddressing::find(_slots.empty() ? nullptr : &(_slots[0]), _slots.size(), hash, [s, length, &string](T slot) {
+            const char* other = string(static_cast<T>(slot - 1));
+            return strncmp(other, s, length) == 0 && other[length] == '\0';
+        });
+        if (!slot) {
+            return false;
+        }
+        id = static_cast<T>(*slot - 1);
+        return true;
+    }
+    
+    template<typename F>
+    void add(T id, uint32_t hash, F string)
+    {
+        size_t size = OpenAddressing::sizeToAdd(_count, _slots.size(), MinSlots);
+        if (size) {
+            m8r::Vector<T> slots;
+            slots.swap(_slots);
+            _slots.resize(size);
+            for (T slot : slots) {
+                if (slot) {
+                    size_t length = std::numeric_limits<size_t>::max();
+                    OpenAddressing::insert(&(_slots[0]), _slots.size(), StringIndex::hash(string(static_cast<T>(slot - 1)), length), slot);
+                }
+            }
+        }
+        
+        OpenAddressing::insert(&(_slots[0]), _slots.size(), hash, static_cast<T>(id + 1));
+        ++_count;
+    }
+    
+    uint32_t size() const { return static_cast<uint32_t>(_slots.size() * sizeof(T)); }
+    
+private:
+    static constexpr uint32_t MinSlots = 64;
+    
+    m8r::Vector<T> _slots;
+    uint32_t _count = 0;
+};
+
 class Program : public Function {
 public:
     Program();
@@ -24,48 +81,47 @@ public:
     {
         Function::gcMark();
     }
+    
+    virtual void heapSnapshot(HeapSnapshot&) const override;
 
     virtual m8r::String toString(ExecutionUnit* eu, bool typeOnly = false) const override { return typeOnly ? m8r::String("Program") : Function::toString(eu, false); }
 
+    virtual bool setProperty(const m8r::Atom& prop, const Value& v, Value::SetType type = Value::SetType::AddIfNeeded) override;
+
+    // Changes whenever a property is added to or removed from this Program,
+    // which is when the slots ThreadedCode::RefCache remembers can move.
+    // Epochs of every Program come from one counter, so a cache filled for a
+    // freed Program can't match a new one at the same address
+    uint32_t propertyEpoch() const { return _propertyEpoch; }
+
     const char* stringFromAtom(const m8r::Atom& atom) const { return _atomTable.stringFromAtom(atom); }
-    m8r::Atom atomizeString(const char* s) const { return _atomTable.atomizeString(s); }
+    m8r::Atom atomizeString(const char* s) const { return atomizeString(s, std::numeric_limits<size_t>::max()); }
+    
+    // Atomize the first length chars of s, or up to a '\0'. If the string
+    // is already an atom this doesn't allocate
+    m8r::Atom atomizeString(const char* s, size_t length) const;
 
     StringLiteral startStringLiteral() { return StringLiteral(StringLiteral::Raw(static_cast<uint32_t>(_stringLiteralTable.size()))); }
     void addToStringLiteral(char c) { _stringLiteralTable.push_back(c); }
-    void endStringLiteral() { _stringLiteralTable.push_back('\0'); }
+    void endStringLiteral();
     
-    StringLiteral addStringLiteral(const char* s)
-    {
-        size_t length = strlen(s);
-        size_t index = _stringLiteralTable.size();
-        _stringLiteralTable.resize(index + length + 1);
-        memcpy(&(_stringLiteralTable[index]), s, length + 1);
-        return StringLiteral(StringLiteral::Raw(static_cast<uint32_t>(index)));
-    }
+    // Literals are interned. Adding a string which is already in the table
+    // returns the one there, so equal literals anywhere in the program are
+    // the same StringLiteral
+    StringLiteral addStringLiteral(const char* s);
     const char* stringFromStringLiteral(const StringLiteral& id) const { return &(_stringLiteralTable[id.raw()]); }
+    StringLiteral stringLiteralFromString(const char* s) { return addStringLiteral(s); }
     
-    StringLiteral stringLiteralFromString(const char* s)
-    {
-        const char* table = &_stringLiteralTable[0];
-        size_t size = _stringLiteralTable.size();
-        
-        for (size_t i = 0; i < size; ) {
-            // Find the next string
-            if (strcmp(s, table + i) == 0) {
-                return StringLiteral(StringLiteral::Raw(static_cast<uint32_t>(i)));
-            }
-            
-            i += strlen(table + i) + 1;
-        }
-        
-        // Not found, add it
-        return addStringLiteral(s);
-    }
+private:
+    static uint32_t _lastPropertyEpoch;
     
-private:    
+    uint32_t _propertyEpoch;
+
     m8r::AtomTable _atomTable;
+    mutable StringIndex<uint16_t> _atomIndex;
     
     m8r::Vector<char> _stringLiteralTable;
+    StringIndex<uint32_t> _stringLiteralIndex;
 };
 
 }
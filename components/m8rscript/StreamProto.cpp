@@ -12,7 +12,7 @@
 using namespace m8rscript;
 using namespace m8r;
 
-static StaticObject::StaticFunctionProperty _functionProps[] =
+static const StaticObject::StaticFunctionProperty _functionProps[] =
 {
     { SA::constructor, StreamProto::constructor },
     { SA::eof, StreamProto::eof },
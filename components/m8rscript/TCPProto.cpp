@@ -10,29 +10,29 @@
 #include "TCPProto.h"
 
 #include "ExecutionUnit.h"
+#include "Metrics.h"
 #include "SystemInterface.h"
 #include "TCP.h"
 
 using namespace m8rscript;
 using namespace m8r;
 
-static StaticObject::StaticFunctionProperty _functionProps[] =
+static const StaticObject::StaticFunctionProperty _functionProps[] =
 {
     { SA::constructor, TCPProto::constructor },
-    { SA::send, TCPProto::send },
-    { SA::disconnect, TCPProto::disconnect },
     { SA::disconnect, TCPProto::disconnect },
+    { SA::send, TCPProto::send },
 };
 
-static StaticObject::StaticProperty _props[] =
+static const StaticObject::StaticProperty _props[] =
 {
-    { SA::Connected, Value(static_cast<int32_t>(TCP::Event::Connected)) },
-    { SA::Reconnected, Value(static_cast<int32_t>(TCP::Event::Reconnected)) },
-    { SA::Disconnected, Value(static_cast<int32_t>(TCP::Event::Disconnected)) },
-    { SA::Error, Value(static_cast<int32_t>(TCP::Event::Error)) },
-    { SA::ReceivedData, Value(static_cast<int32_t>(TCP::Event::ReceivedData)) },
-    { SA::SentData, Value(static_cast<int32_t>(TCP::Event::SentData)) },
-    { SA::MaxConnections, Value(static_cast<int32_t>(TCP::MaxConnections)) },
+    { SA::Connected, static_cast<int32_t>(TCP::Event::Connected) },
+    { SA::Disconnected, static_cast<int32_t>(TCP::Event::Disconnected) },
+    { SA::Error, static_cast<int32_t>(TCP::Event::Error) },
+    { SA::MaxConnections, static_cast<int32_t>(TCP::MaxConnections) },
+    { SA::ReceivedData, static_cast<int32_t>(TCP::Event::ReceivedData) },
+    { SA::Reconnected, static_cast<int32_t>(TCP::Event::Reconnected) },
+    { SA::SentData, static_cast<int32_t>(TCP::Event::SentData) },
 };
 
 TCPProto::TCPProto()
@@ -72,6 +72,12 @@ CallReturnValue TCPProto::constructor(ExecutionUnit* eu, Value thisValue, uint32
 
     Mad<TCP> tcp = system()->createTCP(port, ipAddr, 
     [thisValue, eu, func](TCP*, TCP::Event event, int16_t connectionId, const char* data, int16_t length) {
+        if (event == TCP::Event::Connected) {
+            Metrics::adjust(Metrics::Gauge::TCPConnectionsLive, 1);
+        } else if (event == TCP::Event::Disconnected) {
+            Metrics::adjust(Metrics::Gauge::TCPConnectionsLive, -1);
+        }
+        
         Value args[5];
         args[0] = thisValue;
         args[1] = Value(static_cast<int32_t>(event));
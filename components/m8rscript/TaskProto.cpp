@@ -12,11 +12,12 @@
 #include "ExecutionUnit.h"
 #include "SystemInterface.h"
 #include "TCP.h"
+#include "Trace.h"
 
 using namespace m8rscript;
 using namespace m8r;
 
-static StaticObject::StaticFunctionProperty _functionProps[] =
+static const StaticObject::StaticFunctionProperty _functionProps[] =
 {
     { SA::constructor, TaskProto::constructor },
     { SA::run, TaskProto::run },
@@ -130,8 +131,10 @@ CallReturnValue TaskProto::run(ExecutionUnit* eu, Value thisValue, uint32_t npar
     // Store func so it doesn't get gc'ed
     thisValue.setProperty(SAtom(SA::__object), func, Value::SetType::AddIfNeeded);
     
-    system()->taskManager()->run(task, [eu, func](Task* task)
+    uint16_t traceId = Trace::beginAsync(Trace::Span::Task);
+    system()->taskManager()->run(task, [eu, func, traceId](Task* task)
     {
+        Trace::endAsync(Trace::Span::Task, traceId);
         if (func) {
             Value arg(static_cast<int32_t>(task->error().code()));
             eu->fireEvent(func, Value(), &arg, 1);
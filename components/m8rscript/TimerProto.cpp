@@ -10,22 +10,23 @@
 #include "TimerProto.h"
 
 #include "ExecutionUnit.h"
+#include "Metrics.h"
 #include "Timer.h"
 
 using namespace m8rscript;
 using namespace m8r;
 
-static StaticObject::StaticFunctionProperty _functionProps[] =
+static const StaticObject::StaticFunctionProperty _functionProps[] =
 {
     { SA::constructor, TimerProto::constructor },
     { SA::start, TimerProto::start },
     { SA::stop, TimerProto::stop },
 };
 
-static StaticObject::StaticProperty _props[] =
+static const StaticObject::StaticProperty _props[] =
 {
-    { SA::Once, Value(static_cast<int32_t>(Timer::Behavior::Once)) },
-    { SA::Repeating, Value(static_cast<int32_t>(Timer::Behavior::Repeating)) },
+    { SA::Once, static_cast<int32_t>(Timer::Behavior::Once) },
+    { SA::Repeating, static_cast<int32_t>(Timer::Behavior::Repeating) },
 };
 
 TimerProto::TimerProto()
@@ -51,6 +52,7 @@ CallReturnValue TimerProto::constructor(ExecutionUnit* eu, Value thisValue, uint
     thisValue.setProperty(SAtom(SA::__object), func, Value::SetType::AddIfNeeded);
     
     Timer* timer = new Timer();
+    Metrics::adjust(Metrics::Gauge::TimersLive, 1);
     timer->setCallback([eu, func](Timer*)
     {
         if (func) {
@@ -66,6 +68,7 @@ CallReturnValue TimerProto::constructor(ExecutionUnit* eu, Value thisValue, uint
         Timer* timer = reinterpret_cast<Timer*>(thisValue.property(SAtom(SA::__impl)).asRawPointer());
         if (timer) {
             delete timer;
+            Metrics::adjust(Metrics::Gauge::TimersLive, -1);
             thisValue.setProperty(SAtom(SA::__impl), Value(), Value::SetType::AddIfNeeded);
         }
         return CallReturnValue(CallReturnValue::Type::ReturnCount, 0);
@@ -0,0 +1,257 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "Trace.h"
+
+#include "SystemTime.h"
+#include <cstdio>
+#include <cstring>
+
+using namespace m8rscript;
+using namespace m8r;
+
+bool Trace::_tracing = false;
+uint8_t Trace::_currentThread = 0;
+uint16_t Trace::_nextId = 0;
+Vector<Trace::Event> Trace::_events;
+uint32_t Trace::_nextEvent = 0;
+uint32_t Trace::_eventCount = 0;
+Vector<const void*> Trace::_threads;
+Vector<String> Trace::_userNames;
+Vector<Trace::UserSpan> Trace::_userSpans;
+
+struct SpanInfo {
+    const char* name;
+    const char* category;
+};
+
+static const SpanInfo spanInfo[] = {
+    { "quantum", "eu" },
+    { "ClearMarkedObj", "gc" },
+    { "ClearMarkedStr", "gc" },
+    { "MarkActive", "gc" },
+    { "MarkStatic", "gc" },
+    { "SweepObj", "gc" },
+    { "SweepStr", "gc" },
+    { "event", "event" },
+    { "delay", "delay" },
+    { "task", "task" },
+};
+
+static_assert(sizeof(spanInfo) / sizeof(SpanInfo) == static_cast<uint16_t>(Trace::Span::NumSpans), "spanInfo is wrong size");
+
+static constexpr uint16_t UserNameBase = static_cast<uint16_t>(Trace::Span::NumSpans);
+
+// Used for all user spans once MaxUserNames have been seen
+static constexpr uint16_t UserOverflowName = UserNameBase + Trace::MaxUserNames;
+
+void Trace::start(uint32_t capacity)
+{
+    clear();
+    _events.resize(capacity ? capacity : DefaultCapacity);
+    _tracing = true;
+}
+
+void Trace::clear()
+{
+    _events.clear();
+    _nextEvent = 0;
+    _eventCount = 0;
+    _threads.clear();
+    _userNames.clear();
+    _userSpans.clear();
+}
+
+Trace::Scope::Scope(const ExecutionUnit* eu)
+    : _prevThread(_currentThread)
+{
+    if (!_tracing) {
+        return;
+    }
+
+    // Units are given threads in the order they first run. The viewer only needs
+    // them to be distinct. Past the limit they share the system thread
+    _currentThread = 0;
+    for (uint32_t i = 0; i < _threads.size(); ++i) {
+        if (_threads[i] == eu) {
+            _currentThread = static_cast<uint8_t>(i + 1);
+            break;
+        }
+    }
+    if (!_currentThread && _threads.size() < MaxThreads) {
+        _threads.push_back(eu);
+        _currentThread = static_cast<uint8_t>(_threads.size());
+    }
+    begin(Span::Quantum);
+}
+
+Trace::Scope::~Scope()
+{
+    end(Span::Quantum);
+    _currentThread = _prevThread;
+}
+
+void Trace::record(uint16_t name, uint16_t id, char phase)
+{
+    if (_events.empty()) {
+        return;
+    }
+
+    Event& event = _events[_nextEvent];
+    event._ts = Time::now().us();
+    event._name = name;
+    event._id = id;
+    
+    // A unit running when tracing restarted has no thread until its next quantum
+    event._thread = (_currentThread <= _threads.size()) ? _currentThread : 0;
+    event._phase = phase;
+
+    if (++_nextEvent >= _events.size()) {
+        _nextEvent = 0;
+    }
+    if (_eventCount < _events.size()) {
+        ++_eventCount;
+    }
+}
+
+uint16_t Trace::recordAsync(uint16_t name, uint16_t id, char phase)
+{
+    if (!id) {
+        // 0 means no span, so skip it when the id wraps
+        if (++_nextId == 0) {
+            ++_nextId;
+        }
+        id = _nextId;
+    }
+    record(name, id, phase);
+    return id;
+}
+
+void Trace::beginUser(const char* name)
+{
+    if (!_tracing) {
+        return;
+    }
+
+    uint16_t index = 0;
+    for ( ; index < _userNames.size(); ++index) {
+        if (strcmp(_userNames[index].c_str(), name) == 0) {
+            break;
+        }
+    }
+    if (index == _userNames.size()) {
+        if (index < MaxUserNames) {
+            _userNames.push_back(String(name));
+        } else {
+            index = MaxUserNames;
+        }
+    }
+
+    uint16_t nameIndex = UserNameBase + index;
+    _userSpans.push_back({ nameIndex, recordAsync(nameIndex, 0, 'b') });
+}
+
+void Trace::endUser()
+{
+    if (_userSpans.empty()) {
+        return;
+    }
+
+    UserSpan span = _userSpans.back();
+    _userSpans.pop_back();
+    if (_tracing) {
+        recordAsync(span._name, span._id, 'e');
+    }
+}
+
+const char* Trace::name(uint16_t name)
+{
+    if (name < UserNameBase) {
+        return spanInfo[name].name;
+    }
+    return (name < UserOverflowName) ? _userNames[name - UserNameBase].c_str() : "user";
+}
+
+const char* Trace::category(uint16_t name)
+{
+    return (name < UserNameBase) ? spanInfo[name].category : "user";
+}
+
+// Names come from scripts, so escape anything that would break the string
+static void appendQuoted(String& s, const char* str)
+{
+    s += '"';
+    for ( ; *str; ++str) {
+        if (*str == '"' || *str == '\\') {
+            s += '\\';
+        }
+        s += (static_cast<uint8_t>(*str) < ' ') ? ' ' : *str;
+    }
+    s += '"';
+}
+
+String Trace::json()
+{
+    String s = "{\"traceEvents\":[";
+    char buf[80];
+    bool first = true;
+
+    for (uint32_t i = 0; i < _threads.size() + 1; ++i) {
+        snprintf(buf, sizeof(buf), "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":",
+                 first ? "" : ",\n", static_cast<unsigned>(i));
+        s += buf;
+        if (i == 0) {
+            s += "\"system\"";
+        } else {
+            snprintf(buf, sizeof(buf), "\"ExecutionUnit %u\"", static_cast<unsigned>(i));
+            s += buf;
+        }
+        s += "}}";
+        first = false;
+    }
+
+    // Depth of sync spans on each thread, to drop ends whose begins were overwritten
+    Vector<uint32_t> depth;
+    depth.resize(_threads.size() + 1);
+    for (uint32_t i = 0; i < depth.size(); ++i) {
+        depth[i] = 0;
+    }
+
+    uint32_t index = (_eventCount < _events.size()) ? 0 : _nextEvent;
+    for (uint32_t i = 0; i < _eventCount; ++i, ++index) {
+        if (index >= _events.size()) {
+            index = 0;
+        }
+        const Event& event = _events[index];
+        if (event._phase == 'B') {
+            depth[event._thread]++;
+        } else if (event._phase == 'E') {
+            if (depth[event._thread] == 0) {
+                continue;
+            }
+            depth[event._thread]--;
+        }
+
+        s += ",\n{\"name\":";
+        appendQuoted(s, name(event._name));
+        s += ",\"cat\":";
+        appendQuoted(s, category(event._name));
+        snprintf(buf, sizeof(buf), ",\"ph\":\"%c\",\"ts\":%llu,\"pid\":1,\"tid\":%u",
+                 event._phase, static_cast<unsigned long long>(event._ts), static_cast<unsigned>(event._thread));
+        s += buf;
+        if (event._id) {
+            snprintf(buf, sizeof(buf), ",\"id\":\"0x%x\"", static_cast<unsigned>(event._id));
+            s += buf;
+        }
+        s += "}";
+    }
+
+    s += "]}\n";
+    return s;
+}
@@ -0,0 +1,119 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Containers.h"
+
+namespace m8rscript {
+
+class ExecutionUnit;
+
+// Trace - Timestamped spans for a timeline of the event loop
+//
+// When tracing is on, spans are recorded into a fixed size ring buffer, so the
+// newest events are always kept. json() writes the buffer in the Chrome
+// trace_event format, which chrome://tracing and Perfetto load directly.
+//
+// There are two kinds of span. Quanta of execute() and GC phases begin and end
+// in the same call, so they are sync spans ('B' and 'E') on the thread of the
+// ExecutionUnit that is running. Events, delays, tasks and spans from the
+// script run across many quanta, so they are async spans ('b' and 'e') with an
+// id, which the viewer shows in their own rows. When the ring buffer wraps, a
+// sync end can lose its begin. json() drops those.
+//
+// When tracing is off the cost of each span is one test of a flag.
+class Trace {
+public:
+    enum class Span : uint16_t {
+        Quantum,
+        GCClearMarkedObj, GCClearMarkedStr, GCMarkActive, GCMarkStatic, GCSweepObj, GCSweepStr,
+        Event,
+        Delay,
+        Task,
+        NumSpans
+    };
+
+    static constexpr uint32_t DefaultCapacity = 512;
+    static constexpr uint32_t MaxUserNames = 32;
+    static constexpr uint32_t MaxThreads = 254;
+
+    static void start(uint32_t capacity = DefaultCapacity);
+    static void stop() { _tracing = false; }
+    static void clear();
+    static bool tracing() { return _tracing; }
+
+    // Sets the thread of the spans to the running unit and records the quantum
+    class Scope {
+    public:
+        Scope(const ExecutionUnit* eu);
+        ~Scope();
+
+    private:
+        uint8_t _prevThread;
+    };
+
+    // A sync span over the rest of a block
+    class SpanScope {
+    public:
+        SpanScope(Span span) : _span(span) { begin(span); }
+        ~SpanScope() { end(_span); }
+
+    private:
+        Span _span;
+    };
+
+    static void begin(Span span) { if (_tracing) { record(static_cast<uint16_t>(span), 0, 'B'); } }
+    static void end(Span span) { if (_tracing) { record(static_cast<uint16_t>(span), 0, 'E'); } }
+
+    // Returns the id to pass to endAsync, or 0 if not tracing
+    static uint16_t beginAsync(Span span) { return _tracing ? recordAsync(static_cast<uint16_t>(span), 0, 'b') : 0; }
+    static void endAsync(Span span, uint16_t id) { if (_tracing && id) { recordAsync(static_cast<uint16_t>(span), id, 'e'); } }
+
+    // Spans from trace.begin(name) and trace.end() in scripts. They nest, so end
+    // closes the last one begun
+    static void beginUser(const char* name);
+    static void endUser();
+
+    static m8r::String json();
+
+private:
+    struct Event {
+        uint64_t _ts;
+        uint16_t _name;
+        uint16_t _id;
+        uint8_t _thread;
+        char _phase;
+    };
+
+    struct UserSpan {
+        uint16_t _name;
+        uint16_t _id;
+    };
+
+    static void record(uint16_t name, uint16_t id, char phase);
+    static uint16_t recordAsync(uint16_t name, uint16_t id, char phase);
+    static const char* name(uint16_t);
+    static const char* category(uint16_t);
+
+    static bool _tracing;
+    static uint8_t _currentThread;
+    static uint16_t _nextId;
+
+    static m8r::Vector<Event> _events;
+    static uint32_t _nextEvent;
+    static uint32_t _eventCount;
+
+    // Index 0 is the thread of anything run outside an ExecutionUnit
+    static m8r::Vector<const void*> _threads;
+    static m8r::Vector<m8r::String> _userNames;
+    static m8r::Vector<UserSpan> _userSpans;
+};
+
+}
@@ -0,0 +1,89 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#include "TraceProto.h"
+
+#include "ExecutionUnit.h"
+#include "Trace.h"
+
+using namespace m8rscript;
+using namespace m8r;
+
+static const StaticObject::StaticFunctionProperty _functionProps[] =
+{
+    { SA::begin, TraceProto::begin },
+    { SA::end, TraceProto::end },
+    { SA::result, TraceProto::result },
+    { SA::start, TraceProto::start },
+    { SA::stop, TraceProto::stop },
+};
+
+TraceProto::TraceProto()
+{
+    setProperties(_functionProps, sizeof(_functionProps) / sizeof(StaticFunctionProperty));
+}
+
+CallReturnValue TraceProto::start(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
+{
+    if (nparams > 1) {
+        return CallReturnValue(Error::Code::WrongNumberOfParams);
+    }
+    
+    uint32_t capacity = Trace::DefaultCapacity;
+    if (nparams == 1) {
+        int32_t n = eu->stack().top().toIntValue(eu);
+        if (n <= 0) {
+            return CallReturnValue(Error::Code::InvalidArgumentValue);
+        }
+        capacity = static_cast<uint32_t>(n);
+    }
+    
+    Trace::start(capacity);
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 0);
+}
+
+CallReturnValue TraceProto::stop(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
+{
+    if (nparams != 0) {
+        return CallReturnValue(Error::Code::WrongNumberOfParams);
+    }
+    
+    Trace::stop();
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 0);
+}
+
+CallReturnValue TraceProto::result(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
+{
+    if (nparams != 0) {
+        return CallReturnValue(Error::Code::WrongNumberOfParams);
+    }
+    
+    eu->stack().push(Value(ExecutionUnit::createString(Trace::json())));
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 1);
+}
+
+CallReturnValue TraceProto::begin(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
+{
+    if (nparams != 1) {
+        return CallReturnValue(Error::Code::WrongNumberOfParams);
+    }
+    
+    Trace::beginUser(eu->stack().top().toStringValue(eu).c_str());
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 0);
+}
+
+CallReturnValue TraceProto::end(ExecutionUnit* eu, Value thisValue, uint32_t nparams)
+{
+    if (nparams != 0) {
+        return CallReturnValue(Error::Code::WrongNumberOfParams);
+    }
+    
+    Trace::endUser();
+    return CallReturnValue(CallReturnValue::Type::ReturnCount, 0);
+}
@@ -0,0 +1,30 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+#pragma once
+
+#include "Object.h"
+
+namespace m8rscript {
+
+// trace.start(<capacity>), trace.stop() and trace.result(). The result is the
+// spans in the ring buffer as Chrome trace_event JSON. trace.begin(name) and
+// trace.end() add spans of the script's own
+class TraceProto : public StaticObject {
+public:
+    TraceProto();
+
+    static m8r::CallReturnValue start(ExecutionUnit*, Value thisValue, uint32_t nparams);
+    static m8r::CallReturnValue stop(ExecutionUnit*, Value thisValue, uint32_t nparams);
+    static m8r::CallReturnValue result(ExecutionUnit*, Value thisValue, uint32_t nparams);
+    static m8r::CallReturnValue begin(ExecutionUnit*, Value thisValue, uint32_t nparams);
+    static m8r::CallReturnValue end(ExecutionUnit*, Value thisValue, uint32_t nparams);
+};
+
+}
@@ -106,12 +106,10 @@ Atom Value::_toIdValue(ExecutionUnit* eu) const
         case Type::Float: return eu->program()->atomizeString(toStringValue(eu).c_str());
         case Type::String: {
             const Mad<String> s = asString();
-            return s.valid() ? eu->program()->atomizeString(s->c_str()) : Atom();
-        }
-        case Type::StringLiteral: {
-            const String& s = eu->program()->stringFromStringLiteral(stringLiteralFromValue());
-            return eu->program()->atomizeString(s.c_str());
+            return s.valid() ? eu->program()->atomizeString(s->c_str(), s->size()) : Atom();
         }
+        case Type::StringLiteral:
+            return eu->program()->atomizeString(eu->program()->stringFromStringLiteral(stringLiteralFromValue()));
         case Type::Id:
         case Type::NativeObject:
         case Type::NativeFunction:
@@ -99,6 +99,13 @@ public:
     bool operator==(const Value& other) { return _value._type == other._value._type && _value._intptr == other._value._intptr; }
     bool operator!=(const Value& other) { return !(*this == other); }
     
+    // Values that are == have the same hash
+    uint32_t hash() const
+    {
+        uint64_t bits = static_cast<uint64_t>(_value._intptr);
+        return static_cast<uint32_t>(bits ^ (bits >> 32)) ^ (static_cast<uint32_t>(_value._type) << 24);
+    }
+    
     explicit operator bool() const { return type() != Type::Undefined; }
 
     ~Value() { }
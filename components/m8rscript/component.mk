@@ -10,8 +10,11 @@ COMPONENT_NAME := m8rscript
 COMPONENT_PRIV_INCLUDEDIRS := ../../../libm8r/components/libm8r
 
 COMPONENT_OBJS := \
+    AllocationTracker.o \
+    BufferedFileStream.o \
     Closure.o \
     CodePrinter.o \
+    CompileStats.o \
     ExecutionUnit.o \
     FSProto.o \
     Function.o \
@@ -19,15 +22,23 @@ COMPONENT_OBJS := \
     GeneratedValues.o \
     Global.o \
     GPIO.o \
+    HeapSnapshot.o \
     IPAddrProto.o \
     Iterator.o \
     JSONProto.o \
+    Metrics.o \
     Object.o \
+    OpcodeStats.o \
+    ParseArena.o \
     ParseEngine.o \
     Parser.o \
+    Profiler.o \
+    ProfilerProto.o \
     Program.o \
     StreamProto.o \
     TaskProto.o \
     TCPProto.o \
     TimerProto.o \
+    Trace.o \
+    TraceProto.o \
     Value.o \
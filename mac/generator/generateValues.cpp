@@ -13,6 +13,7 @@
 #include <string.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <algorithm>
 #include <string>
 #include <vector>
 
@@ -154,6 +155,10 @@ int main(int argc, const char* argv[])
     
     // Write the postambles
     fprintf(hfile, "};\n\n");
+    
+    // The enum is in sorted order from 0, so atoms below this are the
+    // shared ones, and tables keyed by SA can be sorted and searched
+    fprintf(hfile, "static constexpr uint16_t SharedAtomCount = %d;\n\n", static_cast<int32_t>(strings.size()));
     fprintf(hfile, "const char** sharedAtoms(uint16_t& nelts);\n");
     fprintf(hfile, "const char* specialChars();\n");
     fprintf(hfile, "static inline m8r::Atom SAtom(SA sa) { return m8r::Atom(static_cast<m8r::Atom::value_type>(sa)); }\n");
@@ -0,0 +1,189 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// Runs each script in scripts/benchmarks through an ExecutionUnit and prints
+// the results as a JSON array, with one object per benchmark:
+//
+//      {"name":"arith","runs":10,"median_ms":20.1,"p95_ms":21.7,"instructions":2800005,
+//       "objects":3,"strings":4,"gc_cycles":12,"gc_pause_us":310}
+//
+// Times are for the whole run, including waiting for events. The counts come
+// from Metrics and are the median over the runs, so they need a build with
+// M8RSCRIPT_METRICS. Script output is thrown away so printing doesn't count in
+// the time.
+//
+// This is the benchM8rscript target in mac/m8rscript.xcodeproj. Like
+// testM8rscript it links libm8rscript and libm8r, and is run from the top of
+// the repository so the scripts can be uploaded. M8R_BENCH_RUNS in the
+// environment sets the number of runs of each script (default 10).
+
+#include "Application.h"
+#include "BufferedFileStream.h"
+#include "ExecutionUnit.h"
+#include "Metrics.h"
+#include "SystemInterface.h"
+#include "SystemTime.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace m8rscript;
+
+static constexpr const char* BenchmarkRoot = "/bench";
+static constexpr uint32_t DefaultRuns = 10;
+
+m8r::Vector<const char*> fileList = {
+    "scripts/benchmarks/arith.m8r",
+    "scripts/benchmarks/array.m8r",
+    "scripts/benchmarks/closure.m8r",
+    "scripts/benchmarks/event.m8r",
+    "scripts/benchmarks/gc.m8r",
+    "scripts/benchmarks/json.m8r",
+    "scripts/benchmarks/method.m8r",
+    "scripts/benchmarks/property.m8r",
+    "scripts/benchmarks/string.m8r",
+    "scripts/benchmarks/switch.m8r",
+};
+
+struct Run {
+    double ms;
+    uint64_t instructions;
+    uint64_t objects;
+    uint64_t strings;
+    uint64_t gcCycles;
+    uint64_t gcPauseUs;
+};
+
+static uint64_t counter(Metrics::Counter c) { return Metrics::value(c); }
+
+static bool runOnce(m8r::Application& application, ExecutionUnit* eu, const char* path, Run& run)
+{
+    m8r::Mad<m8r::File> file = m8r::system()->fileSystem()->open(path, m8r::FS::FileOpenMode::Read);
+    if (!file.valid()) {
+        return false;
+    }
+
+    bool loaded = eu->load(BufferedFileStream(file));
+    file.destroy(m8r::MemoryType::Native);
+    if (!loaded) {
+        return false;
+    }
+
+    Run start = { 0, counter(Metrics::Counter::Instructions), counter(Metrics::Counter::ObjectsAllocated),
+                  counter(Metrics::Counter::StringsAllocated), counter(Metrics::Counter::GCCycles),
+                  counter(Metrics::Counter::GCPauseUs) };
+    uint64_t startUs = m8r::Time::now().us();
+
+    while (true) {
+        m8r::CallReturnValue r = eu->execute();
+        if (r.isFinished()) {
+            break;
+        }
+        if (r.isTerminated() || r.isError()) {
+            return false;
+        }
+
+        // Let timers and other events fire while the script waits
+        if (r.isDelay() || r.isWaitForEvent()) {
+            application.runOneIteration();
+        }
+    }
+
+    run.ms = static_cast<double>(m8r::Time::now().us() - startUs) / 1000;
+    run.instructions = counter(Metrics::Counter::Instructions) - start.instructions;
+    run.objects = counter(Metrics::Counter::ObjectsAllocated) - start.objects;
+    run.strings = counter(Metrics::Counter::StringsAllocated) - start.strings;
+    run.gcCycles = counter(Metrics::Counter::GCCycles) - start.gcCycles;
+    run.gcPauseUs = counter(Metrics::Counter::GCPauseUs) - start.gcPauseUs;
+    return true;
+}
+
+// Value at fraction p of the way through the sorted values
+template<typename T>
+static T percentile(std::vector<T> values, double p)
+{
+    std::sort(values.begin(), values.end());
+    size_t index = static_cast<size_t>(p * (values.size() - 1) + 0.5);
+    return values[index];
+}
+
+template<typename F>
+static uint64_t medianOf(const std::vector<Run>& runs, F field)
+{
+    std::vector<uint64_t> values;
+    for (const Run& run : runs) {
+        values.push_back(field(run));
+    }
+    return percentile(values, 0.5);
+}
+
+void m8rmain()
+{
+    m8r::Application application(m8r::Application::HeartbeatType::Status, BenchmarkRoot, 23);
+    m8r::Application::uploadFiles(fileList, BenchmarkRoot);
+
+    const char* runsString = getenv("M8R_BENCH_RUNS");
+    uint32_t runCount = runsString ? static_cast<uint32_t>(atoi(runsString)) : DefaultRuns;
+    if (runCount == 0) {
+        runCount = DefaultRuns;
+    }
+
+    // One unit runs everything. load() starts each script from a clean state
+    m8r::SharedPtr<ExecutionUnit> eu(new ExecutionUnit());
+    eu->setConsolePrintFunction([](const char*) { });
+
+    printf("[\n");
+    bool first = true;
+    for (const char* file : fileList) {
+        // Scripts are uploaded to the root under their base name
+        const char* baseName = strrchr(file, '/') ? (strrchr(file, '/') + 1) : file;
+        m8r::String path = m8r::String(BenchmarkRoot) + "/" + baseName;
+        m8r::String name(baseName);
+        name = name.slice(0, static_cast<int32_t>(name.size()) - 4);
+
+        std::vector<Run> runs;
+        for (uint32_t i = 0; i < runCount; ++i) {
+            Run run;
+            if (!runOnce(application, eu.get(), path.c_str(), run)) {
+                break;
+            }
+            runs.push_back(run);
+        }
+
+        printf("%s  ", first ? "" : ",\n");
+        first = false;
+
+        if (runs.size() != runCount) {
+            printf("{\"name\":\"%s\",\"error\":\"failed on run %d\"}", name.c_str(), static_cast<int>(runs.size()) + 1);
+            continue;
+        }
+
+        std::vector<double> times;
+        for (const Run& run : runs) {
+            times.push_back(run.ms);
+        }
+
+        printf("{\"name\":\"%s\",\"runs\":%u,\"median_ms\":%.3f,\"p95_ms\":%.3f,"
+               "\"instructions\":%llu,\"objects\":%llu,\"strings\":%llu,\"gc_cycles\":%llu,\"gc_pause_us\":%llu}",
+               name.c_str(), runCount, percentile(times, 0.5), percentile(times, 0.95),
+               static_cast<unsigned long long>(medianOf(runs, [](const Run& r) { return r.instructions; })),
+               static_cast<unsigned long long>(medianOf(runs, [](const Run& r) { return r.objects; })),
+               static_cast<unsigned long long>(medianOf(runs, [](const Run& r) { return r.strings; })),
+               static_cast<unsigned long long>(medianOf(runs, [](const Run& r) { return r.gcCycles; })),
+               static_cast<unsigned long long>(medianOf(runs, [](const Run& r) { return r.gcPauseUs; })));
+    }
+    printf("\n]\n");
+
+    // Units are never destroyed on the device, where m8rmain doesn't return.
+    // Leave without running the static destructors of the GC stores
+    fflush(stdout);
+    _Exit(0);
+}
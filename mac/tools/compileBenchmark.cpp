@@ -0,0 +1,258 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// Compiles sources with Parser::parse and prints the throughput as a JSON
+// array, with one object per source:
+//
+//      {"name":"mrsh","bytes":5120,"runs":20,"median_ms":1.40,"bytes_per_sec":3657142,
+//       "tokens_per_sec":812000,"functions_per_sec":21000,"peak_bytes":9216,
+//       "scan_pct":31.2,"productions_pct":61.0,"emit_pct":7.8}
+//
+// The sources are the scripts uploaded to /sys/bin by main/m8rscript.cpp,
+// except TestGibberish which doesn't parse, and a large synthetic one made of
+// many functions and classes. Each is read into
+// memory first, so file reads don't count. Only the parse is timed, not
+// running the program or collecting it afterward.
+//
+// Tokens, functions, peak memory and the split between scanning, ParseEngine
+// productions and emitDeferred/reconcileRegisters come from CompileStats, so
+// they are only printed in a build with M8RSCRIPT_COMPILE_STATS=1. Times from
+// that build are higher than from a normal one. Compare rates from the same
+// kind of build.
+//
+// This is the compileBenchM8rscript target in mac/m8rscript.xcodeproj. Like
+// testM8rscript it links libm8rscript and libm8r, and is run from the top of
+// the repository so the scripts can be uploaded. M8R_COMPILE_RUNS in the
+// environment sets the number of compiles of each source (default 20) and
+// M8R_COMPILE_UNITS the number of function and class pairs in the synthetic
+// source (default 50).
+// Each pair adds constants to the top level of the program, so much past 60
+// overflows its constant table.
+
+#include "Application.h"
+#include "BufferedFileStream.h"
+#include "CompileStats.h"
+#include "ExecutionUnit.h"
+#include "GC.h"
+#include "Parser.h"
+#include "StringStream.h"
+#include "SystemInterface.h"
+#include "SystemTime.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+using namespace m8rscript;
+
+static constexpr const char* UploadRoot = "/sys/bin";
+static constexpr uint32_t DefaultRuns = 20;
+static constexpr uint32_t DefaultUnits = 50;
+
+m8r::Vector<const char*> fileList = {
+    "scripts/mem.m8r",
+    "scripts/mrsh.m8r",
+    "scripts/examples/NTPClient.m8r",
+    "scripts/examples/TimeZoneDBClient.m8r",
+    "scripts/simple/basic.m8r",
+    "scripts/simple/blink.m8r",
+    "scripts/simple/hello.m8r",
+    "scripts/simple/simpleFunction.m8r",
+    "scripts/simple/simpleTest.m8r",
+    "scripts/simple/simpleTest2.m8r",
+    "scripts/timing/timing-esp.m8r",
+    "scripts/timing/timing.m8r",
+    "scripts/tests/TestBase64.m8r",
+    "scripts/tests/TestClass.m8r",
+    "scripts/tests/TestClosure.m8r",
+    "scripts/tests/TestGC.m8r",
+    "scripts/tests/TestIterator.m8r",
+    "scripts/tests/TestLoop.m8r",
+    "scripts/tests/TestRefCache.m8r",
+    "scripts/tests/TestSwitch.m8r",
+    "scripts/tests/TestTailCall.m8r",
+    "scripts/tests/TestTCPSocket.m8r",
+    "scripts/tests/TestUDPSocket.m8r",
+};
+
+// Each unit is a function and a class using most of the statement and
+// expression forms, so every part of the parser gets work
+static const char* unitFormat =
+    "function f%u(a, b)\n"
+    "{\n"
+    "    var sum = 0;\n"
+    "    for (var i = 0; i < a; ++i) {\n"
+    "        if (i %% 3 == 0) {\n"
+    "            sum += i * b;\n"
+    "        } else {\n"
+    "            sum -= b >> 1;\n"
+    "        }\n"
+    "    }\n"
+    "    while (sum > 1000) {\n"
+    "        sum = sum / 2;\n"
+    "    }\n"
+    "    switch (sum %% 4) {\n"
+    "        case 0: sum += 1;\n"
+    "        case 1: sum += 2;\n"
+    "        case 2: sum += 3;\n"
+    "        default: sum += 4;\n"
+    "    }\n"
+    "    var o = { name: \"f%u\", value: sum, list: [ 1, 2.5, \"three\" ] };\n"
+    "    var g = function(x) { return x + o.value; };\n"
+    "    return (a < b) ? g(o.list.length) : o.name + \":\" + sum;\n"
+    "}\n"
+    "\n"
+    "class C%u\n"
+    "{\n"
+    "    var _count = 0;\n"
+    "    var _name = \"C%u\";\n"
+    "\n"
+    "    constructor(n) { _count = n; }\n"
+    "\n"
+    "    function add(n) { _count += n; return _count; }\n"
+    "    function name() { return _name + \"/\" + _count; }\n"
+    "}\n"
+    "\n";
+
+static m8r::String syntheticSource(uint32_t units)
+{
+    m8r::String s;
+    char buf[1200];
+    for (uint32_t i = 0; i < units; ++i) {
+        snprintf(buf, sizeof(buf), unitFormat, i, i, i, i);
+        s += buf;
+    }
+    return s;
+}
+
+static bool readFile(const char* path, m8r::String& source)
+{
+    m8r::Mad<m8r::File> file = m8r::system()->fileSystem()->open(path, m8r::FS::FileOpenMode::Read);
+    if (!file.valid()) {
+        return false;
+    }
+
+    BufferedFileStream stream(file);
+    char buf[256];
+    while (true) {
+        int32_t size = stream.read(buf, sizeof(buf));
+        source += m8r::String(buf, size);
+        if (size < static_cast<int32_t>(sizeof(buf))) {
+            break;
+        }
+    }
+    file.destroy(m8r::MemoryType::Native);
+    return true;
+}
+
+static uint32_t envValue(const char* name, uint32_t defaultValue)
+{
+    const char* s = getenv(name);
+    uint32_t value = s ? static_cast<uint32_t>(atoi(s)) : 0;
+    return value ? value : defaultValue;
+}
+
+static void benchmark(ExecutionUnit* eu, const char* name, const m8r::String& source, uint32_t runCount, bool first)
+{
+    printf("%s  ", first ? "" : ",\n");
+
+    std::vector<double> times;
+    uint64_t ns[static_cast<uint8_t>(CompileStats::Phase::NumPhases)] = { };
+    uint64_t tokens = 0;
+    uint64_t functions = 0;
+    uint32_t peakBytes = 0;
+
+    for (uint32_t i = 0; i < runCount; ++i) {
+        m8r::StringStream stream(source);
+        CompileStats::clear();
+
+        uint64_t startUs = m8r::Time::now().us();
+        bool failed;
+        {
+            Parser parser;
+            parser.parse(stream, eu, Parser::debug);
+            failed = parser.nerrors() > 0;
+        }
+        times.push_back(static_cast<double>(m8r::Time::now().us() - startUs) / 1000);
+
+        if (failed) {
+            printf("{\"name\":\"%s\",\"error\":\"parse failed\"}", name);
+            return;
+        }
+
+        for (uint8_t phase = 0; phase < static_cast<uint8_t>(CompileStats::Phase::NumPhases); ++phase) {
+            ns[phase] += CompileStats::ns(static_cast<CompileStats::Phase>(phase));
+        }
+        tokens += CompileStats::tokens();
+        functions += CompileStats::functions();
+        peakBytes = std::max(peakBytes, CompileStats::peakBytes());
+
+        // Collect the program now so it isn't collected in the next run
+        GC::gc(true);
+    }
+
+    double totalSec = 0;
+    for (double ms : times) {
+        totalSec += ms / 1000;
+    }
+    std::sort(times.begin(), times.end());
+
+    printf("{\"name\":\"%s\",\"bytes\":%u,\"runs\":%u,\"median_ms\":%.3f,\"bytes_per_sec\":%.0f",
+           name, static_cast<uint32_t>(source.size()), runCount, times[times.size() / 2],
+           totalSec ? (static_cast<double>(source.size()) * runCount / totalSec) : 0.);
+
+    if (CompileStats::enabled()) {
+        double parseNs = static_cast<double>(ns[static_cast<uint8_t>(CompileStats::Phase::Parse)]);
+        double scanNs = static_cast<double>(ns[static_cast<uint8_t>(CompileStats::Phase::Scan)]);
+        double emitNs = static_cast<double>(ns[static_cast<uint8_t>(CompileStats::Phase::Emit)]);
+        double percent = parseNs ? (100 / parseNs) : 0;
+        printf(",\"tokens_per_sec\":%.0f,\"functions_per_sec\":%.0f,\"peak_bytes\":%u,"
+               "\"scan_pct\":%.1f,\"productions_pct\":%.1f,\"emit_pct\":%.1f",
+               totalSec ? (tokens / totalSec) : 0., totalSec ? (functions / totalSec) : 0., peakBytes,
+               scanNs * percent, (parseNs - scanNs - emitNs) * percent, emitNs * percent);
+    }
+    printf("}");
+}
+
+void m8rmain()
+{
+    m8r::Application application(m8r::Application::HeartbeatType::Status, UploadRoot, 23);
+    m8r::Application::uploadFiles(fileList, UploadRoot);
+
+    uint32_t runCount = envValue("M8R_COMPILE_RUNS", DefaultRuns);
+    uint32_t unitCount = envValue("M8R_COMPILE_UNITS", DefaultUnits);
+
+    // The parser needs a unit for errors and imports. Nothing is run in it
+    m8r::SharedPtr<ExecutionUnit> eu(new ExecutionUnit());
+
+    printf("[\n");
+    benchmark(eu.get(), "synthetic", syntheticSource(unitCount), runCount, true);
+
+    for (const char* file : fileList) {
+        // Scripts are uploaded to the root under their base name
+        const char* baseName = strrchr(file, '/') ? (strrchr(file, '/') + 1) : file;
+        m8r::String path = m8r::String(UploadRoot) + "/" + baseName;
+        m8r::String name(baseName);
+        name = name.slice(0, static_cast<int32_t>(name.size()) - 4);
+
+        m8r::String source;
+        if (!readFile(path.c_str(), source)) {
+            printf(",\n  {\"name\":\"%s\",\"error\":\"can't open\"}", name.c_str());
+            continue;
+        }
+        benchmark(eu.get(), name.c_str(), source, runCount, false);
+    }
+    printf("\n]\n");
+
+    // Units are never destroyed on the device, where m8rmain doesn't return.
+    // Leave without running the static destructors of the GC stores
+    fflush(stdout);
+    _Exit(0);
+}
@@ -0,0 +1,511 @@
+/*-------------------------------------------------------------------------
+    This source file is a part of m8rscript
+    For the latest info, see http:www.marrin.org/
+    Copyright (c) 2018-2020, Chris Marrin
+    All rights reserved.
+    Use of this source code is governed by the MIT license that can be
+    found in the LICENSE file.
+-------------------------------------------------------------------------*/
+
+// Reads a heap snapshot written by the heapSnapshot() script function (see
+// components/m8rscript/HeapSnapshot.h) and prints what is holding on to memory.
+//
+//      heapSnapshot [-n count] snapshot.txt [later.txt]
+//
+// For one snapshot it prints the totals by type and the objects with the largest
+// retained size, each with its dominator path from a root. The retained size of
+// an object is what would be freed if it were freed: its own size plus the size
+// of everything only reachable through it. With a second, later snapshot of the
+// same program it also prints the types that grew between the two, which is
+// usually where a slow leak shows up.
+//
+// This is the heapSnapshot target in mac/m8rscript.xcodeproj. It only uses the
+// standard library, so it also builds on its own with:
+//
+//      c++ -std=c++14 -O2 -o heapSnapshot heapSnapshot.cpp
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+// Just enough JSON to read one line of the snapshot
+struct JSONValue {
+    enum class Type { Null, Number, String, Array, Object };
+
+    const JSONValue* member(const char* name) const
+    {
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (keys[i] == name) {
+                return &values[i];
+            }
+        }
+        return nullptr;
+    }
+
+    Type type = Type::Null;
+    double number = 0;
+    std::string string;
+    std::vector<std::string> keys;
+    std::vector<JSONValue> values;
+};
+
+static void skipSpace(const char*& s)
+{
+    while (*s == ' ' || *s == '\t' || *s == '\r' || *s == '\n') {
+        ++s;
+    }
+}
+
+static bool parseString(const char*& s, std::string& out)
+{
+    if (*s != '"') {
+        return false;
+    }
+    for (++s; *s && *s != '"'; ++s) {
+        if (*s == '\\' && s[1]) {
+            ++s;
+        }
+        out += *s;
+    }
+    if (*s != '"') {
+        return false;
+    }
+    ++s;
+    return true;
+}
+
+static bool parseValue(const char*& s, JSONValue& value)
+{
+    skipSpace(s);
+    if (*s == '"') {
+        value.type = JSONValue::Type::String;
+        return parseString(s, value.string);
+    }
+    if (*s == '[' || *s == '{') {
+        bool isObject = *s == '{';
+        char close = isObject ? '}' : ']';
+        value.type = isObject ? JSONValue::Type::Object : JSONValue::Type::Array;
+        ++s;
+        skipSpace(s);
+        if (*s == close) {
+            ++s;
+            return true;
+        }
+        while (true) {
+            if (isObject) {
+                skipSpace(s);
+                value.keys.emplace_back();
+                if (!parseString(s, value.keys.back())) {
+                    return false;
+                }
+                skipSpace(s);
+                if (*s++ != ':') {
+                    return false;
+                }
+            }
+            value.values.emplace_back();
+            if (!parseValue(s, value.values.back())) {
+                return false;
+            }
+            skipSpace(s);
+            if (*s == ',') {
+                ++s;
+                continue;
+            }
+            if (*s++ != close) {
+                return false;
+            }
+            return true;
+        }
+    }
+    char* end;
+    value.number = strtod(s, &end);
+    if (end == s) {
+        return false;
+    }
+    value.type = JSONValue::Type::Number;
+    s = end;
+    return true;
+}
+
+struct Edge {
+    std::string kind;
+    std::string label;
+    uint32_t to;
+};
+
+struct Node {
+    std::string type;
+    std::string name;
+    uint64_t size = 0;
+    std::vector<Edge> edges;
+
+    // Filled in by computeDominators()
+    uint32_t idom = UINT32_MAX;
+    uint64_t retained = 0;
+};
+
+struct Snapshot {
+    // The last node is a synthetic root with an edge to every real root
+    std::vector<Node> nodes;
+
+    uint32_t root() const { return static_cast<uint32_t>(nodes.size() - 1); }
+
+    std::string description(uint32_t id) const
+    {
+        const Node& node = nodes[id];
+        std::string s = node.type;
+        if (!node.name.empty()) {
+            s += " " + node.name;
+        }
+        return s + " #" + std::to_string(id);
+    }
+};
+
+static bool readSnapshot(const char* filename, Snapshot& snapshot)
+{
+    FILE* f = fopen(filename, "r");
+    if (!f) {
+        fprintf(stderr, "can't open '%s'\n", filename);
+        return false;
+    }
+
+    std::vector<std::pair<std::string, uint32_t>> roots;
+    std::string line;
+    uint32_t lineno = 0;
+    int c;
+    do {
+        c = fgetc(f);
+        if (c != '\n' && c != EOF) {
+            line += static_cast<char>(c);
+            continue;
+        }
+        ++lineno;
+        if (line.empty()) {
+            continue;
+        }
+
+        JSONValue value;
+        const char* s = line.c_str();
+        if (!parseValue(s, value) || value.type != JSONValue::Type::Object) {
+            fprintf(stderr, "%s:%d: bad line\n", filename, lineno);
+            fclose(f);
+            return false;
+        }
+        line.clear();
+
+        if (const JSONValue* count = value.member("snapshot")) {
+            if (count->number != 1) {
+                fprintf(stderr, "%s: unknown snapshot version %g\n", filename, count->number);
+                fclose(f);
+                return false;
+            }
+            const JSONValue* nodes = value.member("nodes");
+            snapshot.nodes.resize(nodes ? static_cast<size_t>(nodes->number) + 1 : 1);
+        } else if (const JSONValue* id = value.member("id")) {
+            uint32_t index = static_cast<uint32_t>(id->number);
+            if (index >= snapshot.root()) {
+                fprintf(stderr, "%s:%d: node id out of range\n", filename, lineno);
+                fclose(f);
+                return false;
+            }
+            Node& node = snapshot.nodes[index];
+            if (const JSONValue* type = value.member("type")) {
+                node.type = type->string;
+            }
+            if (const JSONValue* name = value.member("name")) {
+                node.name = name->string;
+            }
+            if (const JSONValue* size = value.member("size")) {
+                node.size = static_cast<uint64_t>(size->number);
+            }
+            if (const JSONValue* edges = value.member("edges")) {
+                for (const JSONValue& edge : edges->values) {
+                    if (edge.values.size() != 3) {
+                        continue;
+                    }
+                    const JSONValue& label = edge.values[1];
+                    std::string labelString = (label.type == JSONValue::Type::Number) ? ("[" + std::to_string(static_cast<int>(label.number)) + "]") : label.string;
+                    node.edges.push_back({ edge.values[0].string, labelString, static_cast<uint32_t>(edge.values[2].number) });
+                }
+            }
+        } else if (const JSONValue* root = value.member("root")) {
+            const JSONValue* to = value.member("to");
+            if (to) {
+                roots.push_back({ root->string, static_cast<uint32_t>(to->number) });
+            }
+        }
+    } while (c != EOF);
+    fclose(f);
+
+    if (snapshot.nodes.empty()) {
+        fprintf(stderr, "%s: no snapshot header\n", filename);
+        return false;
+    }
+
+    Node& root = snapshot.nodes.back();
+    root.type = "(root)";
+    for (auto& it : roots) {
+        root.edges.push_back({ "root", it.first, it.second });
+    }
+
+    // Drop edges to nodes that aren't in the snapshot
+    for (Node& node : snapshot.nodes) {
+        node.edges.erase(std::remove_if(node.edges.begin(), node.edges.end(), [&snapshot](const Edge& edge) {
+            return edge.to >= snapshot.root();
+        }), node.edges.end());
+    }
+    return true;
+}
+
+// Dominators by the iterative algorithm of Cooper, Harvey and Kennedy,
+// "A Simple, Fast Dominance Algorithm". Nodes not reachable from the root
+// keep idom == UINT32_MAX.
+static void computeDominators(Snapshot& snapshot)
+{
+    uint32_t count = static_cast<uint32_t>(snapshot.nodes.size());
+    uint32_t root = snapshot.root();
+
+    // Postorder, without recursion since chains can be very long
+    std::vector<uint32_t> postorder;
+    std::vector<uint32_t> postIndex(count, UINT32_MAX);
+    std::vector<bool> visited(count, false);
+    std::vector<std::pair<uint32_t, size_t>> stack;
+    stack.push_back({ root, 0 });
+    visited[root] = true;
+    while (!stack.empty()) {
+        auto& top = stack.back();
+        const Node& node = snapshot.nodes[top.first];
+        if (top.second < node.edges.size()) {
+            uint32_t to = node.edges[top.second++].to;
+            if (!visited[to]) {
+                visited[to] = true;
+                stack.push_back({ to, 0 });
+            }
+            continue;
+        }
+        postIndex[top.first] = static_cast<uint32_t>(postorder.size());
+        postorder.push_back(top.first);
+        stack.pop_back();
+    }
+
+    std::vector<std::vector<uint32_t>> preds(count);
+    for (uint32_t i = 0; i < count; ++i) {
+        if (!visited[i]) {
+            continue;
+        }
+        for (const Edge& edge : snapshot.nodes[i].edges) {
+            preds[edge.to].push_back(i);
+        }
+    }
+
+    std::vector<uint32_t> idom(count, UINT32_MAX);
+    idom[root] = root;
+    auto intersect = [&](uint32_t a, uint32_t b) {
+        while (a != b) {
+            while (postIndex[a] < postIndex[b]) {
+                a = idom[a];
+            }
+            while (postIndex[b] < postIndex[a]) {
+                b = idom[b];
+            }
+        }
+        return a;
+    };
+
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (auto it = postorder.rbegin(); it != postorder.rend(); ++it) {
+            uint32_t n = *it;
+            if (n == root) {
+                continue;
+            }
+            uint32_t newIdom = UINT32_MAX;
+            for (uint32_t p : preds[n]) {
+                if (idom[p] == UINT32_MAX) {
+                    continue;
+                }
+                newIdom = (newIdom == UINT32_MAX) ? p : intersect(p, newIdom);
+            }
+            if (newIdom != idom[n]) {
+                idom[n] = newIdom;
+                changed = true;
+            }
+        }
+    }
+
+    // Children come before their dominator in postorder, so one pass sums retained sizes
+    for (uint32_t n : postorder) {
+        snapshot.nodes[n].idom = idom[n];
+        snapshot.nodes[n].retained += snapshot.nodes[n].size;
+        if (n != root) {
+            snapshot.nodes[idom[n]].retained += snapshot.nodes[n].retained;
+        }
+    }
+}
+
+static std::string edgeLabel(const Snapshot& snapshot, uint32_t from, uint32_t to)
+{
+    for (const Edge& edge : snapshot.nodes[from].edges) {
+        if (edge.to == to) {
+            return edge.label.empty() ? edge.kind : (edge.kind + " " + edge.label);
+        }
+    }
+    return "...";
+}
+
+static void printDominatorPath(const Snapshot& snapshot, uint32_t id)
+{
+    std::vector<uint32_t> path;
+    for (uint32_t n = id; n != snapshot.root(); n = snapshot.nodes[n].idom) {
+        path.push_back(n);
+    }
+    uint32_t from = snapshot.root();
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        printf("        --%s--> %s\n", edgeLabel(snapshot, from, *it).c_str(), snapshot.description(*it).c_str());
+        from = *it;
+    }
+}
+
+struct TypeTotal {
+    uint32_t count = 0;
+    uint64_t size = 0;
+};
+
+static std::map<std::string, TypeTotal> typeTotals(const Snapshot& snapshot)
+{
+    std::map<std::string, TypeTotal> totals;
+    for (uint32_t i = 0; i < snapshot.root(); ++i) {
+        const Node& node = snapshot.nodes[i];
+        TypeTotal& total = totals[node.name.empty() ? node.type : (node.type + " " + node.name)];
+        total.count++;
+        total.size += node.size;
+    }
+    return totals;
+}
+
+static void printSnapshot(const char* filename, const Snapshot& snapshot, uint32_t topCount)
+{
+    const Node& root = snapshot.nodes[snapshot.root()];
+    uint64_t totalSize = 0;
+    uint32_t unreachable = 0;
+    for (uint32_t i = 0; i < snapshot.root(); ++i) {
+        totalSize += snapshot.nodes[i].size;
+        if (snapshot.nodes[i].idom == UINT32_MAX) {
+            unreachable++;
+        }
+    }
+
+    printf("%s: %d nodes, %llu bytes, %llu reachable from %d roots\n", filename, static_cast<int>(snapshot.root()),
+           static_cast<unsigned long long>(totalSize), static_cast<unsigned long long>(root.retained - root.size),
+           static_cast<int>(root.edges.size()));
+    if (unreachable) {
+        printf("    %d nodes not reachable from any root\n", unreachable);
+    }
+
+    printf("\nBy type:\n");
+    auto totals = typeTotals(snapshot);
+    std::vector<std::pair<std::string, TypeTotal>> sortedTotals(totals.begin(), totals.end());
+    std::sort(sortedTotals.begin(), sortedTotals.end(), [](const std::pair<std::string, TypeTotal>& a, const std::pair<std::string, TypeTotal>& b) {
+        return a.second.size > b.second.size;
+    });
+    for (auto& it : sortedTotals) {
+        printf("    %8llu bytes %6d  %s\n", static_cast<unsigned long long>(it.second.size), it.second.count, it.first.c_str());
+    }
+
+    printf("\nLargest retained sizes:\n");
+    std::vector<uint32_t> ids;
+    for (uint32_t i = 0; i < snapshot.root(); ++i) {
+        if (snapshot.nodes[i].idom != UINT32_MAX) {
+            ids.push_back(i);
+        }
+    }
+    std::sort(ids.begin(), ids.end(), [&snapshot](uint32_t a, uint32_t b) {
+        return snapshot.nodes[a].retained > snapshot.nodes[b].retained;
+    });
+    if (ids.size() > topCount) {
+        ids.resize(topCount);
+    }
+    for (uint32_t id : ids) {
+        printf("    %8llu bytes  %s\n", static_cast<unsigned long long>(snapshot.nodes[id].retained), snapshot.description(id).c_str());
+        printDominatorPath(snapshot, id);
+    }
+}
+
+static void printGrowth(const Snapshot& before, const Snapshot& after)
+{
+    auto beforeTotals = typeTotals(before);
+    auto afterTotals = typeTotals(after);
+
+    struct Growth {
+        std::string type;
+        int64_t count;
+        int64_t size;
+    };
+    std::vector<Growth> growth;
+    for (auto& it : afterTotals) {
+        TypeTotal prev;
+        auto found = beforeTotals.find(it.first);
+        if (found != beforeTotals.end()) {
+            prev = found->second;
+        }
+        int64_t size = static_cast<int64_t>(it.second.size) - static_cast<int64_t>(prev.size);
+        if (size > 0) {
+            growth.push_back({ it.first, static_cast<int64_t>(it.second.count) - static_cast<int64_t>(prev.count), size });
+        }
+    }
+    std::sort(growth.begin(), growth.end(), [](const Growth& a, const Growth& b) { return a.size > b.size; });
+
+    printf("\nGrowth:\n");
+    if (growth.empty()) {
+        printf("    none\n");
+    }
+    for (auto& it : growth) {
+        printf("    %+8lld bytes %+6lld  %s\n", static_cast<long long>(it.size), static_cast<long long>(it.count), it.type.c_str());
+    }
+}
+
+int main(int argc, char * const argv[])
+{
+    uint32_t topCount = 10;
+    int opt;
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+            case 'n': topCount = static_cast<uint32_t>(atoi(optarg)); break;
+            default:
+                fprintf(stderr, "usage: heapSnapshot [-n count] snapshot [later snapshot]\n");
+                return 1;
+        }
+    }
+
+    if (optind >= argc || argc - optind > 2) {
+        fprintf(stderr, "usage: heapSnapshot [-n count] snapshot [later snapshot]\n");
+        return 1;
+    }
+
+    Snapshot snapshot;
+    if (!readSnapshot(argv[optind], snapshot)) {
+        return 1;
+    }
+    computeDominators(snapshot);
+
+    if (argc - optind == 1) {
+        printSnapshot(argv[optind], snapshot, topCount);
+        return 0;
+    }
+
+    Snapshot later;
+    if (!readSnapshot(argv[optind + 1], later)) {
+        return 1;
+    }
+    computeDominators(later);
+    printSnapshot(argv[optind + 1], later, topCount);
+    printGrowth(snapshot, later);
+    return 0;
+}
@@ -14,6 +14,9 @@
 static constexpr const char* WebServerRoot = "/sys/bin";
 static m8r::Duration MainTaskSleepDuration = 10ms;
 
+// Set to a sample interval in microseconds to profile every script
+static constexpr uint32_t ProfileIntervalUs = 0;
+
 m8r::Vector<const char*> fileList = {
     "scripts/mem.m8r",
     "scripts/mrsh.m8r",
@@ -31,9 +34,13 @@ m8r::Vector<const char*> fileList = {
     "scripts/tests/TestBase64.m8r",
     "scripts/tests/TestClass.m8r",
     "scripts/tests/TestClosure.m8r",
+    "scripts/tests/TestGC.m8r",
     "scripts/tests/TestGibberish.m8r",
     "scripts/tests/TestIterator.m8r",
     "scripts/tests/TestLoop.m8r",
+    "scripts/tests/TestRefCache.m8r",
+    "scripts/tests/TestSwitch.m8r",
+    "scripts/tests/TestTailCall.m8r",
     "scripts/tests/TestTCPSocket.m8r",
     "scripts/tests/TestUDPSocket.m8r",
 };
@@ -47,6 +54,7 @@ void m8rmain()
      // Upload files needed by web server
     m8r::Application::uploadFiles(fileList, WebServerRoot);
 
+    m8rscriptScriptingLanguage.setProfileInterval(ProfileIntervalUs);
     m8r::system()->registerScriptingLanguage(&m8rscriptScriptingLanguage);
 
     application.runAutostartTask("/sys/bin/hello.m8r");